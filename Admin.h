@@ -0,0 +1,265 @@
+#ifndef IOCPANDTHREADPOOL_ADMIN_H
+#define IOCPANDTHREADPOOL_ADMIN_H
+
+
+#include <Windows.h>
+
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+#include "Server.h"
+#include "Log.h"
+
+
+/*++
+    管理端口
+        在同一套引擎上单独启动一个 Server（默认只监听 127.0.0.1），按行接收命令：
+            stats               文本格式的快照
+            json                JSON 格式的快照
+            log [级别]          查看或设置日志级别：error/warn/info/debug
+            trace on|off        打开或关闭跟踪输出
+
+        快照包括线程池线程状态（空闲或忙、当前任务的执行时间）、等待队列和调度器队列深度、
+        连接数和每个连接的接收缓冲区、空闲连接占用的内存（Client::IdleFootprint，发送过数据的连接另加 SendStateFootprint）、
+        完成端口循环的计数和两次快照之间的速率。
+        所有数据读取的都是原子计数，只在线程池和连接表上短暂持锁（和已有的 GetMetrics 相同），
+        不暂停完成端口线程，也不向被观察的连接投递任务。
+
+            Server server("0.0.0.0",8000);
+            AdminEndpoint admin(server);
+            server.StartServer();
+            admin.Start();
+--*/
+
+
+
+class AdminEndpoint \
+        : public ThreadFuncBase
+{
+public:
+    enum {AdminMaxLine = 256};      // 超过长度还没有换行的数据视为错误
+
+public:
+    explicit AdminEndpoint(Server& target, const Endpoint& endpoint = Endpoint::Inet("127.0.0.1",9900)) \
+        : m_target(target), \
+          m_server(endpoint,ThreadPoolOptions(1)), \
+          m_lastTick(0), \
+          m_lastCompletions(0) \
+        {
+        m_server.SetMessageHandler(this,reinterpret_cast<MESSAGE_CALLBACK>(&AdminEndpoint::Consume));
+        }
+
+    ~AdminEndpoint() = default;
+
+    AdminEndpoint(const AdminEndpoint&) = delete;
+    AdminEndpoint& operator=(const AdminEndpoint&) = delete;
+
+    // 开始监听
+    bool Start() { return m_server.StartServer(); }
+
+    // 快照，也可以不经过网络直接调用
+    std::string TextSnapshot()
+        {
+        Snapshot snap = Collect();
+        std::string out;
+        Append(out,"pool threads=%zu idle=%zu peak=%zu queued=%zu queue_wait_ms=%llu grown=%zu retired=%zu stuck=%zu\n", \
+            snap.m_pool.m_threads,snap.m_pool.m_idleThreads,snap.m_pool.m_peakThreads,snap.m_pool.m_queued, \
+            snap.m_pool.m_queueWaitMs,snap.m_pool.m_grown,snap.m_pool.m_retired,snap.m_pool.m_stuck);
+        for(size_t i = 0; i != snap.m_threads.size(); ++i)
+            {
+            const ThreadState& state = snap.m_threads[i];
+            Append(out,"thread %zu %s busy_ms=%llu idle_ms=%llu%s%s\n", \
+                state.m_index,state.m_idle ? "idle" : "busy",state.m_busyMs,state.m_idleMs, \
+                state.m_stuck ? " stuck in " : "",state.m_stuck ? (state.m_label ? state.m_label : "-") : "");
+            }
+        Append(out,"scheduler active=%zu turns=%zu tasks=%zu skipped=%zu overruns=%zu\n", \
+            snap.m_scheduler.m_active,snap.m_scheduler.m_turns,snap.m_scheduler.m_tasks, \
+            snap.m_scheduler.m_skipped,snap.m_scheduler.m_overruns);
+        Append(out,"completion polls=%zu spin_hits=%zu blocks=%zu completions=%zu rate=%.1f/s\n", \
+            snap.m_completion.m_polls,snap.m_completion.m_spinHits,snap.m_completion.m_blocks, \
+            snap.m_completion.m_completions,snap.m_completionRate);
+        Append(out,"recv_buffers in_use_bytes=%zu acquired=%zu released=%zu parked=%zu grown=%zu oversized=%zu\n", \
+            snap.m_recv.m_bytesInUse,snap.m_recv.m_acquired,snap.m_recv.m_released, \
+            snap.m_recv.m_parked,snap.m_recv.m_grown,snap.m_recv.m_oversized);
+        Append(out,"connections count=%zu buffer_bytes=%zu idle_footprint=%zu send_state=%zu\n", \
+            snap.m_connections.size(),snap.m_bufferBytes,Client::IdleFootprint(),Client::SendStateFootprint());
+        for(size_t i = 0; i != snap.m_connections.size(); ++i)
+            {
+            const ConnectionStats& conn = snap.m_connections[i];
+            Append(out,"conn %llu buffer=%zu sending=%d backlog=%zu idle=%d weight=%u\n", \
+                static_cast<unsigned long long>(conn.m_sock),conn.m_bufferBytes, \
+                conn.m_sending ? 1 : 0,conn.m_sendBacklog,conn.m_idle ? 1 : 0,conn.m_weight);
+            }
+        Append(out,"admission overloaded=%d transitions=%zu paused=%zu rejected=%zu shed=%zu\n", \
+            snap.m_admission.m_overloaded ? 1 : 0,snap.m_admission.m_transitions,snap.m_admission.m_paused, \
+            snap.m_admission.m_rejected,snap.m_admission.m_shed);
+        Append(out,"log level=%s trace=%s\n",Log::LevelName(Log::GetLevel()),Log::IsTrace() ? "on" : "off");
+        return out;
+        }
+
+    std::string JsonSnapshot()
+        {
+        Snapshot snap = Collect();
+        std::string out = "{";
+        Append(out,"\"pool\":{\"threads\":%zu,\"idle\":%zu,\"peak\":%zu,\"queued\":%zu,\"queue_wait_ms\":%llu,\"grown\":%zu,\"retired\":%zu,\"stuck\":%zu},", \
+            snap.m_pool.m_threads,snap.m_pool.m_idleThreads,snap.m_pool.m_peakThreads,snap.m_pool.m_queued, \
+            snap.m_pool.m_queueWaitMs,snap.m_pool.m_grown,snap.m_pool.m_retired,snap.m_pool.m_stuck);
+        out += "\"threads\":[";
+        for(size_t i = 0; i != snap.m_threads.size(); ++i)
+            {
+            const ThreadState& state = snap.m_threads[i];
+            Append(out,"%s{\"index\":%zu,\"idle\":%s,\"busy_ms\":%llu,\"idle_ms\":%llu,\"stuck\":%s}",i ? "," : "", \
+                state.m_index,state.m_idle ? "true" : "false",state.m_busyMs,state.m_idleMs,state.m_stuck ? "true" : "false");
+            }
+        out += "],";
+        Append(out,"\"scheduler\":{\"active\":%zu,\"turns\":%zu,\"tasks\":%zu,\"skipped\":%zu,\"overruns\":%zu},", \
+            snap.m_scheduler.m_active,snap.m_scheduler.m_turns,snap.m_scheduler.m_tasks, \
+            snap.m_scheduler.m_skipped,snap.m_scheduler.m_overruns);
+        Append(out,"\"completion\":{\"polls\":%zu,\"spin_hits\":%zu,\"blocks\":%zu,\"completions\":%zu,\"rate\":%.1f},", \
+            snap.m_completion.m_polls,snap.m_completion.m_spinHits,snap.m_completion.m_blocks, \
+            snap.m_completion.m_completions,snap.m_completionRate);
+        Append(out,"\"recv_buffers\":{\"in_use_bytes\":%zu,\"acquired\":%zu,\"released\":%zu,\"parked\":%zu,\"grown\":%zu,\"oversized\":%zu},", \
+            snap.m_recv.m_bytesInUse,snap.m_recv.m_acquired,snap.m_recv.m_released, \
+            snap.m_recv.m_parked,snap.m_recv.m_grown,snap.m_recv.m_oversized);
+        Append(out,"\"connections\":{\"count\":%zu,\"buffer_bytes\":%zu,\"idle_footprint\":%zu,\"send_state\":%zu,\"items\":[", \
+            snap.m_connections.size(),snap.m_bufferBytes,Client::IdleFootprint(),Client::SendStateFootprint());
+        for(size_t i = 0; i != snap.m_connections.size(); ++i)
+            {
+            const ConnectionStats& conn = snap.m_connections[i];
+            Append(out,"%s{\"socket\":%llu,\"buffer\":%zu,\"sending\":%s,\"backlog\":%zu,\"idle\":%s,\"weight\":%u}",i ? "," : "", \
+                static_cast<unsigned long long>(conn.m_sock),conn.m_bufferBytes, \
+                conn.m_sending ? "true" : "false",conn.m_sendBacklog,conn.m_idle ? "true" : "false",conn.m_weight);
+            }
+        out += "]},";
+        Append(out,"\"admission\":{\"overloaded\":%s,\"transitions\":%zu,\"paused\":%zu,\"rejected\":%zu,\"shed\":%zu},", \
+            snap.m_admission.m_overloaded ? "true" : "false",snap.m_admission.m_transitions,snap.m_admission.m_paused, \
+            snap.m_admission.m_rejected,snap.m_admission.m_shed);
+        Append(out,"\"log\":{\"level\":\"%s\",\"trace\":%s}}\n",Log::LevelName(Log::GetLevel()),Log::IsTrace() ? "true" : "false");
+        return out;
+        }
+
+private:
+    struct Snapshot
+        {
+        ThreadPoolMetrics               m_pool;
+        std::vector<ThreadState>        m_threads;
+        FairSchedulerMetrics            m_scheduler;
+        CompletionLoopMetrics           m_completion;
+        double                          m_completionRate = 0;   // 距上次快照的每秒完成包数
+        RecvBufferMetrics               m_recv;
+        std::vector<ConnectionStats>    m_connections;
+        size_t                          m_bufferBytes = 0;
+        AdmissionMetrics                m_admission;
+        };
+
+    Snapshot Collect()
+        {
+        Snapshot snap;
+        snap.m_pool = m_target.GetPoolMetrics();
+        snap.m_threads = m_target.GetThreadStates();
+        snap.m_scheduler = m_target.GetSchedulerMetrics();
+        snap.m_completion = m_target.GetCompletionMetrics();
+        snap.m_recv = RecvBufferPool::GetMetrics();
+        snap.m_connections = m_target.GetConnectionStats();
+        snap.m_admission = m_target.GetAdmissionMetrics();
+        for(size_t i = 0; i != snap.m_connections.size(); ++i)
+            {
+            snap.m_bufferBytes += snap.m_connections[i].m_bufferBytes;
+            }
+
+        ULONGLONG now = GetTickCount64();
+        std::lock_guard<std::mutex> guard(m_lock);
+        if(m_lastTick && (now > m_lastTick))
+            {
+            snap.m_completionRate = (snap.m_completion.m_completions - m_lastCompletions) * 1000.0 / (now - m_lastTick);
+            }
+        m_lastTick = now;
+        m_lastCompletions = snap.m_completion.m_completions;
+        return snap;
+        }
+
+    // 处理完整的命令行，返回处理掉的字节数。
+    // 一行超过 AdminMaxLine 时断开连接并返回 -1，Client::Recv 归还缓冲区并注销连接
+    int Consume(Client* pClient, const char* data, size_t size)
+        {
+        size_t offset = 0;
+        for(;;)
+            {
+            const char* end = reinterpret_cast<const char*>(memchr(data + offset,'\n',size - offset));
+            if(!end && (size - offset > AdminMaxLine))
+                {
+                Log::Write(LogWarn,"admin: command line exceeds %d bytes, closing connection",static_cast<int>(AdminMaxLine));
+                pClient->Abort();
+                return -1;
+                }
+            if(!end)
+                {
+                return static_cast<int>(offset);
+                }
+            std::string line(data + offset,end);
+            offset = end - data + 1;
+            if(!line.empty() && ('\r' == line.back()))
+                {
+                line.pop_back();
+                }
+            std::string reply = Execute(line);
+            pClient->Send(&reply[0],reply.size());
+            }
+        }
+
+    // 执行一条命令
+    std::string Execute(const std::string& line)
+        {
+        if("stats" == line)
+            {
+            return TextSnapshot();
+            }
+        if("json" == line)
+            {
+            return JsonSnapshot();
+            }
+        if("log" == line)
+            {
+            return std::string(Log::LevelName(Log::GetLevel())) + "\n";
+            }
+        if(0 == line.compare(0,4,"log "))
+            {
+            return Log::SetLevel(line.c_str() + 4) ? "ok\n" : "error: level is error/warn/info/debug\n";
+            }
+        if(("trace on" == line) || ("trace off" == line))
+            {
+            Log::SetTrace("trace on" == line);
+            return "ok\n";
+            }
+        return "error: commands are stats, json, log [level], trace on|off\n";
+        }
+
+    static void Append(std::string& out, const char* format, ...)
+        {
+        char buf[512];
+        va_list args;
+        va_start(args,format);
+        int len = vsnprintf(buf,sizeof(buf),format,args);
+        va_end(args);
+        if(len > 0)
+            {
+            out.append(buf,(std::min)(static_cast<size_t>(len),sizeof(buf) - 1));
+            }
+        }
+
+private:
+    Server&         m_target;       // 被观察的 Server
+    Server          m_server;       // 管理端口
+    std::mutex      m_lock;         // 保护速率计算
+    ULONGLONG       m_lastTick;
+    size_t          m_lastCompletions;
+};
+
+
+#endif //IOCPANDTHREADPOOL_ADMIN_H
@@ -0,0 +1,177 @@
+#ifndef IOCPANDTHREADPOOL_ADMISSION_H
+#define IOCPANDTHREADPOOL_ADMISSION_H
+
+
+#include <Windows.h>
+
+
+#include <atomic>
+
+
+#include "Thread.h"
+#include "RecvBuffer.h"
+#include "Log.h"
+
+
+/*++
+    准入控制
+        过载时继续接受连接只会让所有队列一起变长，所有连接的延迟一起变差。
+        这里按两个信号判断过载：线程池等待队列队首的等待时间、接收缓冲区占用的内存。
+        任一信号超过上限进入过载，全部回到下限以下才退出（滞后），避免在阈值附近来回切换。
+
+        过载时：
+            1. 新连接：AdmissionPause 暂停投递 AcceptEx，连接留在内核的监听队列中，队列满后由内核拒绝；
+               AdmissionReject 接受后立即用 RST 关闭，客户端马上得到失败，可以重试其他节点
+            2. 低优先级的请求：处理函数对每个可以拒绝的请求调用 Server::Admit，
+               权重低于 m_shedBelowWeight 的连接返回 false，处理函数据此直接回复忙或者丢弃这个请求。
+               只按请求拒绝，不推迟整个连接：连接的接收（归还缓冲区）和发送完成照常处理，
+               否则被推迟的连接占着的缓冲区不会释放，内存信号永远不会回落
+
+        采样最多每 m_sampleMs 一次，由调用 IsOverloaded/Admit 的线程顺带完成，没有额外的线程。
+        默认关闭（m_highQueueWaitMs 和 m_highMemory 都为 0）。
+--*/
+
+
+enum
+{
+    AdmissionPause  = 0,    // 过载时暂停接受连接
+    AdmissionReject = 1     // 过载时接受后立即重置连接
+};
+
+
+struct AdmissionOptions
+{
+    ULONGLONG   m_highQueueWaitMs   = 0;    // 队首等待时间达到这个值进入过载，0 表示不检查
+    ULONGLONG   m_lowQueueWaitMs    = 0;    // 回到这个值以下才可以退出过载
+    size_t      m_highMemory        = 0;    // 接收缓冲区占用达到这个值进入过载，0 表示不检查
+    size_t      m_lowMemory         = 0;
+    UINT        m_shedBelowWeight   = 1;    // 过载时权重低于这个值的连接的请求被拒绝。连接的默认权重是 1，默认不拒绝
+    int         m_acceptPolicy      = AdmissionPause;
+    ULONGLONG   m_sampleMs          = 10;   // 采样间隔
+};
+
+
+struct AdmissionMetrics
+{
+    bool        m_overloaded    = false;
+    size_t      m_transitions   = 0;    // 进入过载的次数
+    size_t      m_paused        = 0;    // 暂停接受连接的次数
+    size_t      m_rejected      = 0;    // 重置的新连接
+    size_t      m_shed          = 0;    // 拒绝的低优先级工作
+    ULONGLONG   m_queueWaitMs   = 0;    // 最近一次采样的队首等待时间
+    size_t      m_memory        = 0;    // 最近一次采样的接收缓冲区占用
+};
+
+
+class AdmissionController
+{
+public:
+    explicit AdmissionController(ThreadPool* pPool) \
+        : m_pool(pPool), \
+          m_nextSample(0), \
+          m_overloaded(false) \
+        {  }
+
+    ~AdmissionController() = default;
+
+    AdmissionController(const AdmissionController&) = delete;
+    AdmissionController& operator=(const AdmissionController&) = delete;
+
+    // 需要在 StartServer 之前设置
+    void SetOptions(const AdmissionOptions& options)
+        {
+        m_options = options;
+        m_options.m_lowQueueWaitMs = (std::min)(m_options.m_lowQueueWaitMs,m_options.m_highQueueWaitMs);
+        m_options.m_lowMemory = (std::min)(m_options.m_lowMemory,m_options.m_highMemory);
+        }
+
+    const AdmissionOptions& GetOptions() const { return m_options; }
+
+    bool IsEnabled() const
+        { return m_options.m_highQueueWaitMs || m_options.m_highMemory; }
+
+    // 是否过载，到了采样时间先采样
+    bool IsOverloaded()
+        {
+        if(!IsEnabled())
+            {
+            return false;
+            }
+        ULONGLONG now = GetTickCount64();
+        ULONGLONG next = m_nextSample.load(std::memory_order_relaxed);
+        if((now >= next) && m_nextSample.compare_exchange_strong(next,now + m_options.m_sampleMs))
+            {
+            Sample();
+            }
+        return m_overloaded.load(std::memory_order_relaxed);
+        }
+
+    // 按权重决定是否接受一项工作
+    bool Admit(UINT weight)
+        {
+        if((weight >= m_options.m_shedBelowWeight) || !IsOverloaded())
+            {
+            return true;
+            }
+        ++m_shed;
+        return false;
+        }
+
+    void CountPaused() { ++m_paused; }
+    void CountRejected() { ++m_rejected; }
+
+    AdmissionMetrics GetMetrics()
+        {
+        AdmissionMetrics metrics;
+        metrics.m_overloaded = m_overloaded.load();
+        metrics.m_transitions = m_transitions.load();
+        metrics.m_paused = m_paused.load();
+        metrics.m_rejected = m_rejected.load();
+        metrics.m_shed = m_shed.load();
+        metrics.m_queueWaitMs = m_queueWaitMs.load();
+        metrics.m_memory = m_memory.load();
+        return metrics;
+        }
+
+private:
+    // 采样并按滞后规则切换状态，同一时刻只有一个线程执行
+    void Sample()
+        {
+        ULONGLONG wait = m_pool ? m_pool->GetMetrics().m_queueWaitMs : 0;
+        size_t memory = RecvBufferPool::GetMetrics().m_bytesInUse;
+        m_queueWaitMs.store(wait);
+        m_memory.store(memory);
+
+        bool bHigh = (m_options.m_highQueueWaitMs && (wait >= m_options.m_highQueueWaitMs)) \
+            || (m_options.m_highMemory && (memory >= m_options.m_highMemory));
+        bool bLow = (!m_options.m_highQueueWaitMs || (wait <= m_options.m_lowQueueWaitMs)) \
+            && (!m_options.m_highMemory || (memory <= m_options.m_lowMemory));
+
+        if(!m_overloaded.load() && bHigh)
+            {
+            m_overloaded.store(true);
+            ++m_transitions;
+            Log::Write(LogWarn,"admission: overloaded (queue wait %llu ms, recv buffers %zu bytes)",wait,memory);
+            }
+        else if(m_overloaded.load() && bLow)
+            {
+            m_overloaded.store(false);
+            Log::Write(LogInfo,"admission: recovered (queue wait %llu ms, recv buffers %zu bytes)",wait,memory);
+            }
+        }
+
+private:
+    ThreadPool*             m_pool;
+    AdmissionOptions        m_options;
+    std::atomic<ULONGLONG>  m_nextSample;
+    std::atomic<bool>       m_overloaded;
+    std::atomic<size_t>     m_transitions{0};
+    std::atomic<size_t>     m_paused{0};
+    std::atomic<size_t>     m_rejected{0};
+    std::atomic<size_t>     m_shed{0};
+    std::atomic<ULONGLONG>  m_queueWaitMs{0};
+    std::atomic<size_t>     m_memory{0};
+};
+
+
+#endif //IOCPANDTHREADPOOL_ADMISSION_H
@@ -0,0 +1,308 @@
+#ifndef IOCPANDTHREADPOOL_ARENA_H
+#define IOCPANDTHREADPOOL_ARENA_H
+
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+
+#include "Numa.h"
+
+
+/*++
+    按连接（或按请求）的线性分配器
+        解码消息和生成回复会分配大量小对象，全部走全局 new 时多个线程池线程会争用堆。
+        Arena 从内存块中顺序切分，释放是空操作，处理完一条消息后用 Reset 一次性归还：
+
+            {
+            ArenaScope scope(pClient->GetArena());
+            std::vector<Field, ArenaAllocator<Field>> fields(ArenaAllocator<Field>(scope.Get()));
+            ...
+            }   // 离开作用域时整体重置
+
+        内存块来自所有连接共享的 ArenaBlockPool，重置后回到池中给其他连接复用，
+        池中没有空闲块时才从 NumaHeap 分配（当前线程所在 NUMA 节点的内存）。
+        ArenaBlockPool::GetMetrics 中的 m_allocations 与 m_heapAllocs 之比就是少调用堆分配的倍数。
+        ArenaBench 用同一段消息处理对比 std::allocator 和 ArenaScope 下每条消息的堆分配次数。
+--*/
+
+
+
+// 分配计数
+struct ArenaMetrics
+{
+    size_t  m_allocations   = 0;    // Arena 分配的次数
+    size_t  m_bytes         = 0;    // Arena 分配的字节数
+    size_t  m_resets        = 0;    // 重置次数
+    size_t  m_heapAllocs    = 0;    // 向堆申请内存的次数（新块和超大分配）
+    size_t  m_blockReuses   = 0;    // 从池中复用块的次数
+    size_t  m_pooledBlocks  = 0;    // 池中空闲的块数
+};
+
+
+
+// 共享的内存块池
+class ArenaBlockPool
+{
+public:
+    enum
+        {
+        ABPBlockSize    = 32 * 1024,    // 块大小
+        ABPMaxPooled    = 1024          // 池中最多保留的空闲块
+        };
+
+public:
+    ArenaBlockPool() = default;
+    ~ArenaBlockPool()
+        {
+        for(size_t i = 0; i != m_free.size(); ++i)
+            {
+            NumaHeap::Free(m_free[i]);
+            }
+        }
+
+    ArenaBlockPool(const ArenaBlockPool&) = delete;
+    ArenaBlockPool& operator=(const ArenaBlockPool&) = delete;
+
+    // 所有 Arena 默认使用的池
+    static ArenaBlockPool& Shared()
+        {
+        static ArenaBlockPool pool;
+        return pool;
+        }
+
+    // 取一个 ABPBlockSize 大小的块
+    void* Acquire()
+        {
+        {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if(!m_free.empty())
+            {
+            void* ptr = m_free.back();
+            m_free.pop_back();
+            ++m_blockReuses;
+            return ptr;
+            }
+        }
+        ++m_heapAllocs;
+        return NumaHeap::Allocate(ABPBlockSize);
+        }
+
+    // 归还块，池满时释放
+    void Release(void* ptr)
+        {
+        {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if(m_free.size() < ABPMaxPooled)
+            {
+            m_free.push_back(ptr);
+            return;
+            }
+        }
+        NumaHeap::Free(ptr);
+        }
+
+    // 超大分配直接走堆，也计入分配次数
+    void* AllocateLarge(size_t size)
+        {
+        ++m_heapAllocs;
+        return NumaHeap::Allocate(size);
+        }
+
+    void FreeLarge(void* ptr)
+        { NumaHeap::Free(ptr); }
+
+    // Arena 汇报的计数
+    void Account(size_t allocations, size_t bytes)
+        {
+        m_allocations.fetch_add(allocations,std::memory_order_relaxed);
+        m_bytes.fetch_add(bytes,std::memory_order_relaxed);
+        m_resets.fetch_add(1,std::memory_order_relaxed);
+        }
+
+    ArenaMetrics GetMetrics()
+        {
+        ArenaMetrics metrics;
+        metrics.m_allocations = m_allocations.load();
+        metrics.m_bytes = m_bytes.load();
+        metrics.m_resets = m_resets.load();
+        metrics.m_heapAllocs = m_heapAllocs.load();
+        metrics.m_blockReuses = m_blockReuses.load();
+        std::lock_guard<std::mutex> guard(m_lock);
+        metrics.m_pooledBlocks = m_free.size();
+        return metrics;
+        }
+
+private:
+    std::mutex              m_lock;
+    std::vector<void*>      m_free;
+    std::atomic<size_t>     m_allocations{0};
+    std::atomic<size_t>     m_bytes{0};
+    std::atomic<size_t>     m_resets{0};
+    std::atomic<size_t>     m_heapAllocs{0};
+    std::atomic<size_t>     m_blockReuses{0};
+};
+
+
+
+// 线性分配器，不是线程安全的，同一时刻只能由一个线程使用（例如在连接的 strand 上）
+class Arena
+{
+public:
+    explicit Arena(ArenaBlockPool& pool = ArenaBlockPool::Shared()) \
+        : m_pool(pool), \
+          m_current(0), \
+          m_offset(0), \
+          m_allocations(0), \
+          m_bytes(0) \
+        {  }
+
+    ~Arena() { Trim(); }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // 分配，不会返回 nullptr
+    void* Allocate(size_t size, size_t align = alignof(std::max_align_t))
+        {
+        ++m_allocations;
+        m_bytes += size;
+        if(size > ArenaLargeSize)
+            {
+            void* ptr = m_pool.AllocateLarge(size);
+            m_large.push_back(ptr);
+            return ptr;
+            }
+        for(;;)
+            {
+            if(m_current < m_blocks.size())
+                {
+                // 按实际地址对齐，块本身只保证 16 字节对齐
+                uintptr_t base = reinterpret_cast<uintptr_t>(m_blocks[m_current]);
+                size_t offset = ((base + m_offset + align - 1) & ~(align - 1)) - base;
+                if(offset + size <= ArenaBlockPool::ABPBlockSize)
+                    {
+                    m_offset = offset + size;
+                    return reinterpret_cast<char*>(m_blocks[m_current]) + offset;
+                    }
+                ++m_current;
+                m_offset = 0;
+                continue;
+                }
+            m_blocks.push_back(m_pool.Acquire());
+            m_current = m_blocks.size() - 1;
+            m_offset = 0;
+            }
+        }
+
+    template<typename T, typename... Args>
+    T* New(Args&&... args)
+        { return new(Allocate(sizeof(T),alignof(T))) T(std::forward<Args>(args)...); }
+
+    // 整体重置。保留第一个块给下一条消息，其余的块归还到池中
+    void Reset()
+        {
+        if(m_allocations)
+            {
+            m_pool.Account(m_allocations,m_bytes);
+            }
+        for(size_t i = 0; i != m_large.size(); ++i)
+            {
+            m_pool.FreeLarge(m_large[i]);
+            }
+        m_large.clear();
+        while(m_blocks.size() > 1)
+            {
+            m_pool.Release(m_blocks.back());
+            m_blocks.pop_back();
+            }
+        m_current = 0;
+        m_offset = 0;
+        m_allocations = 0;
+        m_bytes = 0;
+        }
+
+    // 重置并归还所有块，用于连接进入空闲，空闲连接不占用块
+    void Trim()
+        {
+        Reset();
+        for(size_t i = 0; i != m_blocks.size(); ++i)
+            {
+            m_pool.Release(m_blocks[i]);
+            }
+        m_blocks.clear();
+        }
+
+    // 本轮（上次重置以来）的分配次数和字节数
+    size_t Allocations() const { return m_allocations; }
+    size_t Bytes() const { return m_bytes; }
+
+private:
+    enum
+        {
+        ArenaLargeSize  = ArenaBlockPool::ABPBlockSize / 4  // 超过的分配单独向堆申请
+        };
+
+    ArenaBlockPool&     m_pool;
+    std::vector<void*>  m_blocks;       // 使用中的块
+    std::vector<void*>  m_large;        // 超大分配
+    size_t              m_current;      // 当前块下标
+    size_t              m_offset;       // 当前块已使用的字节
+    size_t              m_allocations;
+    size_t              m_bytes;
+};
+
+
+
+// 标准库分配器适配，释放是空操作，内存在 Arena 重置时统一回收
+template<typename T>
+class ArenaAllocator
+{
+public:
+    typedef T value_type;
+
+    explicit ArenaAllocator(Arena& arena) noexcept : m_arena(&arena) {}
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) noexcept : m_arena(other.m_arena) {}
+
+    T* allocate(size_t n)
+        { return reinterpret_cast<T*>(m_arena->Allocate(n * sizeof(T),alignof(T))); }
+
+    void deallocate(T*, size_t) {}
+
+    template<typename U>
+    bool operator==(const ArenaAllocator<U>& other) const noexcept { return m_arena == other.m_arena; }
+    template<typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const noexcept { return m_arena != other.m_arena; }
+
+private:
+    template<typename U>
+    friend class ArenaAllocator;
+    Arena*  m_arena;
+};
+
+
+
+// 作用域结束时重置 Arena，用于一条消息的处理
+class ArenaScope
+{
+public:
+    explicit ArenaScope(Arena& arena) : m_arena(arena) {}
+    ~ArenaScope() { m_arena.Reset(); }
+
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+
+    Arena& Get() { return m_arena; }
+
+private:
+    Arena&  m_arena;
+};
+
+
+#endif //IOCPANDTHREADPOOL_ARENA_H
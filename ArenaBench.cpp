@@ -0,0 +1,194 @@
+/*++
+    Arena 分配次数对比
+        用同一个模拟的消息处理（拆分字段、建立索引、生成回复）分别跑两遍：
+        一遍用 std::allocator，一遍在 ArenaScope 中用 ArenaAllocator，报告每条消息的堆分配次数和耗时。
+        堆分配次数 = 全局 operator new 的调用次数 + ArenaBlockPool 向 NumaHeap 申请的次数。
+
+            ArenaBench [消息数] [每条消息的字段数]
+--*/
+
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+
+#include "Arena.h"
+
+
+// 全局 operator new 的调用次数
+static std::atomic<size_t> g_heapAllocs{0};
+
+
+void* operator new(size_t size)
+    {
+    g_heapAllocs.fetch_add(1,std::memory_order_relaxed);
+    void* ptr = malloc(size ? size : 1);
+    if(!ptr)
+        {
+        throw std::bad_alloc();
+        }
+    return ptr;
+    }
+
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+
+
+
+// 字段在消息中的位置
+struct BenchField
+{
+    size_t  m_offset;
+    size_t  m_length;
+};
+
+
+// 模拟一条消息的处理，Alloc 决定临时对象从哪里分配。返回回复的长度
+template<typename Alloc>
+size_t HandleMessage(const std::string& message, const Alloc& alloc)
+    {
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<BenchField>    FieldAlloc;
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<std::pair<const size_t, size_t>>   IndexAlloc;
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<char>  CharAlloc;
+
+    // 拆分字段
+    std::vector<BenchField, FieldAlloc> fields{FieldAlloc(alloc)};
+    size_t start = 0;
+    for(size_t i = 0; i <= message.size(); ++i)
+        {
+        if((i == message.size()) || (',' == message[i]))
+            {
+            fields.push_back(BenchField{start,i - start});
+            start = i + 1;
+            }
+        }
+
+    // 按字段内容的散列（FNV-1a）建立索引
+    std::map<size_t, size_t, std::less<size_t>, IndexAlloc> index{IndexAlloc(alloc)};
+    for(size_t i = 0; i != fields.size(); ++i)
+        {
+        size_t hash = 14695981039346656037ULL;
+        for(size_t j = 0; j != fields[i].m_length; ++j)
+            {
+            hash = (hash ^ static_cast<unsigned char>(message[fields[i].m_offset + j])) * 1099511628211ULL;
+            }
+        index.insert(std::make_pair(hash,i));
+        }
+
+    // 按索引顺序生成回复
+    std::vector<char, CharAlloc> reply{CharAlloc(alloc)};
+    typename std::map<size_t, size_t, std::less<size_t>, IndexAlloc>::const_iterator it = index.begin();
+    for(; it != index.end(); ++it)
+        {
+        const BenchField& field = fields[it->second];
+        reply.insert(reply.end(),message.data() + field.m_offset,message.data() + field.m_offset + field.m_length);
+        reply.push_back(';');
+        }
+    return reply.size();
+    }
+
+
+struct BenchResult
+{
+    size_t  m_heapAllocs    = 0;
+    double  m_elapsedMs     = 0;
+    size_t  m_checksum      = 0;    // 回复长度之和，防止被优化掉，两遍应该相同
+};
+
+
+static double Now()
+    {
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return now.QuadPart * 1000.0 / freq.QuadPart;
+    }
+
+
+static BenchResult RunStd(const std::vector<std::string>& messages)
+    {
+    BenchResult result;
+    size_t before = g_heapAllocs.load();
+    double start = Now();
+    for(size_t i = 0; i != messages.size(); ++i)
+        {
+        result.m_checksum += HandleMessage(messages[i],std::allocator<char>());
+        }
+    result.m_elapsedMs = Now() - start;
+    result.m_heapAllocs = g_heapAllocs.load() - before;
+    return result;
+    }
+
+
+static BenchResult RunArena(const std::vector<std::string>& messages, ArenaBlockPool& pool, Arena& arena)
+    {
+    BenchResult result;
+    size_t before = g_heapAllocs.load();
+    size_t poolBefore = pool.GetMetrics().m_heapAllocs;
+    double start = Now();
+    for(size_t i = 0; i != messages.size(); ++i)
+        {
+        // 和 Client::Recv 一样，每条消息一个 ArenaScope
+        ArenaScope scope(arena);
+        result.m_checksum += HandleMessage(messages[i],ArenaAllocator<char>(scope.Get()));
+        }
+    result.m_elapsedMs = Now() - start;
+    result.m_heapAllocs = g_heapAllocs.load() - before + pool.GetMetrics().m_heapAllocs - poolBefore;
+    return result;
+    }
+
+
+static void Report(const char* name, const BenchResult& result, size_t count)
+    {
+    printf("%-16s allocs/msg %8.3f   ns/msg %8.1f   total allocs %zu\n",name, \
+        static_cast<double>(result.m_heapAllocs) / count,result.m_elapsedMs * 1000000.0 / count,result.m_heapAllocs);
+    }
+
+
+
+int main(int argc, char* argv[])
+    {
+    size_t count = (argc > 1) ? static_cast<size_t>(atoll(argv[1])) : 100000;
+    size_t fieldCount = (argc > 2) ? static_cast<size_t>(atoll(argv[2])) : 16;
+    if(!count || !fieldCount)
+        {
+        fprintf(stderr,"usage: %s [messages] [fields per message]\n",argv[0]);
+        return 2;
+        }
+
+    // 消息在计时之前生成
+    std::vector<std::string> messages(count);
+    for(size_t i = 0; i != count; ++i)
+        {
+        for(size_t j = 0; j != fieldCount; ++j)
+            {
+            messages[i] += (j ? "," : "") + std::to_string(i * 7919 + j * 104729);
+            }
+        }
+
+    // 先各跑一遍预热，Arena 的第一个块在这里分配，之后和长期运行的连接一样复用
+    ArenaBlockPool pool;
+    Arena arena(pool);
+    RunStd(messages);
+    RunArena(messages,pool,arena);
+
+    BenchResult heapResult = RunStd(messages);
+    BenchResult arenaResult = RunArena(messages,pool,arena);
+    printf("messages %zu, %zu fields each\n",count,fieldCount);
+    Report("std::allocator",heapResult,count);
+    Report("ArenaScope",arenaResult,count);
+    if(heapResult.m_checksum != arenaResult.m_checksum)
+        {
+        fprintf(stderr,"checksum mismatch\n");
+        return 1;
+        }
+    return 0;
+    }
@@ -0,0 +1,317 @@
+#ifndef IOCPANDTHREADPOOL_CAPTURE_H
+#define IOCPANDTHREADPOOL_CAPTURE_H
+
+
+#include <Windows.h>
+
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+
+#include "FileCache.h"
+#include "Log.h"
+
+
+/*++
+    流量录制
+        把每个连接收到的数据按时间戳记录到内存映射文件中，用 Replay 工具按原来的时间间隔
+        （或者尽快）重放到本地的 Server，线上的问题就变成了可以重复运行的本地压测。
+
+        文件格式：CaptureFileHeader，之后是连续的帧，每帧 CaptureFrame + 数据，按 8 字节对齐。
+        写入时用一次原子加法预留空间，各个连接的 strand 并发写入不需要加锁；
+        帧头最后写 m_commit，读取时遇到没有写完的帧就停止。文件写满后丢弃新的帧并计数。
+
+            CaptureLog capture;
+            capture.Open("traffic.cap",256 * 1024 * 1024);
+            server.SetCapture(&capture);
+            server.StartServer();
+            ...
+            server.Drain(30000);
+            capture.Close();
+
+            Replay traffic.cap 127.0.0.1 8000 [--fast | --speed 2]
+--*/
+
+
+enum
+{
+    CaptureMagic        = 0x50414349,   // "ICAP"
+    CaptureVersion      = 1,
+    CaptureCommitted    = 0x434F4D54,   // 帧写完的标记
+    CaptureAlign        = 8
+};
+
+
+// 帧类型
+enum
+{
+    CaptureOpen     = 1,    // 连接建立，没有数据
+    CaptureData     = 2,    // 收到的数据
+    CaptureClose    = 3     // 连接关闭，没有数据
+};
+
+
+struct CaptureFileHeader
+{
+    uint32_t    m_magic;
+    uint32_t    m_version;
+    uint64_t    m_frequency;    // 时间戳的计数频率（QueryPerformanceFrequency）
+    uint64_t    m_used;         // 文件头和所有帧的长度，关闭时写入
+    uint64_t    m_dropped;      // 空间不足丢弃的帧数，关闭时写入
+};
+
+
+struct CaptureFrame
+{
+    uint64_t    m_ticks;        // 距离开始录制的计数周期
+    uint32_t    m_conn;         // 连接编号，从 1 开始
+    uint16_t    m_type;         // CaptureOpen/CaptureData/CaptureClose
+    uint16_t    m_reserved;
+    uint32_t    m_length;       // 数据长度，不包括帧头和对齐
+    uint32_t    m_commit;       // CaptureCommitted 表示已经写完
+};
+
+
+struct CaptureMetrics
+{
+    size_t  m_frames    = 0;
+    size_t  m_bytes     = 0;    // 数据字节数，不包括帧头
+    size_t  m_dropped   = 0;
+    size_t  m_used      = 0;    // 已经使用的文件空间
+    size_t  m_capacity  = 0;
+};
+
+
+
+// 录制文件，Open 之后可以在任意线程写入
+class CaptureLog
+{
+public:
+    CaptureLog() \
+        : m_hFile(INVALID_HANDLE_VALUE), \
+          m_hMapping(nullptr), \
+          m_pView(nullptr), \
+          m_capacity(0), \
+          m_start(0), \
+          m_offset(0), \
+          m_nextConn(1), \
+          m_enabled(false) \
+        {  }
+
+    ~CaptureLog() { Close(); }
+
+    CaptureLog(const CaptureLog&) = delete;
+    CaptureLog& operator=(const CaptureLog&) = delete;
+
+    // 创建文件并映射 capacity 字节，之前的内容被覆盖
+    bool Open(const std::string& path, size_t capacity)
+        {
+        Close();
+        capacity = (std::max)(capacity,sizeof(CaptureFileHeader));
+        m_hFile = CreateFile(path.c_str(), \
+            GENERIC_READ | GENERIC_WRITE, \
+            FILE_SHARE_READ, \
+            nullptr, \
+            CREATE_ALWAYS, \
+            FILE_ATTRIBUTE_NORMAL, \
+            nullptr);
+        if(INVALID_HANDLE_VALUE == m_hFile)
+            {
+            Log::Write(LogError,"capture: create %s failed [%lu]",path.c_str(),GetLastError());
+            return false;
+            }
+        ULONGLONG size = capacity;
+        m_hMapping = CreateFileMapping(m_hFile,nullptr,PAGE_READWRITE, \
+            static_cast<DWORD>(size >> 32),static_cast<DWORD>(size & 0xFFFFFFFF),nullptr);
+        if(m_hMapping)
+            {
+            m_pView = reinterpret_cast<char*>(MapViewOfFile(m_hMapping,FILE_MAP_WRITE,0,0,0));
+            }
+        if(!m_pView)
+            {
+            Log::Write(LogError,"capture: map %s failed [%lu]",path.c_str(),GetLastError());
+            Close();
+            return false;
+            }
+
+        LARGE_INTEGER freq, now;
+        QueryPerformanceFrequency(&freq);
+        QueryPerformanceCounter(&now);
+        CaptureFileHeader* pHeader = reinterpret_cast<CaptureFileHeader*>(m_pView);
+        pHeader->m_magic = CaptureMagic;
+        pHeader->m_version = CaptureVersion;
+        pHeader->m_frequency = static_cast<uint64_t>(freq.QuadPart);
+        pHeader->m_used = 0;
+        pHeader->m_dropped = 0;
+
+        m_capacity = capacity;
+        m_start = now.QuadPart;
+        m_offset.store(sizeof(CaptureFileHeader));
+        m_frames.store(0);
+        m_bytes.store(0);
+        m_dropped.store(0);
+        m_enabled.store(true);
+        return true;
+        }
+
+    // 写入长度，截掉没有使用的空间后关闭。关闭前需要停止所有写入（例如 Server::Drain 之后）
+    void Close()
+        {
+        m_enabled.store(false);
+        if(m_pView)
+            {
+            CaptureFileHeader* pHeader = reinterpret_cast<CaptureFileHeader*>(m_pView);
+            pHeader->m_used = (std::min)(m_offset.load(),m_capacity);
+            pHeader->m_dropped = m_dropped.load();
+            LARGE_INTEGER used;
+            used.QuadPart = static_cast<LONGLONG>(pHeader->m_used);
+            UnmapViewOfFile(m_pView);
+            m_pView = nullptr;
+            CloseHandle(m_hMapping);
+            m_hMapping = nullptr;
+            if(SetFilePointerEx(m_hFile,used,nullptr,FILE_BEGIN))
+                {
+                SetEndOfFile(m_hFile);
+                }
+            }
+        if(m_hMapping)
+            {
+            CloseHandle(m_hMapping);
+            m_hMapping = nullptr;
+            }
+        if(m_hFile != INVALID_HANDLE_VALUE)
+            {
+            CloseHandle(m_hFile);
+            m_hFile = INVALID_HANDLE_VALUE;
+            }
+        }
+
+    // 暂停或者恢复录制，不影响已经写入的帧
+    void SetEnabled(bool bEnabled) { m_enabled.store(bEnabled && m_pView); }
+    bool IsEnabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+    // 新连接的编号
+    uint32_t NextConnection() { return m_nextConn.fetch_add(1,std::memory_order_relaxed); }
+
+    // 写一帧，空间不足或者没有打开时返回 false
+    bool Write(uint32_t conn, uint16_t type, const void* data = nullptr, size_t size = 0)
+        {
+        if(!IsEnabled())
+            {
+            return false;
+            }
+        size_t total = (sizeof(CaptureFrame) + size + CaptureAlign - 1) & ~static_cast<size_t>(CaptureAlign - 1);
+        size_t offset = m_offset.fetch_add(total,std::memory_order_relaxed);
+        if(offset + total > m_capacity)
+            {
+            // 预留失败的空间不再使用，读取时在这里停止
+            m_dropped.fetch_add(1,std::memory_order_relaxed);
+            return false;
+            }
+
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        CaptureFrame* pFrame = reinterpret_cast<CaptureFrame*>(m_pView + offset);
+        pFrame->m_ticks = static_cast<uint64_t>(now.QuadPart - m_start);
+        pFrame->m_conn = conn;
+        pFrame->m_type = type;
+        pFrame->m_reserved = 0;
+        pFrame->m_length = static_cast<uint32_t>(size);
+        if(size)
+            {
+            memcpy(pFrame + 1,data,size);
+            }
+        std::atomic_thread_fence(std::memory_order_release);
+        pFrame->m_commit = CaptureCommitted;
+
+        m_frames.fetch_add(1,std::memory_order_relaxed);
+        m_bytes.fetch_add(size,std::memory_order_relaxed);
+        return true;
+        }
+
+    CaptureMetrics GetMetrics() const
+        {
+        CaptureMetrics metrics;
+        metrics.m_frames = m_frames.load();
+        metrics.m_bytes = m_bytes.load();
+        metrics.m_dropped = m_dropped.load();
+        metrics.m_used = (std::min)(m_offset.load(),m_capacity);
+        metrics.m_capacity = m_capacity;
+        return metrics;
+        }
+
+private:
+    HANDLE                  m_hFile;
+    HANDLE                  m_hMapping;
+    char*                   m_pView;
+    size_t                  m_capacity;
+    LONGLONG                m_start;        // 开始录制的计数
+    std::atomic<size_t>     m_offset;       // 下一帧的位置
+    std::atomic<uint32_t>   m_nextConn;
+    std::atomic<bool>       m_enabled;
+    std::atomic<size_t>     m_frames{0};
+    std::atomic<size_t>     m_bytes{0};
+    std::atomic<size_t>     m_dropped{0};
+};
+
+
+
+// 按顺序读取录制文件中的帧
+class CaptureReader
+{
+public:
+    CaptureReader() : m_offset(0), m_end(0) {}
+
+    bool Open(const std::string& path)
+        {
+        m_blob = MappedBlob::Open(path);
+        if(!m_blob || (m_blob->Size() < sizeof(CaptureFileHeader)))
+            {
+            return false;
+            }
+        const CaptureFileHeader* pHeader = Header();
+        if((CaptureMagic != pHeader->m_magic) || (CaptureVersion != pHeader->m_version))
+            {
+            return false;
+            }
+        // 没有正常关闭的文件没有 m_used，读到没有写完的帧为止
+        m_end = pHeader->m_used ? (std::min)(static_cast<size_t>(pHeader->m_used),m_blob->Size()) : m_blob->Size();
+        m_offset = sizeof(CaptureFileHeader);
+        return true;
+        }
+
+    const CaptureFileHeader* Header() const
+        { return reinterpret_cast<const CaptureFileHeader*>(m_blob->Data()); }
+
+    // 下一帧，没有了返回 nullptr。数据紧跟在帧头后面
+    const CaptureFrame* Next()
+        {
+        if(m_offset + sizeof(CaptureFrame) > m_end)
+            {
+            return nullptr;
+            }
+        const CaptureFrame* pFrame = reinterpret_cast<const CaptureFrame*>(m_blob->Data() + m_offset);
+        size_t total = (sizeof(CaptureFrame) + pFrame->m_length + CaptureAlign - 1) & ~static_cast<size_t>(CaptureAlign - 1);
+        if((CaptureCommitted != pFrame->m_commit) || (m_offset + total > m_end))
+            {
+            return nullptr;
+            }
+        m_offset += total;
+        return pFrame;
+        }
+
+    static const char* Data(const CaptureFrame* pFrame)
+        { return reinterpret_cast<const char*>(pFrame + 1); }
+
+private:
+    PTR_BLOB    m_blob;
+    size_t      m_offset;
+    size_t      m_end;
+};
+
+
+#endif //IOCPANDTHREADPOOL_CAPTURE_H
@@ -0,0 +1,475 @@
+#ifndef IOCPANDTHREADPOOL_COROUTINE_H
+#define IOCPANDTHREADPOOL_COROUTINE_H
+
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+
+#include "Server.h"
+
+
+/*++
+    C++20 协程接口
+        业务逻辑可以写成顺序代码：
+
+            Task<> Session(Server& server)
+                {
+                Client* pClient = co_await AsyncAccept(server);
+                char buf[64];
+                int n = co_await AsyncReadExactly(pClient,buf,sizeof(buf));
+                if(n > 0)
+                    {
+                    co_await AsyncWrite(pClient,buf,n);
+                    }
+                }
+
+            CoSpawn(Session(server));
+
+        I/O 返回值和 recv/send 保持一致：>0 为字节数，0 表示对端关闭，SOCKET_ERROR 表示失败，
+        错误码通过 WSAGetLastError() 获取。
+        等待对象存放在协程帧中，协程帧从 FramePool 中分配，每一步都不需要额外的堆分配。
+--*/
+
+
+
+/*++
+    协程帧内存池
+        按 64 字节分级的线程本地空闲链表，超过 2KB 的帧直接走全局 new。
+        协程可能在别的线程上结束，释放的内存块会留在释放它的线程上继续复用。
+--*/
+class FramePool
+{
+public:
+    FramePool() = delete;
+    ~FramePool() = delete;
+public:
+    static void* Allocate(size_t size)
+        {
+        size_t index = IndexOf(size);
+        if(index >= FPClasses)
+            {
+            return ::operator new(size);
+            }
+        Cache& cache = Local();
+        Node* pNode = cache.m_head[index];
+        if(pNode)
+            {
+            cache.m_head[index] = pNode->m_next;
+            --cache.m_count[index];
+            return pNode;
+            }
+        return ::operator new((index + 1) * FPGranularity);
+        }
+
+    static void Deallocate(void* ptr, size_t size)
+        {
+        size_t index = IndexOf(size);
+        Cache& cache = Local();
+        if(index >= FPClasses || cache.m_count[index] >= FPMaxCached)
+            {
+            ::operator delete(ptr);
+            return;
+            }
+        Node* pNode = reinterpret_cast<Node*>(ptr);
+        pNode->m_next = cache.m_head[index];
+        cache.m_head[index] = pNode;
+        ++cache.m_count[index];
+        }
+
+private:
+    enum
+        {
+        FPGranularity   = 64,   // 分级粒度
+        FPClasses       = 32,   // 分级数量，最大 2KB
+        FPMaxCached     = 256   // 每一级最多缓存的块数
+        };
+
+    struct Node
+        {
+        Node*   m_next;
+        };
+
+    struct Cache
+        {
+        Node*   m_head[FPClasses]  = {};
+        size_t  m_count[FPClasses] = {};
+        ~Cache()
+            {
+            for(size_t i = 0; i != FPClasses; ++i)
+                {
+                while(m_head[i])
+                    {
+                    Node* pNode = m_head[i];
+                    m_head[i] = pNode->m_next;
+                    ::operator delete(pNode);
+                    }
+                }
+            }
+        };
+
+    static size_t IndexOf(size_t size)
+        { return (size + FPGranularity - 1) / FPGranularity - 1; }
+
+    static Cache& Local()
+        {
+        thread_local Cache cache;
+        return cache;
+        }
+};
+
+
+
+template<typename T = void>
+class Task;
+
+
+// promise 公共部分
+class TaskPromiseBase
+{
+public:
+    // 协程结束时，有等待者则直接切换到等待者（对称转移），被分离的协程自行销毁
+    struct FinalAwaiter
+        {
+        bool await_ready() noexcept { return false; }
+
+        template<typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+            {
+            TaskPromiseBase& promise = handle.promise();
+            if(promise.m_continuation)
+                {
+                return promise.m_continuation;
+                }
+            if(promise.m_detached)
+                {
+                if(promise.m_exception)
+                    {
+                    std::cerr << "detached coroutine exited with an exception!" << std::endl;
+                    }
+                handle.destroy();
+                }
+            return std::noop_coroutine();
+            }
+
+        void await_resume() noexcept {}
+        };
+
+public:
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { m_exception = std::current_exception(); }
+
+    // 协程帧从内存池分配
+    static void* operator new(size_t size) { return FramePool::Allocate(size); }
+    static void operator delete(void* ptr, size_t size) { FramePool::Deallocate(ptr,size); }
+
+public:
+    std::coroutine_handle<>     m_continuation;     // 等待本协程的协程
+    std::exception_ptr          m_exception;
+    bool                        m_detached = false; // 由 CoSpawn 启动，结束后自行销毁
+};
+
+
+template<typename T>
+class TaskPromise \
+        : public TaskPromiseBase
+{
+public:
+    Task<T> get_return_object();
+
+    template<typename U>
+    void return_value(U&& value) { m_value.emplace(std::forward<U>(value)); }
+
+    T Result()
+        {
+        if(m_exception)
+            {
+            std::rethrow_exception(m_exception);
+            }
+        return std::move(*m_value);
+        }
+private:
+    std::optional<T>    m_value;
+};
+
+
+template<>
+class TaskPromise<void> \
+        : public TaskPromiseBase
+{
+public:
+    Task<void> get_return_object();
+
+    void return_void() {}
+
+    void Result()
+        {
+        if(m_exception)
+            {
+            std::rethrow_exception(m_exception);
+            }
+        }
+};
+
+
+/*++
+    协程任务
+        惰性启动：co_await 时才开始执行，或者交给 CoSpawn 分离执行
+--*/
+template<typename T>
+class Task
+{
+public:
+    typedef TaskPromise<T>                      promise_type;
+    typedef std::coroutine_handle<promise_type> HANDLE_TYPE;
+
+public:
+    Task() : m_handle(nullptr) {}
+    explicit Task(HANDLE_TYPE handle) : m_handle(handle) {}
+    Task(Task&& task) noexcept : m_handle(std::exchange(task.m_handle,nullptr)) {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    Task& operator=(Task&& task) noexcept
+        {
+        if(this != &task)
+            {
+            if(m_handle)
+                {
+                m_handle.destroy();
+                }
+            m_handle = std::exchange(task.m_handle,nullptr);
+            }
+        return *this;
+        }
+
+    ~Task()
+        {
+        if(m_handle)
+            {
+            m_handle.destroy();
+            }
+        }
+
+    // 分离执行，协程结束后自行销毁
+    void Detach()
+        {
+        HANDLE_TYPE handle = std::exchange(m_handle,nullptr);
+        if(handle)
+            {
+            handle.promise().m_detached = true;
+            handle.resume();
+            }
+        }
+
+    auto operator co_await() && noexcept
+        {
+        struct Awaiter
+            {
+            HANDLE_TYPE m_handle;
+
+            bool await_ready() noexcept { return !m_handle || m_handle.done(); }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+                {
+                m_handle.promise().m_continuation = continuation;
+                return m_handle;
+                }
+
+            T await_resume() { return m_handle.promise().Result(); }
+            };
+        return Awaiter{m_handle};
+        }
+
+private:
+    HANDLE_TYPE     m_handle;
+};
+
+
+template<typename T>
+inline Task<T> TaskPromise<T>::get_return_object()
+    { return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this)); }
+
+inline Task<void> TaskPromise<void>::get_return_object()
+    { return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this)); }
+
+
+// 分离启动一个协程
+inline void CoSpawn(Task<>&& task)
+    { task.Detach(); }
+
+
+
+/*++
+    等待对象
+        await_suspend 中投递重叠 I/O，投递成功后不能再访问 this，
+        因为完成包可能已经在别的线程上恢复了协程并销毁了本对象。
+--*/
+
+
+// 切换到线程池继续执行
+class PoolAwaitable \
+        : public AWAITOVERLAPPED
+{
+public:
+    explicit PoolAwaitable(Server& server) \
+        : AWAITOVERLAPPED(ResumeInPool) \
+        { m_server = &server; }
+
+    bool await_ready() { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+        {
+        m_handle = handle;
+        return m_server->PostCompletion(&m_overlapped);
+        }
+
+    void await_resume() {}
+};
+
+
+// 等待新连接
+class AcceptAwaitable \
+        : public AWAITOVERLAPPED
+{
+public:
+    AcceptAwaitable(Server& server, ResumeMode mode) \
+        : AWAITOVERLAPPED(mode) \
+        { m_server = &server; }
+
+    bool await_ready() { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+        {
+        m_handle = handle;
+        m_sock = m_server->GetListenSocket();
+        m_client = m_server->CreateClient();
+        if(m_server->PostAccept(m_client,&m_overlapped))
+            {
+            return true;
+            }
+        m_dwError = WSAGetLastError();
+        return false;
+        }
+
+    // 失败返回 nullptr
+    Client* await_resume()
+        {
+        if(m_dwError)
+            {
+            m_server->RemoveClient(m_client);
+            WSASetLastError(m_dwError);
+            return nullptr;
+            }
+        m_server->CompleteAccept(m_client);
+        return m_client;
+        }
+};
+
+
+// 接收或发送一次
+class TransferAwaitable \
+        : public AWAITOVERLAPPED
+{
+public:
+    TransferAwaitable(Client* pClient, void* buffer, size_t size, bool isSend, ResumeMode mode) \
+        : AWAITOVERLAPPED(mode) \
+        {
+        m_client = pClient;
+        m_sock = *pClient;
+        m_wsaBuffer.buf = reinterpret_cast<CHAR*>(buffer);
+        m_wsaBuffer.len = static_cast<ULONG>(size);
+        m_isSend = isSend;
+        }
+
+    bool await_ready() { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+        {
+        m_handle = handle;
+        int ret = m_isSend \
+            ? m_client->PostSend(&m_wsaBuffer,1,&m_overlapped) \
+            : m_client->PostRecv(&m_wsaBuffer,&m_overlapped);
+        if(SOCKET_ERROR == ret)
+            {
+            int err = WSAGetLastError();
+            if(err != WSA_IO_PENDING)
+                {
+                m_dwError = err;
+                return false;
+                }
+            }
+        return true;
+        }
+
+    int await_resume()
+        {
+        if(m_dwError)
+            {
+            WSASetLastError(m_dwError);
+            return SOCKET_ERROR;
+            }
+        return static_cast<int>(m_dwTransferred);
+        }
+private:
+    bool    m_isSend;
+};
+
+
+// 切换到线程池
+inline PoolAwaitable SwitchToPool(Server& server)
+    { return PoolAwaitable(server); }
+
+// 接受一个新连接，失败返回 nullptr
+inline AcceptAwaitable AsyncAccept(Server& server, ResumeMode mode = ResumeInline)
+    { return AcceptAwaitable(server,mode); }
+
+// 读取一次，返回值同 recv
+inline TransferAwaitable AsyncReadSome(Client* pClient, void* buffer, size_t size, ResumeMode mode = ResumeInline)
+    { return TransferAwaitable(pClient,buffer,size,false,mode); }
+
+// 读满 size 字节。返回 size 表示成功，0 表示读满之前对端关闭，SOCKET_ERROR 表示失败
+inline Task<int> AsyncReadExactly(Client* pClient, void* buffer, size_t size, ResumeMode mode = ResumeInline)
+    {
+    char* pData = reinterpret_cast<char*>(buffer);
+    size_t done = 0;
+    while(done < size)
+        {
+        int ret = co_await AsyncReadSome(pClient,pData + done,size - done,mode);
+        if(ret <= 0)
+            {
+            co_return ret;
+            }
+        done += static_cast<size_t>(ret);
+        }
+    co_return static_cast<int>(size);
+    }
+
+// 写完 size 字节，处理部分写入。返回 size 表示成功，SOCKET_ERROR 表示失败
+inline Task<int> AsyncWrite(Client* pClient, const void* buffer, size_t size, ResumeMode mode = ResumeInline)
+    {
+    const char* pData = reinterpret_cast<const char*>(buffer);
+    size_t done = 0;
+    while(done < size)
+        {
+        int ret = co_await TransferAwaitable(pClient,const_cast<char*>(pData) + done,size - done,true,mode);
+        if(ret < 0)
+            {
+            co_return SOCKET_ERROR;
+            }
+        if(0 == ret)
+            {
+            // 发送了 0 字节没有错误码，按连接被重置处理，调用者通过 WSAGetLastError 得到原因
+            WSASetLastError(WSAECONNRESET);
+            co_return SOCKET_ERROR;
+            }
+        done += static_cast<size_t>(ret);
+        }
+    co_return static_cast<int>(size);
+    }
+
+
+#endif //IOCPANDTHREADPOOL_COROUTINE_H
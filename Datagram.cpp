@@ -0,0 +1,296 @@
+#include "Datagram.h"
+
+
+// 发送到指定地址，处理函数返回后统一发送
+bool DatagramBatch::SendTo(const sockaddr_in& addr, const void* data, size_t size)
+    {
+    if(size > m_endpoint->m_options.m_maxDatagram)
+        {
+        return false;
+        }
+    DatagramOverlapped* pOver = m_endpoint->Acquire();
+    memcpy(pOver->m_buffer.data(),data,size);
+    pOver->m_size = static_cast<DWORD>(size);
+    pOver->m_addr = addr;
+    m_replies.push_back(pOver);
+    return true;
+    }
+
+
+// 线程池入口，处理完成后回收缓冲区并删除自己
+int DatagramBatch::BatchWorker()
+    {
+    m_endpoint->DealBatch(*this);
+    delete this;
+    return -1;
+    }
+
+
+
+DatagramEndpoint::DatagramEndpoint(Server* pServer, const sockaddr_in& addr, \
+    ThreadFuncBase* obj, DATAGRAM_CALLBACK callback, const DatagramOptions& options) \
+    : m_server(pServer), \
+      m_sock(INVALID_SOCKET), \
+      m_addr(addr), \
+      m_options(options), \
+      m_base(obj), \
+      m_callback(callback), \
+      m_batch(nullptr), \
+      m_ready(false), \
+      m_received(0), \
+      m_dropped(0), \
+      m_sent(0), \
+      m_batches(0) \
+    {
+    }
+
+
+DatagramEndpoint::~DatagramEndpoint()
+    {
+    if(m_sock != INVALID_SOCKET)
+        {
+        closesocket(m_sock);
+        m_sock = INVALID_SOCKET;
+        }
+    delete m_batch;
+    std::lock_guard<std::mutex> guard(m_lock);
+    for(size_t i = 0; i != m_all.size(); ++i)
+        {
+        delete m_all[i];
+        }
+    m_all.clear();
+    m_free.clear();
+    }
+
+
+// 创建套接字、绑定到完成端口并投递接收
+bool DatagramEndpoint::Start(HANDLE hIocp)
+    {
+    m_sock = WSASocket(PF_INET,SOCK_DGRAM,IPPROTO_UDP,nullptr,0,WSA_FLAG_OVERLAPPED);
+    if(INVALID_SOCKET == m_sock)
+        {
+        return false;
+        }
+    int opt = 1;
+    setsockopt(m_sock,SOL_SOCKET,SO_REUSEADDR,reinterpret_cast<const char*>(&opt),sizeof(opt));
+    setsockopt(m_sock,SOL_SOCKET,SO_RCVBUF,reinterpret_cast<const char*>(&m_options.m_recvBufSize),sizeof(m_options.m_recvBufSize));
+
+    // 对端端口不可达时，不让 ICMP 报文把后续的接收变成 WSAECONNRESET
+    BOOL bNewBehavior = FALSE;
+    DWORD dwBytes = 0;
+    WSAIoctl(m_sock,SIO_UDP_CONNRESET,&bNewBehavior,sizeof(bNewBehavior),nullptr,0,&dwBytes,nullptr,nullptr);
+
+    if(SOCKET_ERROR == bind(m_sock,reinterpret_cast<sockaddr*>(&m_addr),sizeof(m_addr)))
+        {
+        std::cerr << "datagram bind failed! [" << WSAGetLastError() \
+                  << "] (" << Tools::GetErrorInfo(WSAGetLastError()).c_str() \
+                  << ")" << std::endl;
+        return false;
+        }
+
+    if(!CreateIoCompletionPort(reinterpret_cast<HANDLE>(m_sock),hIocp,reinterpret_cast<ULONG_PTR>(this),0))
+        {
+        return false;
+        }
+
+    for(size_t i = 0; i != m_options.m_pendingRecvs; ++i)
+        {
+        if(!PostRecv(Acquire()))
+            {
+            return false;
+            }
+        }
+    return true;
+    }
+
+
+// 发送一个数据报
+bool DatagramEndpoint::SendTo(const sockaddr_in& addr, const void* data, size_t size)
+    {
+    if(size > m_options.m_maxDatagram)
+        {
+        return false;
+        }
+    DatagramOverlapped* pOver = Acquire();
+    memcpy(pOver->m_buffer.data(),data,size);
+    pOver->m_size = static_cast<DWORD>(size);
+    pOver->m_addr = addr;
+    return PostSend(pOver);
+    }
+
+
+// 运行指标
+DatagramMetrics DatagramEndpoint::GetMetrics() const
+    {
+    DatagramMetrics metrics;
+    metrics.m_received = m_received.load();
+    metrics.m_dropped = m_dropped.load();
+    metrics.m_sent = m_sent.load();
+    metrics.m_batches = m_batches.load();
+    return metrics;
+    }
+
+
+// 接收完成，放入当前批次并补投一个接收
+void DatagramEndpoint::OnRecv(DatagramOverlapped* pOver, DWORD dwTransferred, bool bSuccess)
+    {
+    // 先补投，保证处理期间仍有足够的接收在等待
+    PostRecv(Acquire());
+
+    if(!bSuccess)
+        {
+        ++m_dropped;
+        Recycle(pOver);
+        return;
+        }
+
+    ++m_received;
+    pOver->m_size = dwTransferred;
+    if(!m_batch)
+        {
+        m_batch = new DatagramBatch(this);
+        m_batch->m_items.reserve(m_options.m_batchSize);
+        }
+    m_batch->m_items.push_back(pOver);
+
+    if(m_batch->m_items.size() >= m_options.m_batchSize)
+        {
+        Flush();
+        }
+    else if(!m_ready)
+        {
+        m_ready = true;
+        m_server->MarkDatagramReady(this);
+        }
+    }
+
+
+// 发送完成，回收缓冲区
+void DatagramEndpoint::OnSent(DatagramOverlapped* pOver)
+    {
+    Recycle(pOver);
+    }
+
+
+// 把当前批次交给线程池
+void DatagramEndpoint::Flush()
+    {
+    m_ready = false;
+    DatagramBatch* pBatch = m_batch;
+    m_batch = nullptr;
+    if(!pBatch)
+        {
+        return;
+        }
+    ++m_batches;
+    if(-1 == m_server->DispatchWorker(ThreadWorker(pBatch,reinterpret_cast<FUNCTYPE>(&DatagramBatch::BatchWorker))))
+        {
+        pBatch->BatchWorker();
+        }
+    }
+
+
+// 从缓冲池中取一个缓冲区
+DatagramOverlapped* DatagramEndpoint::Acquire()
+    {
+    {
+    std::lock_guard<std::mutex> guard(m_lock);
+    if(!m_free.empty())
+        {
+        DatagramOverlapped* pOver = m_free.back();
+        m_free.pop_back();
+        return pOver;
+        }
+    }
+    DatagramOverlapped* pOver = new DatagramOverlapped(this,m_options.m_maxDatagram);
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_all.push_back(pOver);
+    return pOver;
+    }
+
+
+// 归还缓冲区
+void DatagramEndpoint::Recycle(DatagramOverlapped* pOver)
+    {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_free.push_back(pOver);
+    }
+
+
+void DatagramEndpoint::Recycle(std::vector<DatagramOverlapped*>& items)
+    {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_free.insert(m_free.end(),items.begin(),items.end());
+    items.clear();
+    }
+
+
+// 投递接收
+bool DatagramEndpoint::PostRecv(DatagramOverlapped* pOver)
+    {
+    pOver->Reset(IORecvFrom);
+    int ret = WSARecvFrom(m_sock, \
+        &pOver->m_wsaBuffer, \
+        1, \
+        nullptr, \
+        &pOver->m_flags, \
+        reinterpret_cast<sockaddr*>(&pOver->m_addr), \
+        &pOver->m_addrLen, \
+        &pOver->m_overlapped, \
+        nullptr);
+    if(SOCKET_ERROR == ret && WSAGetLastError() != WSA_IO_PENDING)
+        {
+        std::cerr << "WSARecvFrom failed! [" << WSAGetLastError() \
+                  << "] (" << Tools::GetErrorInfo(WSAGetLastError()).c_str() \
+                  << ")" << std::endl;
+        Recycle(pOver);
+        return false;
+        }
+    return true;
+    }
+
+
+// 投递发送
+bool DatagramEndpoint::PostSend(DatagramOverlapped* pOver)
+    {
+    DWORD dwSize = pOver->m_size;
+    pOver->Reset(IOSendTo);
+    pOver->m_wsaBuffer.len = dwSize;
+    pOver->m_size = dwSize;
+    int ret = WSASendTo(m_sock, \
+        &pOver->m_wsaBuffer, \
+        1, \
+        nullptr, \
+        0, \
+        reinterpret_cast<sockaddr*>(&pOver->m_addr), \
+        sizeof(pOver->m_addr), \
+        &pOver->m_overlapped, \
+        nullptr);
+    if(SOCKET_ERROR == ret && WSAGetLastError() != WSA_IO_PENDING)
+        {
+        Recycle(pOver);
+        return false;
+        }
+    ++m_sent;
+    return true;
+    }
+
+
+// 处理一批数据报
+void DatagramEndpoint::DealBatch(DatagramBatch& batch)
+    {
+    if(m_base && m_callback)
+        {
+        int ret = (m_base->*m_callback)(batch);
+        if(ret)
+            {
+            std::cerr << "datagram handler found warning code " << ret << std::endl;
+            }
+        }
+    for(size_t i = 0; i != batch.m_replies.size(); ++i)
+        {
+        PostSend(batch.m_replies[i]);
+        }
+    batch.m_replies.clear();
+    Recycle(batch.m_items);
+    }
@@ -0,0 +1,180 @@
+#ifndef IOCPANDTHREADPOOL_DATAGRAM_H
+#define IOCPANDTHREADPOOL_DATAGRAM_H
+
+
+#include "Server.h"
+
+
+/*++
+    数据报（UDP）端点
+        和 TCP 共用 Server 的完成端口和线程池：
+        1. 同时投递 m_pendingRecvs 个 WSARecvFrom，缓冲区来自端点自己的缓冲池
+        2. 完成端口线程用 GetQueuedCompletionStatusEx 批量取出完成包，同一端点的数据报攒成一批
+        3. 每一批交给线程池调用一次处理函数，处理函数中的回复在返回后统一发送
+        Windows 没有 recvmmsg/sendmmsg，这里用多个并发的重叠操作加批量出队代替。
+--*/
+
+
+
+// 数据报端点配置
+struct DatagramOptions
+{
+    size_t  m_maxDatagram   = 2048;             // 单个数据报最大长度，超过的会被丢弃
+    size_t  m_pendingRecvs  = 128;              // 同时投递的接收操作数
+    size_t  m_batchSize     = 64;               // 每批最多交给处理函数的数据报数
+    int     m_recvBufSize   = 4 * 1024 * 1024;  // SO_RCVBUF
+};
+
+
+// 数据报端点运行指标
+struct DatagramMetrics
+{
+    size_t  m_received  = 0;    // 收到的数据报
+    size_t  m_dropped   = 0;    // 接收失败或超长被丢弃的数据报
+    size_t  m_sent      = 0;    // 发送的数据报
+    size_t  m_batches   = 0;    // 分发给处理函数的批数
+};
+
+
+// 数据报重叠结构，收发共用，由端点的缓冲池管理
+class DatagramOverlapped \
+        : public IoOverlapped
+{
+public:
+    explicit DatagramOverlapped(DatagramEndpoint* pEndpoint, size_t size)
+        {
+        memset(&m_overlapped,0,sizeof(m_overlapped));
+        m_operator = IORecvFrom;
+        m_server = nullptr;
+        m_client = nullptr;
+        m_endpoint = pEndpoint;
+        m_buffer.resize(size);
+        m_size = 0;
+        m_flags = 0;
+        m_addrLen = sizeof(m_addr);
+        memset(&m_addr,0,sizeof(m_addr));
+        }
+    virtual ~DatagramOverlapped() = default;
+
+    // 重新投递前重置
+    void Reset(DWORD op)
+        {
+        memset(&m_overlapped,0,sizeof(m_overlapped));
+        m_operator = op;
+        m_wsaBuffer.buf = m_buffer.data();
+        m_wsaBuffer.len = static_cast<ULONG>(m_buffer.size());
+        m_flags = 0;
+        m_addrLen = sizeof(m_addr);
+        }
+public:
+    DatagramEndpoint*   m_endpoint;
+    NUMA_BUFFER         m_buffer;       // 数据报缓冲区
+    sockaddr_in         m_addr;         // 来源或目标地址
+    INT                 m_addrLen;
+    DWORD               m_flags;
+    DWORD               m_size;         // 数据长度
+};
+
+
+// 交给处理函数的一批数据报
+class DatagramBatch \
+        : public ThreadFuncBase
+{
+public:
+    DatagramBatch(DatagramEndpoint* pEndpoint) : m_endpoint(pEndpoint) {}
+    ~DatagramBatch() = default;
+
+    size_t Size() const { return m_items.size(); }
+    const char* Data(size_t index) const { return m_items[index]->m_buffer.data(); }
+    size_t Length(size_t index) const { return m_items[index]->m_size; }
+    const sockaddr_in& From(size_t index) const { return m_items[index]->m_addr; }
+    DatagramEndpoint* Endpoint() const { return m_endpoint; }
+
+    // 回复第 index 个数据报的来源，处理函数返回后统一发送
+    bool Reply(size_t index, const void* data, size_t size)
+        { return SendTo(From(index),data,size); }
+
+    // 发送到指定地址，处理函数返回后统一发送
+    bool SendTo(const sockaddr_in& addr, const void* data, size_t size);
+
+    // 线程池入口，处理完成后回收缓冲区并删除自己
+    int BatchWorker();
+
+private:
+    friend class DatagramEndpoint;
+    DatagramEndpoint*                   m_endpoint;
+    std::vector<DatagramOverlapped*>    m_items;        // 收到的数据报
+    std::vector<DatagramOverlapped*>    m_replies;      // 待发送的数据报
+};
+
+
+class DatagramEndpoint \
+        : public ThreadFuncBase
+{
+public:
+    DatagramEndpoint(Server* pServer, const sockaddr_in& addr, \
+        ThreadFuncBase* obj, DATAGRAM_CALLBACK callback, const DatagramOptions& options);
+    ~DatagramEndpoint();
+
+    // 创建套接字、绑定到完成端口并投递接收
+    bool Start(HANDLE hIocp);
+
+    // 发送一个数据报，数据会复制到缓冲池中的缓冲区
+    bool SendTo(const sockaddr_in& addr, const void* data, size_t size);
+
+    // 运行指标
+    DatagramMetrics GetMetrics() const;
+
+    operator SOCKET() const { return m_sock; }
+
+public:
+    // 以下由完成端口线程调用
+
+    // 接收完成，放入当前批次并补投一个接收
+    void OnRecv(DatagramOverlapped* pOver, DWORD dwTransferred, bool bSuccess);
+
+    // 发送完成，回收缓冲区
+    void OnSent(DatagramOverlapped* pOver);
+
+    // 把当前批次交给线程池
+    void Flush();
+
+private:
+    friend class DatagramBatch;
+
+    // 从缓冲池中取一个缓冲区
+    DatagramOverlapped* Acquire();
+
+    // 归还缓冲区
+    void Recycle(DatagramOverlapped* pOver);
+    void Recycle(std::vector<DatagramOverlapped*>& items);
+
+    // 投递接收
+    bool PostRecv(DatagramOverlapped* pOver);
+
+    // 投递发送
+    bool PostSend(DatagramOverlapped* pOver);
+
+    // 处理一批数据报
+    void DealBatch(DatagramBatch& batch);
+
+private:
+    Server*                             m_server;
+    SOCKET                              m_sock;
+    sockaddr_in                         m_addr;
+    DatagramOptions                     m_options;
+    ThreadFuncBase*                     m_base;
+    DATAGRAM_CALLBACK                   m_callback;
+    DatagramBatch*                      m_batch;        // 正在收集的批次，只在完成端口线程上访问
+    bool                                m_ready;        // 已经登记到 Server 等待本轮分发
+    std::mutex                          m_lock;         // 保护缓冲池
+    std::vector<DatagramOverlapped*>    m_free;         // 空闲缓冲区
+    std::vector<DatagramOverlapped*>    m_all;          // 所有缓冲区，析构时释放
+    std::atomic<size_t>                 m_received;
+    std::atomic<size_t>                 m_dropped;
+    std::atomic<size_t>                 m_sent;
+    std::atomic<size_t>                 m_batches;
+};
+
+
+#endif //IOCPANDTHREADPOOL_DATAGRAM_H
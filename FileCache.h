@@ -0,0 +1,262 @@
+#ifndef IOCPANDTHREADPOOL_FILECACHE_H
+#define IOCPANDTHREADPOOL_FILECACHE_H
+
+
+#include <Windows.h>
+
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+/*++
+    热点内容缓存
+        文件只映射一次，之后所有连接共享同一块映射内存，通过 Client::SendShared 直接发送，
+        不再复制到每个连接的缓冲区。
+        映射内存由 shared_ptr 计数，被淘汰时仍在发送的连接会继续持有，发送完成后才解除映射。
+        按 key 的哈希分片，每个分片一把锁和一个 LRU 链表，线程池中的线程并发查找时不会争用全局锁。
+--*/
+
+
+
+// 映射到内存的只读文件
+class MappedBlob
+{
+public:
+    MappedBlob() \
+        : m_hFile(INVALID_HANDLE_VALUE), \
+          m_hMapping(nullptr), \
+          m_pData(nullptr), \
+          m_size(0) \
+        {  }
+
+    ~MappedBlob()
+        {
+        if(m_pData)
+            {
+            UnmapViewOfFile(m_pData);
+            }
+        if(m_hMapping)
+            {
+            CloseHandle(m_hMapping);
+            }
+        if(m_hFile != INVALID_HANDLE_VALUE)
+            {
+            CloseHandle(m_hFile);
+            }
+        }
+
+    MappedBlob(const MappedBlob&) = delete;
+    MappedBlob& operator=(const MappedBlob&) = delete;
+
+    // 映射文件，失败返回 nullptr
+    static std::shared_ptr<const MappedBlob> Open(const std::string& path)
+        {
+        std::shared_ptr<MappedBlob> blob = std::make_shared<MappedBlob>();
+        blob->m_hFile = CreateFile(path.c_str(), \
+            GENERIC_READ, \
+            FILE_SHARE_READ, \
+            nullptr, \
+            OPEN_EXISTING, \
+            FILE_ATTRIBUTE_NORMAL, \
+            nullptr);
+        if(INVALID_HANDLE_VALUE == blob->m_hFile)
+            {
+            return nullptr;
+            }
+        LARGE_INTEGER size;
+        if(!GetFileSizeEx(blob->m_hFile,&size))
+            {
+            return nullptr;
+            }
+        blob->m_size = static_cast<size_t>(size.QuadPart);
+        if(0 == blob->m_size)
+            {
+            // 空文件不能映射
+            return blob;
+            }
+        blob->m_hMapping = CreateFileMapping(blob->m_hFile,nullptr,PAGE_READONLY,0,0,nullptr);
+        if(!blob->m_hMapping)
+            {
+            return nullptr;
+            }
+        blob->m_pData = reinterpret_cast<const char*>(MapViewOfFile(blob->m_hMapping,FILE_MAP_READ,0,0,0));
+        if(!blob->m_pData)
+            {
+            return nullptr;
+            }
+        return blob;
+        }
+
+    const char* Data() const { return m_pData; }
+    size_t Size() const { return m_size; }
+
+private:
+    HANDLE          m_hFile;
+    HANDLE          m_hMapping;
+    const char*     m_pData;
+    size_t          m_size;
+};
+
+typedef std::shared_ptr<const MappedBlob>   PTR_BLOB;
+
+
+
+// 缓存运行指标
+struct ContentCacheMetrics
+{
+    size_t  m_hits      = 0;
+    size_t  m_misses    = 0;
+    size_t  m_evictions = 0;
+    size_t  m_entries   = 0;    // 当前条目数
+    size_t  m_bytes     = 0;    // 当前占用的映射大小
+};
+
+
+
+class ContentCache
+{
+public:
+    // maxBytes 为所有分片的映射大小上限，平均分配给每个分片
+    ContentCache(size_t maxBytes = 256 * 1024 * 1024, size_t shards = 16) \
+        : m_shards(shards ? shards : 1) \
+        {
+        m_shardBytes = maxBytes / m_shards.size();
+        }
+
+    ~ContentCache() = default;
+
+    // 查找文件内容，未命中时映射文件并放入缓存。文件不存在返回 nullptr
+    PTR_BLOB Get(const std::string& path)
+        {
+        Shard& shard = ShardOf(path);
+        PTR_BLOB blob = Find(shard,path);
+        if(blob)
+            {
+            return blob;
+            }
+
+        // 在锁外映射文件，不阻塞同一分片的其他查找
+        blob = MappedBlob::Open(path);
+        if(!blob)
+            {
+            return nullptr;
+            }
+        return Insert(shard,path,blob);
+        }
+
+    // 只查找，不加载
+    PTR_BLOB Find(const std::string& path)
+        { return Find(ShardOf(path),path); }
+
+    // 移除，文件内容变化时调用
+    void Erase(const std::string& path)
+        {
+        Shard& shard = ShardOf(path);
+        std::lock_guard<std::mutex> guard(shard.m_lock);
+        std::unordered_map<std::string, LRU_ITER>::iterator it = shard.m_index.find(path);
+        if(it != shard.m_index.end())
+            {
+            shard.m_bytes -= it->second->m_blob->Size();
+            shard.m_lru.erase(it->second);
+            shard.m_index.erase(it);
+            }
+        }
+
+    // 运行指标
+    ContentCacheMetrics GetMetrics()
+        {
+        ContentCacheMetrics metrics;
+        for(size_t i = 0; i != m_shards.size(); ++i)
+            {
+            Shard& shard = m_shards[i];
+            metrics.m_hits += shard.m_hits.load(std::memory_order_relaxed);
+            metrics.m_misses += shard.m_misses.load(std::memory_order_relaxed);
+            std::lock_guard<std::mutex> guard(shard.m_lock);
+            metrics.m_evictions += shard.m_evictions;
+            metrics.m_entries += shard.m_index.size();
+            metrics.m_bytes += shard.m_bytes;
+            }
+        return metrics;
+        }
+
+private:
+    struct Entry
+        {
+        std::string     m_key;
+        PTR_BLOB        m_blob;
+        };
+    typedef std::list<Entry>::iterator  LRU_ITER;
+
+    // 分片，按 64 字节对齐避免伪共享
+    struct alignas(64) Shard
+        {
+        std::mutex                                  m_lock;
+        std::list<Entry>                            m_lru;      // 头部为最近使用
+        std::unordered_map<std::string, LRU_ITER>   m_index;
+        size_t                                      m_bytes = 0;
+        size_t                                      m_evictions = 0;
+        std::atomic<size_t>                         m_hits{0};
+        std::atomic<size_t>                         m_misses{0};
+        };
+
+    Shard& ShardOf(const std::string& path)
+        { return m_shards[std::hash<std::string>()(path) % m_shards.size()]; }
+
+    PTR_BLOB Find(Shard& shard, const std::string& path)
+        {
+        std::lock_guard<std::mutex> guard(shard.m_lock);
+        std::unordered_map<std::string, LRU_ITER>::iterator it = shard.m_index.find(path);
+        if(it == shard.m_index.end())
+            {
+            shard.m_misses.fetch_add(1,std::memory_order_relaxed);
+            return nullptr;
+            }
+        shard.m_hits.fetch_add(1,std::memory_order_relaxed);
+        shard.m_lru.splice(shard.m_lru.begin(),shard.m_lru,it->second);
+        return it->second->m_blob;
+        }
+
+    PTR_BLOB Insert(Shard& shard, const std::string& path, const PTR_BLOB& blob)
+        {
+        std::lock_guard<std::mutex> guard(shard.m_lock);
+        std::unordered_map<std::string, LRU_ITER>::iterator it = shard.m_index.find(path);
+        if(it != shard.m_index.end())
+            {
+            // 其他线程已经加载过，使用已有的映射
+            return it->second->m_blob;
+            }
+        if(blob->Size() > m_shardBytes)
+            {
+            // 超过分片上限的文件不缓存，直接返回给调用者使用
+            return blob;
+            }
+
+        shard.m_lru.push_front(Entry{path,blob});
+        shard.m_index[path] = shard.m_lru.begin();
+        shard.m_bytes += blob->Size();
+
+        // 淘汰最久未使用的条目，正在发送的连接仍持有引用
+        while(shard.m_bytes > m_shardBytes && shard.m_lru.size() > 1)
+            {
+            Entry& last = shard.m_lru.back();
+            shard.m_bytes -= last.m_blob->Size();
+            shard.m_index.erase(last.m_key);
+            shard.m_lru.pop_back();
+            ++shard.m_evictions;
+            }
+        return blob;
+        }
+
+private:
+    std::vector<Shard>  m_shards;
+    size_t              m_shardBytes;   // 每个分片的映射大小上限
+};
+
+
+#endif //IOCPANDTHREADPOOL_FILECACHE_H
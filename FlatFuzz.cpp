@@ -0,0 +1,377 @@
+/*++
+    FlatReader::Validate 的模糊测试
+        随机生成负载（大部分从合法的消息变异而来：改偏移、改个数、翻转字节、截断、加长），
+        把校验结果和独立实现的边界判断（oracle）比较，通过校验的消息再读出所有变长字段的每个字节。
+        负载放在大小正好的堆内存中，配合 AddressSanitizer 可以发现任何越界读取。
+
+            FlatFuzz [次数] [种子]
+
+        用 clang 构建时还有 FlatFuzzLib 目标，定义 FLAT_FUZZ_LIBFUZZER，由 libFuzzer 提供输入：
+
+            FlatFuzzLib corpus_dir
+--*/
+
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <vector>
+
+
+#include "FlatMessage.h"
+
+
+struct FuzzPair
+{
+    uint64_t    m_key;
+    double      m_value;
+};
+
+
+// 被测的布局：不同大小和对齐的变长字段
+struct FuzzLayout
+{
+    uint64_t                m_id;
+    FlatString              m_name;
+    FlatArray<uint32_t>     m_ids;
+    FlatArray<FuzzPair>     m_pairs;
+    FlatArray<uint16_t>     m_shorts;
+
+    template<typename V> void Visit(V& v) const { v(m_name); v(m_ids); v(m_pairs); v(m_shorts); }
+};
+
+
+// 变长字段在布局中的位置和元素的大小、对齐，oracle 按这张表直接读原始字节，不经过 FuzzLayout
+struct FuzzField
+{
+    size_t  m_refOffset;
+    size_t  m_elemSize;
+    size_t  m_elemAlign;
+};
+
+static const FuzzField g_fields[] =
+{
+    {offsetof(FuzzLayout,m_name),   sizeof(char),       alignof(char)},
+    {offsetof(FuzzLayout,m_ids),    sizeof(uint32_t),   alignof(uint32_t)},
+    {offsetof(FuzzLayout,m_pairs),  sizeof(FuzzPair),   alignof(FuzzPair)},
+    {offsetof(FuzzLayout,m_shorts), sizeof(uint16_t),   alignof(uint16_t)}
+};
+enum {FuzzFieldCount = sizeof(g_fields) / sizeof(g_fields[0])};
+
+
+// 统计
+struct FuzzStats
+{
+    size_t  m_cases         = 0;
+    size_t  m_results[4]    = {0, 0, 0, 0};     // 按 -FlatResult 计数
+    size_t  m_bytesRead     = 0;                // 通过校验后读取的变长字段字节数
+    size_t  m_mismatches    = 0;
+};
+static FuzzStats g_stats;
+static volatile unsigned char g_sink;   // 读出的字节写到这里，读取不会被优化掉
+
+
+static void ReadRef(const char* data, size_t field, uint32_t& offset, uint32_t& count)
+    {
+    memcpy(&offset,data + g_fields[field].m_refOffset,sizeof(offset));
+    memcpy(&count,data + g_fields[field].m_refOffset + sizeof(offset),sizeof(count));
+    }
+
+static void WriteRef(char* data, size_t field, uint32_t offset, uint32_t count)
+    {
+    memcpy(data + g_fields[field].m_refOffset,&offset,sizeof(offset));
+    memcpy(data + g_fields[field].m_refOffset + sizeof(offset),&count,sizeof(count));
+    }
+
+
+// 按格式说明独立计算期望的结果：第一个不合法的变长字段决定返回值
+static int Oracle(const char* data, size_t size)
+    {
+    if(size < sizeof(FuzzLayout))
+        {
+        return FlatTooShort;
+        }
+    if(0 != (reinterpret_cast<uintptr_t>(data) % alignof(FuzzLayout)))
+        {
+        return FlatMisaligned;
+        }
+    for(size_t i = 0; i != FuzzFieldCount; ++i)
+        {
+        uint32_t offset, count;
+        ReadRef(data,i,offset,count);
+        if(0 == count)
+            {
+            continue;
+            }
+        if(offset < sizeof(FuzzLayout))
+            {
+            return FlatOutOfRange;
+            }
+        if(0 != (offset % g_fields[i].m_elemAlign))
+            {
+            return FlatMisaligned;
+            }
+        // 偏移和个数都是 32 位，元素不超过 16 字节，64 位的结束位置不会溢出
+        uint64_t end = static_cast<uint64_t>(offset) + static_cast<uint64_t>(count) * g_fields[i].m_elemSize;
+        if(end > size)
+            {
+            return FlatOutOfRange;
+            }
+        }
+    return FlatOk;
+    }
+
+
+// 读出所有元素，越界读取由 AddressSanitizer 报告，范围不对时返回 false
+template<typename T>
+static bool Touch(const FlatReader<FuzzLayout>& reader, const FlatArray<T>& ref, const char* data, size_t size)
+    {
+    // FlatString 得到 string_view，其他得到 FlatSpan
+    auto view = reader.Get(ref);
+    if(view.empty())
+        {
+        return true;
+        }
+    const char* first = reinterpret_cast<const char*>(&*view.begin());
+    const char* last = first + view.size() * sizeof(T);
+    if((first < data + sizeof(FuzzLayout)) || (last > data + size))
+        {
+        return false;
+        }
+    unsigned char sum = 0;
+    for(const char* p = first; p != last; ++p)
+        {
+        sum = static_cast<unsigned char>(sum + *p);
+        }
+    g_sink = sum;
+    g_stats.m_bytesRead += static_cast<size_t>(last - first);
+    return true;
+    }
+
+
+static void Dump(const char* data, size_t size)
+    {
+    fprintf(stderr,"payload %zu bytes:",size);
+    for(size_t i = 0; i != size; ++i)
+        {
+        fprintf(stderr,"%s%02x",(i % 16) ? " " : "\n  ",static_cast<unsigned char>(data[i]));
+        }
+    fprintf(stderr,"\n");
+    }
+
+
+// 检查一个负载，不一致时打印并计数。bytes 会被复制到大小正好、按 FlatAlign 对齐的内存中
+static bool CheckOne(const char* bytes, size_t size)
+    {
+    ++g_stats.m_cases;
+    char* data = static_cast<char*>(::operator new(size ? size : 1,std::align_val_t(FlatAlign)));
+    if(size)
+        {
+        memcpy(data,bytes,size);
+        }
+
+    int expected = Oracle(data,size);
+    FlatReader<FuzzLayout> reader(data,size);
+    bool ok = (reader.Result() == expected);
+    if(ok && reader.IsValid())
+        {
+        ok = Touch(reader,reader->m_name,data,size) \
+            && Touch(reader,reader->m_ids,data,size) \
+            && Touch(reader,reader->m_pairs,data,size) \
+            && Touch(reader,reader->m_shorts,data,size);
+        }
+
+    // 没有对齐的地址：直接校验应该报 FlatMisaligned，带 Arena 的构造函数复制后结果和对齐时相同
+    if(ok && (size >= sizeof(FuzzLayout)))
+        {
+        char* shifted = static_cast<char*>(::operator new(size + 1,std::align_val_t(FlatAlign)));
+        memcpy(shifted + 1,data,size);
+        ok = (FlatMisaligned == FlatReader<FuzzLayout>::Validate(shifted + 1,size));
+        if(ok)
+            {
+            Arena arena;
+            FlatReader<FuzzLayout> copied(shifted + 1,size,arena);
+            ok = (copied.Result() == expected);
+            }
+        ::operator delete(shifted,std::align_val_t(FlatAlign));
+        }
+
+    if(expected <= 0 && expected >= -3)
+        {
+        ++g_stats.m_results[-expected];
+        }
+    if(!ok)
+        {
+        ++g_stats.m_mismatches;
+        fprintf(stderr,"mismatch: Validate %d, expected %d\n",reader.Result(),expected);
+        Dump(data,size);
+        }
+    ::operator delete(data,std::align_val_t(FlatAlign));
+    return ok;
+    }
+
+
+
+#ifdef FLAT_FUZZ_LIBFUZZER
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+    {
+    if(!CheckOne(reinterpret_cast<const char*>(data),size))
+        {
+        abort();
+        }
+    return 0;
+    }
+
+#else
+
+// 随机负载生成
+class FuzzGenerator
+{
+public:
+    explicit FuzzGenerator(uint64_t seed) : m_rng(seed) {}
+
+    // 生成一个负载，写入 buffer，返回长度
+    size_t Next(std::vector<char>& buffer)
+        {
+        size_t size = BuildValid(buffer);
+        Mutate(buffer,size);
+        return size;
+        }
+
+private:
+    uint64_t Random(uint64_t bound) { return bound ? m_rng() % bound : 0; }
+
+    // 按 FlatBuilder 的规则排列一个合法的消息
+    size_t BuildValid(std::vector<char>& buffer)
+        {
+        buffer.assign(sizeof(FuzzLayout) + 2048,0);
+        for(size_t i = 0; i != sizeof(uint64_t); ++i)
+            {
+            buffer[i] = static_cast<char>(m_rng());
+            }
+        size_t size = sizeof(FuzzLayout);
+        for(size_t i = 0; i != FuzzFieldCount; ++i)
+            {
+            size_t count = Random(4) ? Random(1024 / (FuzzFieldCount * g_fields[i].m_elemSize)) : 0;
+            size_t offset = (size + g_fields[i].m_elemAlign - 1) & ~(g_fields[i].m_elemAlign - 1);
+            for(size_t j = 0; j != count * g_fields[i].m_elemSize; ++j)
+                {
+                buffer[offset + j] = static_cast<char>(m_rng());
+                }
+            WriteRef(buffer.data(),i,count ? static_cast<uint32_t>(offset) : 0,static_cast<uint32_t>(count));
+            if(count)
+                {
+                size = offset + count * g_fields[i].m_elemSize;
+                }
+            }
+        if(Random(2))
+            {
+            size = (size + FlatAlign - 1) & ~static_cast<size_t>(FlatAlign - 1);
+            }
+        return size;
+        }
+
+    // 边界附近的值出现的概率更高
+    uint32_t Boundary(size_t size, size_t field, uint32_t offset, uint32_t count)
+        {
+        size_t elem = g_fields[field].m_elemSize;
+        switch(Random(10))
+            {
+        case 0:     return 0;
+        case 1:     return static_cast<uint32_t>(sizeof(FuzzLayout) - 1);
+        case 2:     return static_cast<uint32_t>(size);
+        case 3:     return static_cast<uint32_t>(size - (std::min)(size,count * elem) + 1);
+        case 4:     return offset + 1;
+        case 5:     return UINT32_MAX;
+        case 6:     return static_cast<uint32_t>(UINT32_MAX / elem + 1);
+        case 7:     return static_cast<uint32_t>(size / elem + 1);
+        case 8:     return static_cast<uint32_t>(m_rng());
+        default:    return static_cast<uint32_t>(Random(size + 16));
+            }
+        }
+
+    void Mutate(std::vector<char>& buffer, size_t& size)
+        {
+        // 四分之一保持合法
+        if(0 == Random(4))
+            {
+            return;
+            }
+        for(size_t i = 0; i != FuzzFieldCount; ++i)
+            {
+            uint32_t offset, count;
+            ReadRef(buffer.data(),i,offset,count);
+            switch(Random(6))
+                {
+            case 0:
+                offset = Boundary(size,i,offset,count);
+                break;
+            case 1:
+                count = Boundary(size,i,offset,count);
+                break;
+            case 2:
+                offset = Boundary(size,i,offset,count);
+                count = Boundary(size,i,offset,count);
+                break;
+            default:
+                break;
+                }
+            WriteRef(buffer.data(),i,offset,count);
+            }
+        // 翻转随机字节
+        for(size_t n = Random(4); n; --n)
+            {
+            buffer[Random(size ? size : 1)] ^= static_cast<char>(1 + Random(255));
+            }
+        // 截断或者加长
+        switch(Random(8))
+            {
+        case 0:
+            size = Random(size + 1);
+            break;
+        case 1:
+            size = (std::min)(size + 1 + Random(64),buffer.size());
+            break;
+        case 2:
+            size = sizeof(FuzzLayout) - 1 - Random(sizeof(FuzzLayout));
+            break;
+        default:
+            break;
+            }
+        }
+
+private:
+    std::mt19937_64     m_rng;
+};
+
+
+
+int main(int argc, char* argv[])
+    {
+    size_t iterations = (argc > 1) ? static_cast<size_t>(atoll(argv[1])) : 1000000;
+    uint64_t seed = (argc > 2) ? static_cast<uint64_t>(atoll(argv[2])) : 1;
+
+    FuzzGenerator generator(seed);
+    std::vector<char> buffer;
+    for(size_t i = 0; i != iterations; ++i)
+        {
+        size_t size = generator.Next(buffer);
+        CheckOne(buffer.data(),size);
+        }
+
+    printf("cases %zu (seed %llu)\n",g_stats.m_cases,static_cast<unsigned long long>(seed));
+    printf("ok %zu, too_short %zu, misaligned %zu, out_of_range %zu\n", \
+        g_stats.m_results[0],g_stats.m_results[-FlatTooShort], \
+        g_stats.m_results[-FlatMisaligned],g_stats.m_results[-FlatOutOfRange]);
+    printf("bytes read from valid payloads %zu\n",g_stats.m_bytesRead);
+    printf("mismatches %zu\n",g_stats.m_mismatches);
+    return g_stats.m_mismatches ? 1 : 0;
+    }
+
+#endif
@@ -0,0 +1,383 @@
+#ifndef IOCPANDTHREADPOOL_FLATMESSAGE_H
+#define IOCPANDTHREADPOOL_FLATMESSAGE_H
+
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <type_traits>
+
+
+#include "Arena.h"
+#include "Numa.h"
+#include "Router.h"
+#include "Server.h"
+
+
+/*++
+    平坦消息格式
+        负载（MessageHeader 之后）由定长部分和变长区组成：
+            定长部分就是消息的布局结构体，字段在固定偏移上，原地读取，不解析也不复制；
+            变长字段（字符串、数组）在定长部分中是 FlatArray {偏移, 个数}，指向后面的变长区。
+
+            struct QuoteLayout
+                {
+                uint64_t            m_id;
+                double              m_price;
+                FlatString          m_symbol;
+
+                template<typename V> void Visit(V& v) const { v(m_symbol); }    // 列出所有变长字段，用于校验
+                };
+
+            // 接收：在 Router 的处理函数中
+            FlatReader<QuoteLayout> quote(payload,size);
+            if(!quote.IsValid()) return quote.Result();
+            std::string_view symbol = quote.Get(quote->m_symbol);
+
+            // 发送：直接写入 NumaHeap 分配的发送缓冲区，发送完成后归还
+            FlatBuilder<QuoteLayout> builder(OpQuote);
+            builder->m_id = 1;
+            builder.SetString(&QuoteLayout::m_symbol,"MSFT");
+            builder.Send(*pClient);
+
+        校验只在构造 FlatReader 时做一次：长度、对齐、每个变长字段的范围（偏移和个数都来自对端，按不可信处理）。
+        通过校验后读取没有额外检查。所有地址按 FlatAlign 对齐，FlatBuilder 生成的负载长度也补齐到 FlatAlign，
+        所以连续的消息在接收缓冲区中仍然对齐；对齐不满足时可以用带 Arena 的构造函数复制一份再读。
+        Validate 的边界判断由 FlatFuzz（随机和变异的负载，对照独立的 oracle）覆盖，修改校验规则时同步修改那里的 oracle。
+--*/
+
+
+
+enum FlatResult
+{
+    FlatOk          = 0,
+    FlatTooShort    = -1,   // 比定长部分短
+    FlatMisaligned  = -2,   // 起始地址或变长字段偏移没有对齐
+    FlatOutOfRange  = -3    // 变长字段超出负载
+};
+
+enum {FlatAlign = 8};
+
+
+// 变长字段的引用，偏移相对于负载起始位置
+template<typename T>
+struct FlatArray
+{
+    static_assert(std::is_trivially_copyable<T>::value, "FlatArray element must be trivially copyable");
+    typedef T value_type;
+
+    uint32_t    m_offset;
+    uint32_t    m_count;
+};
+typedef FlatArray<char>     FlatString;
+
+
+// 变长字段的只读视图，指向接收缓冲区
+template<typename T>
+class FlatSpan
+{
+public:
+    FlatSpan() : m_data(nullptr), m_count(0) {}
+    FlatSpan(const T* data, size_t count) : m_data(data), m_count(count) {}
+
+    const T* begin() const { return m_data; }
+    const T* end() const { return m_data + m_count; }
+    const T& operator[](size_t index) const { return m_data[index]; }
+    size_t size() const { return m_count; }
+    bool empty() const { return 0 == m_count; }
+
+private:
+    const T*    m_data;
+    size_t      m_count;
+};
+
+
+// 校验和构造计数，用于观察被拒绝的消息
+struct FlatMetrics
+{
+    size_t  m_validated     = 0;    // 通过校验的消息
+    size_t  m_rejected      = 0;    // 未通过校验的消息
+    size_t  m_copied        = 0;    // 因为没有对齐而复制的消息
+    size_t  m_built         = 0;    // FlatBuilder 生成的消息
+    size_t  m_builtBytes    = 0;
+};
+
+
+class FlatCounters
+{
+public:
+    FlatCounters() = delete;
+    ~FlatCounters() = delete;
+public:
+    static void CountValidate(bool bValid)
+        { ++(bValid ? Get().m_validated : Get().m_rejected); }
+    static void CountCopy()
+        { ++Get().m_copied; }
+    static void CountBuild(size_t bytes)
+        {
+        ++Get().m_built;
+        Get().m_builtBytes += bytes;
+        }
+
+    static FlatMetrics GetMetrics()
+        {
+        Counters& counters = Get();
+        FlatMetrics metrics;
+        metrics.m_validated = counters.m_validated.load();
+        metrics.m_rejected = counters.m_rejected.load();
+        metrics.m_copied = counters.m_copied.load();
+        metrics.m_built = counters.m_built.load();
+        metrics.m_builtBytes = counters.m_builtBytes.load();
+        return metrics;
+        }
+
+private:
+    struct Counters
+        {
+        std::atomic<size_t>     m_validated{0};
+        std::atomic<size_t>     m_rejected{0};
+        std::atomic<size_t>     m_copied{0};
+        std::atomic<size_t>     m_built{0};
+        std::atomic<size_t>     m_builtBytes{0};
+        };
+
+    static Counters& Get()
+        {
+        static Counters counters;
+        return counters;
+        }
+};
+
+
+
+// 原地读取，Layout 见文件开头的说明
+template<typename Layout>
+class FlatReader
+{
+    static_assert(std::is_trivially_copyable<Layout>::value && std::is_standard_layout<Layout>::value,
+        "flat layout must be a trivially copyable standard-layout struct");
+    static_assert(alignof(Layout) <= FlatAlign, "flat layout alignment exceeds FlatAlign");
+
+public:
+    FlatReader(const char* data, size_t size) \
+        : m_data(data), \
+          m_size(size), \
+          m_result(Validate(data,size)) \
+        {
+        FlatCounters::CountValidate(FlatOk == m_result);
+        }
+
+    // 地址没有对齐时复制到 arena 中再读，复制的数据在 arena 重置前有效
+    FlatReader(const char* data, size_t size, Arena& arena) \
+        : m_data(data), \
+          m_size(size), \
+          m_result(FlatOk) \
+        {
+        if(0 != (reinterpret_cast<uintptr_t>(data) & (FlatAlign - 1)))
+            {
+            char* copy = reinterpret_cast<char*>(arena.Allocate(size ? size : 1,FlatAlign));
+            if(size)
+                {
+                memcpy(copy,data,size);
+                }
+            m_data = copy;
+            FlatCounters::CountCopy();
+            }
+        m_result = Validate(m_data,m_size);
+        FlatCounters::CountValidate(FlatOk == m_result);
+        }
+
+    bool IsValid() const { return FlatOk == m_result; }
+    int Result() const { return m_result; }
+
+    // 定长字段，只能在 IsValid 之后访问
+    const Layout* operator->() const { return reinterpret_cast<const Layout*>(m_data); }
+    const Layout& operator*() const { return *reinterpret_cast<const Layout*>(m_data); }
+
+    // 变长字段
+    template<typename T>
+    FlatSpan<T> Get(const FlatArray<T>& ref) const
+        { return FlatSpan<T>(reinterpret_cast<const T*>(m_data + ref.m_offset),ref.m_count); }
+
+    std::string_view Get(const FlatString& ref) const
+        { return std::string_view(m_data + ref.m_offset,ref.m_count); }
+
+    // 校验负载，返回 FlatResult。只读取 [data, data + size)，任意输入都不会越界
+    static int Validate(const char* data, size_t size)
+        {
+        if(size < sizeof(Layout))
+            {
+            return FlatTooShort;
+            }
+        if(0 != (reinterpret_cast<uintptr_t>(data) & (alignof(Layout) - 1)))
+            {
+            return FlatMisaligned;
+            }
+        RefChecker checker(size);
+        reinterpret_cast<const Layout*>(data)->Visit(checker);
+        return checker.m_result;
+        }
+
+private:
+    // 检查每个变长字段
+    struct RefChecker
+        {
+        explicit RefChecker(size_t size) : m_size(size), m_result(FlatOk) {}
+
+        template<typename T>
+        void operator()(const FlatArray<T>& ref)
+            {
+            // 空字段（包括没有设置的 {0, 0}）不指向任何数据
+            if((FlatOk != m_result) || (0 == ref.m_count))
+                {
+                return;
+                }
+            if((ref.m_offset < sizeof(Layout)) || (0 != (ref.m_offset & (alignof(T) - 1))))
+                {
+                m_result = (ref.m_offset < sizeof(Layout)) ? FlatOutOfRange : FlatMisaligned;
+                return;
+                }
+            // 64 位运算，offset + count * sizeof(T) 不会溢出
+            if(static_cast<uint64_t>(ref.m_offset) + static_cast<uint64_t>(ref.m_count) * sizeof(T) > m_size)
+                {
+                m_result = FlatOutOfRange;
+                }
+            }
+
+        size_t  m_size;
+        int     m_result;
+        };
+
+private:
+    const char*     m_data;
+    size_t          m_size;
+    int             m_result;
+};
+
+
+
+// 构造消息，MessageHeader 和负载写在同一块 NumaHeap 缓冲区中，发送时不复制
+template<typename Layout>
+class FlatBuilder
+{
+    static_assert(std::is_trivially_copyable<Layout>::value && std::is_standard_layout<Layout>::value,
+        "flat layout must be a trivially copyable standard-layout struct");
+    static_assert(alignof(Layout) <= FlatAlign, "flat layout alignment exceeds FlatAlign");
+
+public:
+    // capacity 是预计的负载大小，不够时自动扩大
+    explicit FlatBuilder(uint16_t opcode, size_t capacity = 256) \
+        : m_opcode(opcode), \
+          m_buffer(nullptr), \
+          m_capacity(0), \
+          m_size(sizeof(Layout)) \
+        {
+        Reserve((std::max)(capacity,sizeof(Layout)));
+        memset(m_buffer,0,sizeof(MessageHeader) + sizeof(Layout));
+        }
+
+    ~FlatBuilder()
+        {
+        if(m_buffer)
+            {
+            NumaHeap::Free(m_buffer);
+            }
+        }
+
+    FlatBuilder(const FlatBuilder&) = delete;
+    FlatBuilder& operator=(const FlatBuilder&) = delete;
+
+    // 定长字段。SetArray/SetString 可能重新分配缓冲区，之前取得的指针随之失效
+    Layout* operator->() { return reinterpret_cast<Layout*>(Payload()); }
+    Layout& operator*() { return *reinterpret_cast<Layout*>(Payload()); }
+
+    // 把 count 个元素追加到变长区，写入 member 指向的字段
+    template<typename T>
+    bool SetArray(FlatArray<T> Layout::* member, const T* data, size_t count)
+        {
+        size_t offset = (m_size + alignof(T) - 1) & ~(alignof(T) - 1);
+        size_t bytes = count * sizeof(T);
+        if((count > UINT32_MAX) || (offset + bytes > MessageHeader::MHMaxLength) || !Reserve(offset + bytes))
+            {
+            return false;
+            }
+        if(bytes)
+            {
+            memcpy(Payload() + offset,data,bytes);
+            }
+        memset(Payload() + m_size,0,offset - m_size);
+        FlatArray<T> ref;
+        ref.m_offset = static_cast<uint32_t>(offset);
+        ref.m_count = static_cast<uint32_t>(count);
+        reinterpret_cast<Layout*>(Payload())->*member = ref;
+        m_size = offset + bytes;
+        return true;
+        }
+
+    bool SetString(FlatString Layout::* member, std::string_view value)
+        { return SetArray(member,value.data(),value.size()); }
+
+    // 目前的负载大小，不含补齐
+    size_t Size() const { return m_size; }
+
+    // 填好消息头，交给 Client::SendShared。缓冲区的所有权转给发送队列，之后 FlatBuilder 不能再使用
+    int Send(Client& client, SEND_DONE done = nullptr)
+        {
+        size_t payload = (m_size + FlatAlign - 1) & ~static_cast<size_t>(FlatAlign - 1);
+        if(!Reserve(payload))
+            {
+            return -1;
+            }
+        memset(Payload() + m_size,0,payload - m_size);
+        MessageHeader header;
+        header.m_opcode = m_opcode;
+        header.m_flags = 0;
+        header.m_length = static_cast<uint32_t>(payload);
+        memcpy(m_buffer,&header,sizeof(header));
+
+        size_t total = sizeof(header) + payload;
+        FlatCounters::CountBuild(total);
+        std::shared_ptr<const void> owner(m_buffer,[](const void* ptr) { NumaHeap::Free(const_cast<void*>(ptr)); });
+        const char* data = m_buffer;
+        m_buffer = nullptr;
+        m_capacity = 0;
+        return client.SendShared(std::move(owner),data,total,done);
+        }
+
+private:
+    char* Payload() { return m_buffer + sizeof(MessageHeader); }
+
+    // 保证负载至少有 size 字节，按 2 倍扩大
+    bool Reserve(size_t size)
+        {
+        if(size <= m_capacity)
+            {
+            return true;
+            }
+        size_t capacity = (std::max)(size,m_capacity * 2);
+        char* buffer = reinterpret_cast<char*>(NumaHeap::Allocate(sizeof(MessageHeader) + capacity));
+        if(!buffer)
+            {
+            return false;
+            }
+        if(m_buffer)
+            {
+            memcpy(buffer,m_buffer,sizeof(MessageHeader) + m_size);
+            NumaHeap::Free(m_buffer);
+            }
+        m_buffer = buffer;
+        m_capacity = capacity;
+        return true;
+        }
+
+private:
+    uint16_t    m_opcode;
+    char*       m_buffer;       // MessageHeader + 负载
+    size_t      m_capacity;     // 负载容量
+    size_t      m_size;         // 负载已使用的字节
+};
+
+
+#endif //IOCPANDTHREADPOOL_FLATMESSAGE_H
@@ -0,0 +1,336 @@
+#ifndef IOCPANDTHREADPOOL_FUTURE_H
+#define IOCPANDTHREADPOOL_FUTURE_H
+
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+#include "Thread.h"
+
+
+/*++
+    线程池任务的结果
+        ThreadPool::Submit 返回 Future，任务的返回值或抛出的异常保存在共享状态中：
+
+            Future<int> a = pool.Submit([]() { return Checksum(part1); });
+            Future<int> b = pool.Submit([]() { return Checksum(part2); });
+            WhenAll(std::vector<Future<int>>{a,b}).Then([](Future<std::vector<Future<int>>> all)
+                {
+                std::vector<Future<int>> parts = all.Get();
+                return parts[0].Get() ^ parts[1].Get();
+                });
+
+        Then 的后续任务在前一个任务完成后才投递到线程池，不会占住线程等待，
+        所以任务图中的依赖关系不会阻塞线程池。Get 会阻塞调用线程，只应该在线程池外使用。
+        线程池没有运行时，任务和后续任务在调用线程（或完成前一个任务的线程）上直接执行。
+--*/
+
+
+
+// 共享状态
+template<typename T>
+class FutureState
+{
+public:
+    typedef std::conditional_t<std::is_void_v<T>, bool, T>  VALUE_TYPE;    // void 用 bool 占位
+
+public:
+    explicit FutureState(ThreadPool* pPool) \
+        : m_pool(pPool), \
+          m_ready(false) \
+        {  }
+
+    ~FutureState() = default;
+
+    // 设置结果，只有第一次有效
+    template<typename... Args>
+    void SetValue(Args&&... args)
+        {
+        std::vector<std::function<void()>> callbacks;
+        {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if(m_ready)
+            {
+            return;
+            }
+        m_value.emplace(std::forward<Args>(args)...);
+        m_ready = true;
+        callbacks.swap(m_callbacks);
+        }
+        Notify(callbacks);
+        }
+
+    // 设置异常，只有第一次有效
+    void SetException(std::exception_ptr exception)
+        {
+        std::vector<std::function<void()>> callbacks;
+        {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if(m_ready)
+            {
+            return;
+            }
+        m_exception = exception;
+        m_ready = true;
+        callbacks.swap(m_callbacks);
+        }
+        Notify(callbacks);
+        }
+
+    // 完成时调用 fn，已经完成时立即调用
+    void OnReady(std::function<void()> fn)
+        {
+        {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if(!m_ready)
+            {
+            m_callbacks.push_back(std::move(fn));
+            return;
+            }
+        }
+        fn();
+        }
+
+    bool IsReady()
+        {
+        std::lock_guard<std::mutex> guard(m_lock);
+        return m_ready;
+        }
+
+    // 等待完成，超时返回 false
+    bool Wait(DWORD dwMilliseconds)
+        {
+        std::unique_lock<std::mutex> guard(m_lock);
+        if(INFINITE == dwMilliseconds)
+            {
+            m_cond.wait(guard,[this]() { return m_ready; });
+            return true;
+            }
+        return m_cond.wait_for(guard,std::chrono::milliseconds(dwMilliseconds),[this]() { return m_ready; });
+        }
+
+    // 结果，有异常时重新抛出。需要先等待完成
+    VALUE_TYPE& Value()
+        {
+        if(m_exception)
+            {
+            std::rethrow_exception(m_exception);
+            }
+        return *m_value;
+        }
+
+    ThreadPool* Pool() const { return m_pool; }
+
+private:
+    void Notify(std::vector<std::function<void()>>& callbacks)
+        {
+        m_cond.notify_all();
+        for(size_t i = 0; i != callbacks.size(); ++i)
+            {
+            callbacks[i]();
+            }
+        }
+
+private:
+    ThreadPool*                         m_pool;         // 后续任务投递到这个线程池
+    std::mutex                          m_lock;
+    std::condition_variable             m_cond;
+    bool                                m_ready;
+    std::optional<VALUE_TYPE>           m_value;
+    std::exception_ptr                  m_exception;
+    std::vector<std::function<void()>>  m_callbacks;    // 完成时调用
+};
+
+
+
+// 执行任务并把结果写入共享状态
+class FutureRunner
+{
+public:
+    FutureRunner() = delete;
+    ~FutureRunner() = delete;
+public:
+    template<typename R, typename F>
+    static void Invoke(FutureState<R>& state, F& fn)
+        {
+        try
+            {
+            if constexpr(std::is_void_v<R>)
+                {
+                fn();
+                state.SetValue();
+                }
+            else
+                {
+                state.SetValue(fn());
+                }
+            }
+        catch(...)
+            {
+            state.SetException(std::current_exception());
+            }
+        }
+
+    // 投递到线程池执行，线程池没有运行时在当前线程执行
+    template<typename R, typename F>
+    static void Run(ThreadPool* pPool, const std::shared_ptr<FutureState<R>>& state, F&& fn)
+        {
+        std::function<void()> task = [state, fn = std::forward<F>(fn)]() mutable
+            { Invoke(*state,fn); };
+        if(!pPool || (-1 == pPool->Post(task)))
+            {
+            task();
+            }
+        }
+};
+
+
+
+template<typename T>
+class Future
+{
+public:
+    typedef FutureState<T>              STATE;
+    typedef std::shared_ptr<STATE>      PTR_STATE;
+
+public:
+    Future() {}
+    explicit Future(const PTR_STATE& state) : m_state(state) {}
+
+    bool IsValid() const { return m_state != nullptr; }
+    bool IsReady() const { return m_state && m_state->IsReady(); }
+
+    // 等待完成，超时返回 false
+    bool Wait(DWORD dwMilliseconds = INFINITE) const
+        { return m_state && m_state->Wait(dwMilliseconds); }
+
+    // 取结果，未完成时阻塞，任务抛出的异常在这里重新抛出
+    T Get() const
+        {
+        m_state->Wait(INFINITE);
+        if constexpr(std::is_void_v<T>)
+            {
+            m_state->Value();
+            }
+        else
+            {
+            return m_state->Value();
+            }
+        }
+
+    // 完成后把 fn(*this) 投递到线程池，返回 fn 的结果
+    template<typename F>
+    Future<std::invoke_result_t<std::decay_t<F>, Future<T>>> Then(F&& fn) const
+        {
+        typedef std::invoke_result_t<std::decay_t<F>, Future<T>> R;
+        ThreadPool* pPool = m_state->Pool();
+        std::shared_ptr<FutureState<R>> next = std::make_shared<FutureState<R>>(pPool);
+        Future<T> self = *this;
+        m_state->OnReady([pPool, next, self, fn = std::forward<F>(fn)]() mutable
+            {
+            FutureRunner::Run(pPool,next,[self, fn = std::move(fn)]() mutable { return fn(self); });
+            });
+        return Future<R>(next);
+        }
+
+    // 完成时在完成任务的线程上直接调用 fn，fn 应该很短
+    void OnReady(std::function<void()> fn) const
+        { m_state->OnReady(std::move(fn)); }
+
+    ThreadPool* Pool() const { return m_state ? m_state->Pool() : nullptr; }
+
+private:
+    PTR_STATE   m_state;
+};
+
+
+
+// 手动完成的 Future，用于把 I/O 完成之类的事件接入任务图
+template<typename T>
+class Promise
+{
+public:
+    explicit Promise(ThreadPool* pPool = nullptr) \
+        : m_state(std::make_shared<FutureState<T>>(pPool)) \
+        {  }
+
+    Future<T> GetFuture() const { return Future<T>(m_state); }
+
+    template<typename... Args>
+    void SetValue(Args&&... args) { m_state->SetValue(std::forward<Args>(args)...); }
+
+    void SetException(std::exception_ptr exception) { m_state->SetException(exception); }
+
+private:
+    std::shared_ptr<FutureState<T>>     m_state;
+};
+
+
+
+template<typename F>
+Future<std::invoke_result_t<std::decay_t<F>>> ThreadPool::Submit(F&& fn)
+    {
+    typedef std::invoke_result_t<std::decay_t<F>> R;
+    std::shared_ptr<FutureState<R>> state = std::make_shared<FutureState<R>>(this);
+    FutureRunner::Run(this,state,std::forward<F>(fn));
+    return Future<R>(state);
+    }
+
+
+// 全部完成时完成，结果为输入的 Future（都已完成）
+template<typename T>
+Future<std::vector<Future<T>>> WhenAll(const std::vector<Future<T>>& futures)
+    {
+    typedef std::vector<Future<T>> RESULT;
+    ThreadPool* pPool = futures.empty() ? nullptr : futures[0].Pool();
+    std::shared_ptr<FutureState<RESULT>> state = std::make_shared<FutureState<RESULT>>(pPool);
+    if(futures.empty())
+        {
+        state->SetValue();
+        return Future<RESULT>(state);
+        }
+    std::shared_ptr<RESULT> inputs = std::make_shared<RESULT>(futures);
+    std::shared_ptr<std::atomic<size_t>> remain = std::make_shared<std::atomic<size_t>>(futures.size());
+    for(size_t i = 0; i != futures.size(); ++i)
+        {
+        futures[i].OnReady([state, inputs, remain]()
+            {
+            if(1 == remain->fetch_sub(1))
+                {
+                state->SetValue(std::move(*inputs));
+                }
+            });
+        }
+    return Future<RESULT>(state);
+    }
+
+
+// 任意一个完成时完成，结果为最先完成的下标。输入为空时结果为 size_t(-1)
+template<typename T>
+Future<size_t> WhenAny(const std::vector<Future<T>>& futures)
+    {
+    ThreadPool* pPool = futures.empty() ? nullptr : futures[0].Pool();
+    std::shared_ptr<FutureState<size_t>> state = std::make_shared<FutureState<size_t>>(pPool);
+    if(futures.empty())
+        {
+        state->SetValue(static_cast<size_t>(-1));
+        }
+    for(size_t i = 0; i != futures.size(); ++i)
+        {
+        futures[i].OnReady([state, i]() { state->SetValue(i); });
+        }
+    return Future<size_t>(state);
+    }
+
+
+#endif //IOCPANDTHREADPOOL_FUTURE_H
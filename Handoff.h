@@ -0,0 +1,185 @@
+#ifndef IOCPANDTHREADPOOL_HANDOFF_H
+#define IOCPANDTHREADPOOL_HANDOFF_H
+
+
+#include <MSWSock.h>
+
+
+#include <string>
+
+
+#include "Transport.h"
+#include "Log.h"
+
+
+/*++
+    监听套接字交接
+        升级时新进程从旧进程继承监听套接字，两个进程在交接后同时持有同一个监听队列，
+        已经在内核队列中的连接由新进程接受，旧进程之后调用 Server::Drain 处理完存量连接退出，
+        中间没有无法接受连接的窗口。
+
+        Windows 上没有 SCM_RIGHTS，套接字通过 WSADuplicateSocket 复制：
+            1. 旧进程（Offer）在 path 上监听一个 Unix 域套接字
+            2. 新进程（Inherit）连接后发送自己的进程 ID
+            3. 旧进程为这个进程复制监听套接字，发回 WSAPROTOCOL_INFOW
+            4. 新进程用 WSASocket(FROM_PROTOCOL_INFO) 创建套接字后回复一个字节，
+               旧进程收到后才返回，之前不能关闭自己的监听套接字
+
+            // 旧进程
+            server.HandOff("C:\\run\\server.handoff",5000);
+            server.Drain(30000);
+
+            // 新进程
+            SOCKET sock = ListenerHandoff::Inherit("C:\\run\\server.handoff",5000);
+            server.AdoptListener(sock);
+            server.StartServer();
+--*/
+
+
+class ListenerHandoff
+{
+public:
+    ListenerHandoff() = delete;
+    ~ListenerHandoff() = delete;
+public:
+    // 旧进程：等待新进程连接并交出 sock，timeoutMs 内没有完成返回 false
+    static bool Offer(SOCKET sock, const std::string& path, ULONGLONG timeoutMs)
+        {
+        if(INVALID_SOCKET == sock)
+            {
+            return false;
+            }
+        Endpoint endpoint = Endpoint::Unix(path);
+        SOCKET listener = socket(AF_UNIX,SOCK_STREAM,0);
+        if(INVALID_SOCKET == listener)
+            {
+            return false;
+            }
+        // 上次交接留下的套接字文件会导致 bind 失败
+        DeleteFileA(path.c_str());
+        if((0 != bind(listener,endpoint.Addr(),endpoint.AddrLen())) || (0 != listen(listener,1)))
+            {
+            Log::Write(LogError,"handoff: listen on %s failed [%d]",path.c_str(),WSAGetLastError());
+            closesocket(listener);
+            return false;
+            }
+
+        WSAPOLLFD poll;
+        poll.fd = listener;
+        poll.events = POLLRDNORM;
+        poll.revents = 0;
+        SOCKET peer = INVALID_SOCKET;
+        if(WSAPoll(&poll,1,static_cast<INT>(timeoutMs)) > 0)
+            {
+            peer = accept(listener,nullptr,nullptr);
+            }
+        closesocket(listener);
+        DeleteFileA(path.c_str());
+        if(INVALID_SOCKET == peer)
+            {
+            Log::Write(LogWarn,"handoff: no process connected to %s",path.c_str());
+            return false;
+            }
+
+        SetTimeout(peer,timeoutMs);
+        DWORD pid = 0;
+        WSAPROTOCOL_INFOW info;
+        char ack = 0;
+        bool ret = RecvAll(peer,&pid,sizeof(pid)) \
+            && (0 == WSADuplicateSocketW(sock,pid,&info)) \
+            && SendAll(peer,&info,sizeof(info)) \
+            && RecvAll(peer,&ack,sizeof(ack));
+        closesocket(peer);
+        if(ret)
+            {
+            Log::Write(LogInfo,"handoff: listener handed to process %lu",pid);
+            }
+        else
+            {
+            Log::Write(LogError,"handoff: transfer to process %lu failed [%d]",pid,WSAGetLastError());
+            }
+        return ret;
+        }
+
+    // 新进程：从 path 上的旧进程继承监听套接字，失败返回 INVALID_SOCKET
+    static SOCKET Inherit(const std::string& path, ULONGLONG timeoutMs)
+        {
+        WSADATA data;
+        if(WSAStartup(MAKEWORD(2,2),&data) != 0)
+            {
+            return INVALID_SOCKET;
+            }
+        Endpoint endpoint = Endpoint::Unix(path);
+        SOCKET peer = socket(AF_UNIX,SOCK_STREAM,0);
+        if(INVALID_SOCKET == peer)
+            {
+            return INVALID_SOCKET;
+            }
+        SetTimeout(peer,timeoutMs);
+
+        SOCKET sock = INVALID_SOCKET;
+        DWORD pid = GetCurrentProcessId();
+        WSAPROTOCOL_INFOW info;
+        if((0 == connect(peer,endpoint.Addr(),endpoint.AddrLen())) \
+            && SendAll(peer,&pid,sizeof(pid)) \
+            && RecvAll(peer,&info,sizeof(info)))
+            {
+            sock = WSASocketW(FROM_PROTOCOL_INFO,FROM_PROTOCOL_INFO,FROM_PROTOCOL_INFO,&info,0,WSA_FLAG_OVERLAPPED);
+            }
+        if(INVALID_SOCKET != sock)
+            {
+            // 通知旧进程可以关闭它的监听套接字了
+            char ack = 1;
+            SendAll(peer,&ack,sizeof(ack));
+            }
+        else
+            {
+            Log::Write(LogError,"handoff: inherit from %s failed [%d]",path.c_str(),WSAGetLastError());
+            }
+        closesocket(peer);
+        return sock;
+        }
+
+private:
+    static void SetTimeout(SOCKET sock, ULONGLONG timeoutMs)
+        {
+        DWORD dwTimeout = static_cast<DWORD>(timeoutMs);
+        setsockopt(sock,SOL_SOCKET,SO_RCVTIMEO,reinterpret_cast<const char*>(&dwTimeout),sizeof(dwTimeout));
+        setsockopt(sock,SOL_SOCKET,SO_SNDTIMEO,reinterpret_cast<const char*>(&dwTimeout),sizeof(dwTimeout));
+        }
+
+    static bool SendAll(SOCKET sock, const void* data, size_t size)
+        {
+        const char* p = reinterpret_cast<const char*>(data);
+        while(size)
+            {
+            int ret = send(sock,p,static_cast<int>(size),0);
+            if(ret <= 0)
+                {
+                return false;
+                }
+            p += ret;
+            size -= static_cast<size_t>(ret);
+            }
+        return true;
+        }
+
+    static bool RecvAll(SOCKET sock, void* data, size_t size)
+        {
+        char* p = reinterpret_cast<char*>(data);
+        while(size)
+            {
+            int ret = recv(sock,p,static_cast<int>(size),0);
+            if(ret <= 0)
+                {
+                return false;
+                }
+            p += ret;
+            size -= static_cast<size_t>(ret);
+            }
+        return true;
+        }
+};
+
+
+#endif //IOCPANDTHREADPOOL_HANDOFF_H
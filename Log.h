@@ -0,0 +1,111 @@
+#ifndef IOCPANDTHREADPOOL_LOG_H
+#define IOCPANDTHREADPOOL_LOG_H
+
+
+#include <Windows.h>
+
+
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+
+
+/*++
+    日志
+        级别和跟踪开关在运行时修改（例如通过管理端口），检查只是一次原子读取，
+        关闭的日志不格式化字符串，可以留在完成端口线程等热路径上。
+        跟踪（trace）是单独的开关，用于逐个完成包、逐次读取这类量很大的输出。
+--*/
+
+
+enum LogLevel
+{
+    LogError    = 0,
+    LogWarn     = 1,
+    LogInfo     = 2,
+    LogDebug    = 3
+};
+
+
+class Log
+{
+public:
+    Log() = delete;
+    ~Log() = delete;
+public:
+    static void SetLevel(LogLevel level) { Level().store(level,std::memory_order_relaxed); }
+    static LogLevel GetLevel() { return static_cast<LogLevel>(Level().load(std::memory_order_relaxed)); }
+
+    static void SetTrace(bool bTrace) { Trace().store(bTrace,std::memory_order_relaxed); }
+    static bool IsTrace() { return Trace().load(std::memory_order_relaxed); }
+
+    static bool IsEnabled(LogLevel level) { return level <= Level().load(std::memory_order_relaxed); }
+
+    // 级别名称，用于解析和显示
+    static const char* LevelName(LogLevel level)
+        {
+        static const char* names[] = {"error","warn","info","debug"};
+        return ((level >= LogError) && (level <= LogDebug)) ? names[level] : "unknown";
+        }
+
+    // 按名称设置级别，名称无效返回 false
+    static bool SetLevel(const char* name)
+        {
+        for(int i = LogError; i <= LogDebug; ++i)
+            {
+            if(0 == strcmp(name,LevelName(static_cast<LogLevel>(i))))
+                {
+                SetLevel(static_cast<LogLevel>(i));
+                return true;
+                }
+            }
+        return false;
+        }
+
+    // 写到 stderr
+    static void Write(LogLevel level, const char* format, ...)
+        {
+        if(!IsEnabled(level))
+            {
+            return;
+            }
+        char buf[1024];
+        va_list args;
+        va_start(args,format);
+        vsnprintf(buf,sizeof(buf),format,args);
+        va_end(args);
+        fprintf(stderr,"[%s][%lu] %s\n",LevelName(level),GetCurrentThreadId(),buf);
+        }
+
+    // 跟踪输出，只在打开跟踪时写
+    static void TraceWrite(const char* format, ...)
+        {
+        if(!IsTrace())
+            {
+            return;
+            }
+        char buf[1024];
+        va_list args;
+        va_start(args,format);
+        vsnprintf(buf,sizeof(buf),format,args);
+        va_end(args);
+        fprintf(stderr,"[trace][%lu] %s\n",GetCurrentThreadId(),buf);
+        }
+
+private:
+    static std::atomic<int>& Level()
+        {
+        static std::atomic<int> level{LogInfo};
+        return level;
+        }
+
+    static std::atomic<bool>& Trace()
+        {
+        static std::atomic<bool> trace{false};
+        return trace;
+        }
+};
+
+
+#endif //IOCPANDTHREADPOOL_LOG_H
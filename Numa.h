@@ -0,0 +1,389 @@
+#ifndef IOCPANDTHREADPOOL_NUMA_H
+#define IOCPANDTHREADPOOL_NUMA_H
+
+
+#include <Windows.h>
+
+
+#include <algorithm>
+#include <mutex>
+#include <new>
+#include <vector>
+
+
+/*++
+    NUMA 相关工具
+        线程绑定核心后，连接的缓冲区和 Client 对象从所属线程的 NUMA 节点上分配，
+        避免跨节点访问内存。
+--*/
+
+
+
+class Numa
+{
+public:
+    Numa() = delete;
+    ~Numa() = delete;
+public:
+    enum
+        {
+        NumaMaxNodes = 64
+        };
+
+    // 当前线程所在的 NUMA 节点，结果缓存在线程本地
+    static USHORT CurrentNode()
+        {
+        USHORT& node = LocalNode();
+        if(NumaMaxNodes == node)
+            {
+            node = QueryNode();
+            }
+        return node;
+        }
+
+    // 线程亲和性变化后重新获取节点
+    static void Refresh()
+        { LocalNode() = QueryNode(); }
+
+    // NUMA 节点数量
+    static ULONG NodeCount()
+        {
+        ULONG highest = 0;
+        if(!GetNumaHighestNodeNumber(&highest))
+            {
+            return 1;
+            }
+        return (std::min)(highest + 1, static_cast<ULONG>(NumaMaxNodes));
+        }
+
+    // 每个 NUMA 节点一个亲和性掩码
+    static std::vector<GROUP_AFFINITY> NodeAffinities()
+        {
+        std::vector<GROUP_AFFINITY> ret;
+        ULONG count = NodeCount();
+        for(ULONG i = 0; i != count; ++i)
+            {
+            GROUP_AFFINITY affinity;
+            memset(&affinity,0,sizeof(affinity));
+            if(GetNumaNodeProcessorMaskEx(static_cast<USHORT>(i),&affinity) && affinity.Mask)
+                {
+                ret.push_back(affinity);
+                }
+            }
+        return ret;
+        }
+
+    // 每个逻辑处理器一个亲和性掩码，按节点依次排列
+    static std::vector<GROUP_AFFINITY> CoreAffinities()
+        {
+        std::vector<GROUP_AFFINITY> ret;
+        std::vector<GROUP_AFFINITY> nodes = NodeAffinities();
+        for(size_t i = 0; i != nodes.size(); ++i)
+            {
+            for(size_t bit = 0; bit != sizeof(KAFFINITY) * 8; ++bit)
+                {
+                KAFFINITY mask = static_cast<KAFFINITY>(1) << bit;
+                if(nodes[i].Mask & mask)
+                    {
+                    ret.push_back(MakeAffinity(nodes[i].Group,mask));
+                    }
+                }
+            }
+        return ret;
+        }
+
+    static GROUP_AFFINITY MakeAffinity(WORD group, KAFFINITY mask)
+        {
+        GROUP_AFFINITY affinity;
+        memset(&affinity,0,sizeof(affinity));
+        affinity.Group = group;
+        affinity.Mask = mask;
+        return affinity;
+        }
+
+    // 将当前线程绑定到指定的核心集合
+    static bool PinCurrentThread(const GROUP_AFFINITY& affinity)
+        {
+        bool ret = SetThreadGroupAffinity(GetCurrentThread(),&affinity,nullptr) != FALSE;
+        Refresh();
+        return ret;
+        }
+
+private:
+    static USHORT& LocalNode()
+        {
+        thread_local USHORT node = NumaMaxNodes;
+        return node;
+        }
+
+    static USHORT QueryNode()
+        {
+        PROCESSOR_NUMBER processor;
+        USHORT node = 0;
+        GetCurrentProcessorNumberEx(&processor);
+        if(!GetNumaProcessorNodeEx(&processor,&node) || node >= NumaMaxNodes)
+            {
+            node = 0;
+            }
+        return node;
+        }
+};
+
+
+
+/*++
+    按 NUMA 节点划分的内存堆
+        小块按 2 的幂分级，从各节点上的 1MB 内存块中切分，释放后进入所属节点的空闲链表。
+        每个内存块前面有 16 字节的头部，记录节点和分级，释放时不需要知道大小。
+        每个线程在节点的空闲链表前面有一层不加锁的缓存（每级最多 NHCacheDepth 块），
+        连接的重叠结构这类频繁分配释放的小对象大多在缓存中周转，不争用节点上的锁。
+--*/
+class NumaHeap
+{
+public:
+    NumaHeap() = delete;
+    ~NumaHeap() = delete;
+public:
+    // 在指定节点上分配
+    static void* Allocate(size_t size, USHORT node)
+        {
+        size_t index = IndexOf(size + sizeof(Header));
+        Header* pHeader = nullptr;
+        if(index >= NHClasses)
+            {
+            // 大块直接向系统申请
+            size_t total = size + sizeof(Header);
+            pHeader = reinterpret_cast<Header*>(VirtualAllocExNuma(GetCurrentProcess(), \
+                nullptr,total,MEM_RESERVE | MEM_COMMIT,PAGE_READWRITE,node));
+            if(!pHeader)
+                {
+                throw std::bad_alloc();
+                }
+            pHeader->m_size = total;
+            }
+        else
+            {
+            pHeader = reinterpret_cast<Header*>(Cache().Pop(index,node));
+            if(!pHeader)
+                {
+                pHeader = reinterpret_cast<Header*>(Bin(node,index).Pop(ClassSize(index),node));
+                }
+            pHeader->m_size = 0;
+            }
+        pHeader->m_node = node;
+        pHeader->m_index = static_cast<USHORT>(index);
+        return pHeader + 1;
+        }
+
+    // 在当前线程所在的节点上分配
+    static void* Allocate(size_t size)
+        { return Allocate(size,Numa::CurrentNode()); }
+
+    // 分配 size 字节实际占用的内存（包括头部和分级取整）
+    static size_t BlockSize(size_t size)
+        {
+        size_t index = IndexOf(size + sizeof(Header));
+        return (index >= NHClasses) ? size + sizeof(Header) : ClassSize(index);
+        }
+
+    static void Free(void* ptr)
+        {
+        if(!ptr)
+            {
+            return;
+            }
+        Header* pHeader = reinterpret_cast<Header*>(ptr) - 1;
+        if(pHeader->m_index >= NHClasses)
+            {
+            VirtualFree(pHeader,0,MEM_RELEASE);
+            return;
+            }
+        USHORT node = pHeader->m_node;
+        USHORT index = pHeader->m_index;
+        if(!Cache().Push(index,node,pHeader))
+            {
+            Bin(node,index).Push(pHeader);
+            }
+        }
+
+private:
+    enum
+        {
+        NHMinShift  = 6,                // 最小 64 字节
+        NHClasses   = 11,               // 最大 64KB
+        NHChunkSize = 1024 * 1024,      // 每次向系统申请的大小
+        NHCacheDepth = 32               // 线程缓存每级最多保留的块
+        };
+
+    // 16 字节头部，保证返回的地址 16 字节对齐
+    struct alignas(16) Header
+        {
+        size_t  m_size;     // 大块的总大小，小块为 0
+        USHORT  m_node;
+        USHORT  m_index;
+        };
+
+    struct Node
+        {
+        Node*   m_next;
+        };
+
+    // 某个节点上某一级的空闲链表
+    class FreeList
+        {
+    public:
+        void* Pop(size_t size, USHORT node)
+            {
+            std::lock_guard<std::mutex> guard(m_lock);
+            if(!m_head)
+                {
+                Refill(size,node);
+                }
+            Node* pNode = m_head;
+            m_head = pNode->m_next;
+            return pNode;
+            }
+
+        void Push(void* ptr)
+            {
+            std::lock_guard<std::mutex> guard(m_lock);
+            Node* pNode = reinterpret_cast<Node*>(ptr);
+            pNode->m_next = m_head;
+            m_head = pNode;
+            }
+    private:
+        // 从节点上申请一个内存块并切分，内存块不归还系统
+        void Refill(size_t size, USHORT node)
+            {
+            char* pChunk = reinterpret_cast<char*>(VirtualAllocExNuma(GetCurrentProcess(), \
+                nullptr,NHChunkSize,MEM_RESERVE | MEM_COMMIT,PAGE_READWRITE,node));
+            if(!pChunk)
+                {
+                throw std::bad_alloc();
+                }
+            for(size_t offset = 0; offset + size <= NHChunkSize; offset += size)
+                {
+                Node* pNode = reinterpret_cast<Node*>(pChunk + offset);
+                pNode->m_next = m_head;
+                m_head = pNode;
+                }
+            }
+    private:
+        std::mutex  m_lock;
+        Node*       m_head = nullptr;
+        };
+
+    // 线程缓存，只缓存线程所在节点的块，线程退出时归还到节点的空闲链表
+    class ThreadCache
+        {
+    public:
+        ThreadCache() : m_node(Numa::CurrentNode())
+            {
+            for(size_t i = 0; i != NHClasses; ++i)
+                {
+                m_heads[i] = nullptr;
+                m_counts[i] = 0;
+                }
+            }
+
+        ~ThreadCache()
+            {
+            for(size_t i = 0; i != NHClasses; ++i)
+                {
+                while(m_heads[i])
+                    {
+                    Node* pNode = m_heads[i];
+                    m_heads[i] = pNode->m_next;
+                    Bin(m_node,i).Push(pNode);
+                    }
+                }
+            }
+
+        void* Pop(size_t index, USHORT node)
+            {
+            if((node != m_node) || !m_heads[index])
+                {
+                return nullptr;
+                }
+            Node* pNode = m_heads[index];
+            m_heads[index] = pNode->m_next;
+            --m_counts[index];
+            return pNode;
+            }
+
+        // 缓存已满或者不是本节点的块返回 false
+        bool Push(size_t index, USHORT node, void* ptr)
+            {
+            if((node != m_node) || (m_counts[index] >= NHCacheDepth))
+                {
+                return false;
+                }
+            Node* pNode = reinterpret_cast<Node*>(ptr);
+            pNode->m_next = m_heads[index];
+            m_heads[index] = pNode;
+            ++m_counts[index];
+            return true;
+            }
+    private:
+        USHORT  m_node;
+        Node*   m_heads[NHClasses];
+        size_t  m_counts[NHClasses];
+        };
+
+    static ThreadCache& Cache()
+        {
+        thread_local ThreadCache cache;
+        return cache;
+        }
+
+    static size_t ClassSize(size_t index)
+        { return static_cast<size_t>(1) << (index + NHMinShift); }
+
+    static size_t IndexOf(size_t size)
+        {
+        size_t index = 0;
+        while(index < NHClasses && ClassSize(index) < size)
+            {
+            ++index;
+            }
+        return index;
+        }
+
+    static FreeList& Bin(USHORT node, size_t index)
+        {
+        static FreeList bins[Numa::NumaMaxNodes][NHClasses];
+        return bins[node][index];
+        }
+};
+
+
+
+// 从当前线程所在节点分配的 STL 分配器
+template<typename T>
+class NumaAllocator
+{
+public:
+    typedef T value_type;
+
+    NumaAllocator() noexcept = default;
+    template<typename U>
+    NumaAllocator(const NumaAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n)
+        { return reinterpret_cast<T*>(NumaHeap::Allocate(n * sizeof(T))); }
+
+    void deallocate(T* ptr, size_t)
+        { NumaHeap::Free(ptr); }
+
+    template<typename U>
+    bool operator==(const NumaAllocator<U>&) const noexcept { return true; }
+    template<typename U>
+    bool operator!=(const NumaAllocator<U>&) const noexcept { return false; }
+};
+
+
+// 连接缓冲区
+typedef std::vector<char, NumaAllocator<char>>  NUMA_BUFFER;
+
+
+#endif //IOCPANDTHREADPOOL_NUMA_H
@@ -0,0 +1,233 @@
+#ifndef IOCPANDTHREADPOOL_PARALLEL_H
+#define IOCPANDTHREADPOOL_PARALLEL_H
+
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+
+#include "Thread.h"
+
+
+/*++
+    线程池上的并行算法
+        TaskGroup 把任务放在自己的队列中，每个任务再向线程池投递一个"帮手"，帮手从队列中取一个任务执行。
+        Wait 时调用线程也从队列中取任务执行，直到全部完成，所以：
+        1. 线程池全忙（甚至在线程池线程中嵌套调用）时不会死锁，最坏情况下由调用线程全部执行
+        2. 不创建额外的线程，空闲的线程池线程自动参与
+        ParallelFor/ParallelReduce 基于 TaskGroup，按粒度把区间拆分成任务。
+--*/
+
+
+
+class TaskGroup
+{
+public:
+    explicit TaskGroup(ThreadPool& pool) \
+        : m_pool(pool), \
+          m_state(std::make_shared<State>()) \
+        {  }
+
+    // 析构前必须 Wait，这里兜底，保证任务不会引用已经销毁的数据
+    ~TaskGroup()
+        {
+        try
+            {
+            Wait();
+            }
+        catch(...)
+            {
+            }
+        }
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    // 加入一个任务
+    void Run(std::function<void()> fn)
+        {
+        {
+        std::lock_guard<std::mutex> guard(m_state->m_lock);
+        m_state->m_tasks.push_back(std::move(fn));
+        ++m_state->m_pending;
+        }
+        // 唤醒正在 Wait 的线程，让它也来执行新任务（例如其他线程上嵌套拆分出来的）
+        m_state->m_cond.notify_all();
+        // 投递失败时任务留在队列中，由 Wait 执行
+        std::shared_ptr<State> state = m_state;
+        m_pool.Post([state]() { state->RunOne(); });
+        }
+
+    // 等待全部任务完成，等待期间执行队列中的任务，包括等待期间其他线程加入的。
+    // 任务抛出的第一个异常在这里重新抛出
+    void Wait()
+        {
+        for(;;)
+            {
+            while(m_state->RunOne())
+                {
+                }
+            std::unique_lock<std::mutex> guard(m_state->m_lock);
+            m_state->m_cond.wait(guard,[this]() { return (0 == m_state->m_pending) || !m_state->m_tasks.empty(); });
+            if(0 == m_state->m_pending)
+                {
+                break;
+                }
+            }
+        std::unique_lock<std::mutex> guard(m_state->m_lock);
+        if(m_state->m_exception)
+            {
+            std::exception_ptr exception = m_state->m_exception;
+            m_state->m_exception = nullptr;
+            std::rethrow_exception(exception);
+            }
+        }
+
+    ThreadPool& Pool() { return m_pool; }
+
+private:
+    // 由帮手和等待者共享，帮手可能在 TaskGroup 析构后才执行
+    struct State
+        {
+        std::mutex                          m_lock;
+        std::condition_variable             m_cond;
+        std::deque<std::function<void()>>   m_tasks;        // 还没有开始的任务
+        size_t                              m_pending = 0;  // 还没有结束的任务
+        std::exception_ptr                  m_exception;
+
+        // 取一个任务执行，队列为空返回 false
+        bool RunOne()
+            {
+            std::function<void()> fn;
+            {
+            std::lock_guard<std::mutex> guard(m_lock);
+            if(m_tasks.empty())
+                {
+                return false;
+                }
+            fn = std::move(m_tasks.front());
+            m_tasks.pop_front();
+            }
+            std::exception_ptr exception;
+            try
+                {
+                fn();
+                }
+            catch(...)
+                {
+                exception = std::current_exception();
+                }
+            std::lock_guard<std::mutex> guard(m_lock);
+            if(exception && !m_exception)
+                {
+                m_exception = exception;
+                }
+            if(0 == --m_pending)
+                {
+                m_cond.notify_all();
+                }
+            return true;
+            }
+        };
+
+    ThreadPool&             m_pool;
+    std::shared_ptr<State>  m_state;
+};
+
+
+
+// 默认粒度：每个线程大约 8 个任务，兼顾负载均衡和调度开销
+inline size_t ParallelGrain(ThreadPool& pool, size_t count)
+    {
+    size_t threads = (std::max)(static_cast<size_t>(1),pool.GetOptions().m_maxThreads);
+    return (std::max)(static_cast<size_t>(1),count / (threads * 8));
+    }
+
+
+// 对 [begin, end) 的子区间调用 fn(first, last)。grain 为 0 时自动确定。
+// 区间按二分拆分，上半部分交给其他线程，调用线程继续拆分下半部分，直到不超过 grain
+template<typename F>
+void ParallelForRange(ThreadPool& pool, size_t begin, size_t end, const F& fn, size_t grain = 0)
+    {
+    if(begin >= end)
+        {
+        return;
+        }
+    if(0 == grain)
+        {
+        grain = ParallelGrain(pool,end - begin);
+        }
+    if(end - begin <= grain)
+        {
+        fn(begin,end);
+        return;
+        }
+
+    // split 要比 group 后销毁：fn 在调用线程上抛出异常时，~TaskGroup 先等待仍在引用 split 的任务
+    std::function<void(size_t, size_t)> split;
+    TaskGroup group(pool);
+    split = [&](size_t first, size_t last)
+        {
+        while(last - first > grain)
+            {
+            size_t mid = first + (last - first) / 2;
+            group.Run([&split, mid, last]() { split(mid,last); });
+            last = mid;
+            }
+        fn(first,last);
+        };
+    split(begin,end);
+    group.Wait();
+    }
+
+
+// 对 [begin, end) 中的每个下标调用 fn(i)
+template<typename F>
+void ParallelFor(ThreadPool& pool, size_t begin, size_t end, const F& fn, size_t grain = 0)
+    {
+    ParallelForRange(pool,begin,end,[&fn](size_t first, size_t last)
+        {
+        for(size_t i = first; i != last; ++i)
+            {
+            fn(i);
+            }
+        },grain);
+    }
+
+
+// 归约。每段调用 fn(first, last) 得到部分结果，再按区间顺序用 combine 合并，
+// 所以 combine 只需要满足结合律，不要求交换律
+template<typename T, typename F, typename C>
+T ParallelReduce(ThreadPool& pool, size_t begin, size_t end, T identity, const F& fn, const C& combine, size_t grain = 0)
+    {
+    if(begin >= end)
+        {
+        return identity;
+        }
+    if(0 == grain)
+        {
+        grain = ParallelGrain(pool,end - begin);
+        }
+    size_t chunks = (end - begin + grain - 1) / grain;
+    std::deque<T> partials(chunks,identity);    // 不用 vector，避免 vector<bool> 并发写同一个字节
+    ParallelFor(pool,0,chunks,[&](size_t index)
+        {
+        size_t first = begin + index * grain;
+        size_t last = (std::min)(end,first + grain);
+        partials[index] = fn(first,last);
+        },1);
+
+    T result = identity;
+    for(size_t i = 0; i != chunks; ++i)
+        {
+        result = combine(result,partials[i]);
+        }
+    return result;
+    }
+
+
+#endif //IOCPANDTHREADPOOL_PARALLEL_H
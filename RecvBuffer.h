@@ -0,0 +1,151 @@
+#ifndef IOCPANDTHREADPOOL_RECVBUFFER_H
+#define IOCPANDTHREADPOOL_RECVBUFFER_H
+
+
+#include <atomic>
+
+
+#include "Numa.h"
+
+
+/*++
+    自适应接收缓冲区
+        连接的接收缓冲区按实际读到的大小调整（参考 Netty 的 AdaptiveRecvByteBufAllocator）：
+        一次读满当前大小时增大两级，连续两次读到的数据不超过小一级的大小时减小一级，
+        大小在 64B 到 64KB 之间按 2 的幂取值，正好对应 NumaHeap 的分级，缓冲区归还后由 NumaHeap 复用。
+        连接空闲时用零字节 WSARecv 等待数据，缓冲区中没有未处理的数据就归还，空闲连接不占用任何缓冲区。
+        缓冲区放不下不完整的消息时加倍，超过连接的上限（Client::SetMaxRecvBuffer）就断开连接，
+        对端不能只发一个很大的消息头就让服务器一直分配内存。
+--*/
+
+
+
+// 接收缓冲区运行指标
+struct RecvBufferMetrics
+{
+    size_t  m_acquired      = 0;    // 分配次数
+    size_t  m_released      = 0;    // 归还次数
+    size_t  m_parked        = 0;    // 空闲时归还缓冲区的次数
+    size_t  m_grown         = 0;    // 为了放下不完整的消息而扩大的次数
+    size_t  m_oversized     = 0;    // 不完整的消息超过上限而断开的连接数
+    size_t  m_bytesInUse    = 0;    // 正在使用的缓冲区总大小
+};
+
+
+// 下一次读取的缓冲区大小预测
+class AdaptiveSizer
+{
+public:
+    enum
+        {
+        ASMinShift      = 6,    // 最小 64B
+        ASMaxShift      = 16,   // 最大 64KB
+        ASInitialShift  = 10,   // 初始 1KB
+        ASGrowStep      = 2     // 读满时一次增大的级数
+        };
+
+public:
+    AdaptiveSizer() \
+        : m_shift(ASInitialShift), \
+          m_decrease(false) \
+        {  }
+
+    size_t NextSize() const
+        { return static_cast<size_t>(1) << m_shift; }
+
+    // 记录一次读取的字节数
+    void Record(size_t bytes)
+        {
+        if((m_shift > ASMinShift) && (bytes <= (static_cast<size_t>(1) << (m_shift - 1))))
+            {
+            // 连续两次偏小才减小，避免来回抖动
+            if(m_decrease)
+                {
+                --m_shift;
+                m_decrease = false;
+                }
+            else
+                {
+                m_decrease = true;
+                }
+            }
+        else if(bytes >= NextSize())
+            {
+            m_shift = (std::min)(m_shift + ASGrowStep,static_cast<size_t>(ASMaxShift));
+            m_decrease = false;
+            }
+        else
+            {
+            m_decrease = false;
+            }
+        }
+
+private:
+    size_t  m_shift;
+    bool    m_decrease;
+};
+
+
+// 接收缓冲区的分配和计数，内存由 NumaHeap 按大小分级复用
+class RecvBufferPool
+{
+public:
+    RecvBufferPool() = delete;
+    ~RecvBufferPool() = delete;
+public:
+    static char* Acquire(size_t size)
+        {
+        Counters& counters = Get();
+        ++counters.m_acquired;
+        counters.m_bytesInUse += size;
+        return reinterpret_cast<char*>(NumaHeap::Allocate(size));
+        }
+
+    static void Release(char* ptr, size_t size, bool bParked)
+        {
+        Counters& counters = Get();
+        ++counters.m_released;
+        counters.m_parked += bParked ? 1 : 0;
+        counters.m_bytesInUse -= size;
+        NumaHeap::Free(ptr);
+        }
+
+    static void CountGrow()
+        { ++Get().m_grown; }
+
+    static void CountOversized()
+        { ++Get().m_oversized; }
+
+    static RecvBufferMetrics GetMetrics()
+        {
+        Counters& counters = Get();
+        RecvBufferMetrics metrics;
+        metrics.m_acquired = counters.m_acquired.load();
+        metrics.m_released = counters.m_released.load();
+        metrics.m_parked = counters.m_parked.load();
+        metrics.m_grown = counters.m_grown.load();
+        metrics.m_oversized = counters.m_oversized.load();
+        metrics.m_bytesInUse = counters.m_bytesInUse.load();
+        return metrics;
+        }
+
+private:
+    struct Counters
+        {
+        std::atomic<size_t>     m_acquired{0};
+        std::atomic<size_t>     m_released{0};
+        std::atomic<size_t>     m_parked{0};
+        std::atomic<size_t>     m_grown{0};
+        std::atomic<size_t>     m_oversized{0};
+        std::atomic<size_t>     m_bytesInUse{0};
+        };
+
+    static Counters& Get()
+        {
+        static Counters counters;
+        return counters;
+        }
+};
+
+
+#endif //IOCPANDTHREADPOOL_RECVBUFFER_H
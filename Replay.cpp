@@ -0,0 +1,363 @@
+/*++
+    录制流量重放工具
+        读取 CaptureLog 录制的文件，按录制时的连接和时间间隔把数据重新发给本地的 Server，
+        报告吞吐量和延迟。延迟是从发出请求（上一次响应之后的第一个字节）到收到响应第一个字节的时间。
+
+            Replay <文件> <ip> <端口> [--fast | --speed 倍数]
+                --fast      不等待，尽快发送
+                --speed N   按 N 倍速重放，默认 1
+--*/
+
+
+#include <MSWSock.h>
+
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+
+#include "Capture.h"
+#include "Transport.h"
+
+
+enum
+{
+    ReplayBufferSize    = 64 * 1024,    // 接收缓冲区
+    ReplayTailMs        = 2000          // 发完后等待响应的最长时间
+};
+
+
+// 重放中的连接
+struct ReplayConn
+{
+    SOCKET      m_sock          = INVALID_SOCKET;
+    LONGLONG    m_pendingSince  = 0;    // 等待响应的请求的发送时间，0 表示没有
+};
+
+
+class Replayer
+{
+public:
+    Replayer(const Endpoint& endpoint, bool bFast, double speed) \
+        : m_endpoint(endpoint), \
+          m_fast(bFast), \
+          m_speed(speed), \
+          m_frames(0), \
+          m_connections(0), \
+          m_sent(0), \
+          m_received(0), \
+          m_errors(0), \
+          m_captureMs(0), \
+          m_elapsedMs(0) \
+        {
+        LARGE_INTEGER freq;
+        QueryPerformanceFrequency(&freq);
+        m_frequency = freq.QuadPart;
+        m_buffer.resize(ReplayBufferSize);
+        }
+
+    ~Replayer()
+        {
+        std::map<uint32_t, ReplayConn>::iterator it = m_conns.begin();
+        for(; it != m_conns.end(); ++it)
+            {
+            Close(it->second);
+            }
+        }
+
+    // 重放所有帧，返回 0 表示成功
+    int Run(CaptureReader& reader)
+        {
+        // 不同连接的帧按预留空间的顺序写入，时间戳可能交错，先按时间排序
+        std::vector<const CaptureFrame*> frames;
+        for(const CaptureFrame* pFrame = reader.Next(); pFrame; pFrame = reader.Next())
+            {
+            frames.push_back(pFrame);
+            }
+        std::stable_sort(frames.begin(),frames.end(),[](const CaptureFrame* a, const CaptureFrame* b)
+            { return a->m_ticks < b->m_ticks; });
+        if(frames.empty())
+            {
+            fprintf(stderr,"no frames in capture\n");
+            return 1;
+            }
+        double fileFrequency = static_cast<double>(reader.Header()->m_frequency);
+        m_captureMs = frames.back()->m_ticks * 1000.0 / fileFrequency;
+
+        LONGLONG start = Now();
+        for(size_t i = 0; i != frames.size(); ++i)
+            {
+            const CaptureFrame* pFrame = frames[i];
+            if(!m_fast)
+                {
+                LONGLONG target = start + static_cast<LONGLONG>(pFrame->m_ticks * m_frequency / fileFrequency / m_speed);
+                for(LONGLONG now = Now(); now < target; now = Now())
+                    {
+                    Pump(static_cast<INT>((target - now) * 1000 / m_frequency));
+                    }
+                }
+            Play(pFrame);
+            Pump(0);
+            }
+
+        // 等待最后的响应
+        LONGLONG deadline = Now() + ReplayTailMs * m_frequency / 1000;
+        while(Pending() && (Now() < deadline))
+            {
+            Pump(10);
+            }
+        m_elapsedMs = (Now() - start) * 1000.0 / m_frequency;
+        return 0;
+        }
+
+    void Report()
+        {
+        double seconds = (std::max)(m_elapsedMs / 1000.0,1e-6);
+        printf("frames       %zu (%zu connections, %zu errors)\n",m_frames,m_connections,m_errors);
+        printf("elapsed      %.1f ms (captured over %.1f ms)\n",m_elapsedMs,m_captureMs);
+        printf("sent         %zu bytes, %.2f MB/s, %.0f frames/s\n",m_sent,m_sent / seconds / (1024 * 1024),m_frames / seconds);
+        printf("received     %zu bytes, %.2f MB/s\n",m_received,m_received / seconds / (1024 * 1024));
+        if(m_latencies.empty())
+            {
+            printf("latency      no responses\n");
+            return;
+            }
+        std::sort(m_latencies.begin(),m_latencies.end());
+        printf("latency us   count=%zu p50=%.1f p90=%.1f p99=%.1f max=%.1f\n",m_latencies.size(), \
+            Percentile(0.50),Percentile(0.90),Percentile(0.99),m_latencies.back());
+        }
+
+private:
+    LONGLONG Now()
+        {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        return now.QuadPart;
+        }
+
+    double Percentile(double p)
+        {
+        size_t index = static_cast<size_t>(p * (m_latencies.size() - 1));
+        return m_latencies[index];
+        }
+
+    // 执行一帧
+    void Play(const CaptureFrame* pFrame)
+        {
+        ++m_frames;
+        switch(pFrame->m_type)
+            {
+        case CaptureOpen:
+            Connect(m_conns[pFrame->m_conn]);
+            break;
+        case CaptureData:
+            {
+            // 录制开始前就已经建立的连接没有 CaptureOpen，第一次发送时连接
+            ReplayConn& conn = m_conns[pFrame->m_conn];
+            if((INVALID_SOCKET == conn.m_sock) && !Connect(conn))
+                {
+                break;
+                }
+            if(!conn.m_pendingSince)
+                {
+                conn.m_pendingSince = Now();
+                }
+            const char* data = CaptureReader::Data(pFrame);
+            size_t size = pFrame->m_length;
+            while(size)
+                {
+                int ret = send(conn.m_sock,data,static_cast<int>(size),0);
+                if(ret <= 0)
+                    {
+                    ++m_errors;
+                    Close(conn);
+                    break;
+                    }
+                data += ret;
+                size -= static_cast<size_t>(ret);
+                m_sent += static_cast<size_t>(ret);
+                }
+            }
+            break;
+        case CaptureClose:
+            {
+            std::map<uint32_t, ReplayConn>::iterator it = m_conns.find(pFrame->m_conn);
+            if(it != m_conns.end())
+                {
+                Close(it->second);
+                }
+            }
+            break;
+        default:
+            break;
+            }
+        }
+
+    bool Connect(ReplayConn& conn)
+        {
+        Close(conn);
+        conn.m_sock = socket(m_endpoint.Family(),SOCK_STREAM,0);
+        if((INVALID_SOCKET == conn.m_sock) || (0 != connect(conn.m_sock,m_endpoint.Addr(),m_endpoint.AddrLen())))
+            {
+            ++m_errors;
+            Close(conn);
+            return false;
+            }
+        if(AF_INET == m_endpoint.Family())
+            {
+            BOOL opt = TRUE;
+            setsockopt(conn.m_sock,IPPROTO_TCP,TCP_NODELAY,reinterpret_cast<const char*>(&opt),sizeof(opt));
+            }
+        ++m_connections;
+        return true;
+        }
+
+    void Close(ReplayConn& conn)
+        {
+        if(conn.m_sock != INVALID_SOCKET)
+            {
+            closesocket(conn.m_sock);
+            conn.m_sock = INVALID_SOCKET;
+            }
+        conn.m_pendingSince = 0;
+        }
+
+    // 还有等待响应的请求
+    bool Pending()
+        {
+        std::map<uint32_t, ReplayConn>::iterator it = m_conns.begin();
+        for(; it != m_conns.end(); ++it)
+            {
+            if((it->second.m_sock != INVALID_SOCKET) && it->second.m_pendingSince)
+                {
+                return true;
+                }
+            }
+        return false;
+        }
+
+    // 读取所有连接上的响应，最多等待 timeoutMs
+    void Pump(INT timeoutMs)
+        {
+        std::vector<WSAPOLLFD> polls;
+        std::vector<ReplayConn*> conns;
+        std::map<uint32_t, ReplayConn>::iterator it = m_conns.begin();
+        for(; it != m_conns.end(); ++it)
+            {
+            if(it->second.m_sock != INVALID_SOCKET)
+                {
+                WSAPOLLFD poll;
+                poll.fd = it->second.m_sock;
+                poll.events = POLLRDNORM;
+                poll.revents = 0;
+                polls.push_back(poll);
+                conns.push_back(&it->second);
+                }
+            }
+        if(polls.empty())
+            {
+            if(timeoutMs > 0)
+                {
+                Sleep(static_cast<DWORD>(timeoutMs));
+                }
+            return;
+            }
+        if(WSAPoll(polls.data(),static_cast<ULONG>(polls.size()),timeoutMs) <= 0)
+            {
+            return;
+            }
+        LONGLONG now = Now();
+        for(size_t i = 0; i != polls.size(); ++i)
+            {
+            if(!polls[i].revents)
+                {
+                continue;
+                }
+            ReplayConn& conn = *conns[i];
+            int ret = recv(conn.m_sock,m_buffer.data(),static_cast<int>(m_buffer.size()),0);
+            if(ret <= 0)
+                {
+                Close(conn);
+                continue;
+                }
+            m_received += static_cast<size_t>(ret);
+            if(conn.m_pendingSince)
+                {
+                m_latencies.push_back((now - conn.m_pendingSince) * 1000000.0 / m_frequency);
+                conn.m_pendingSince = 0;
+                }
+            }
+        }
+
+private:
+    Endpoint                        m_endpoint;
+    bool                            m_fast;
+    double                          m_speed;
+    LONGLONG                        m_frequency;
+    std::map<uint32_t, ReplayConn>  m_conns;
+    std::vector<char>               m_buffer;
+    std::vector<double>             m_latencies;    // 微秒
+    size_t                          m_frames;
+    size_t                          m_connections;
+    size_t                          m_sent;
+    size_t                          m_received;
+    size_t                          m_errors;
+    double                          m_captureMs;    // 录制的时长
+    double                          m_elapsedMs;
+};
+
+
+
+int main(int argc, char* argv[])
+    {
+    if(argc < 4)
+        {
+        fprintf(stderr,"usage: %s <capture file> <ip> <port> [--fast | --speed N]\n",argv[0]);
+        return 2;
+        }
+    bool bFast = false;
+    double speed = 1.0;
+    for(int i = 4; i < argc; ++i)
+        {
+        if(0 == strcmp(argv[i],"--fast"))
+            {
+            bFast = true;
+            }
+        else if((0 == strcmp(argv[i],"--speed")) && (i + 1 < argc))
+            {
+            speed = atof(argv[++i]);
+            }
+        }
+    if(speed <= 0)
+        {
+        fprintf(stderr,"speed must be positive\n");
+        return 2;
+        }
+
+    WSADATA data;
+    if(WSAStartup(MAKEWORD(2,2),&data) != 0)
+        {
+        return 1;
+        }
+
+    CaptureReader reader;
+    if(!reader.Open(argv[1]))
+        {
+        fprintf(stderr,"cannot read capture %s\n",argv[1]);
+        return 1;
+        }
+
+    Replayer replayer(Endpoint::Inet(argv[2],static_cast<short>(atoi(argv[3]))),bFast,speed);
+    int ret = replayer.Run(reader);
+    if(0 == ret)
+        {
+        replayer.Report();
+        }
+    WSACleanup();
+    return ret;
+    }
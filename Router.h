@@ -0,0 +1,239 @@
+#ifndef IOCPANDTHREADPOOL_ROUTER_H
+#define IOCPANDTHREADPOOL_ROUTER_H
+
+
+#include <Windows.h>
+
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+
+#include "Thread.h"
+
+
+class Client;
+
+
+/*++
+    按操作码分发消息
+        消息格式：8 字节消息头（操作码、标志、负载长度，小端）后跟负载。
+        处理函数在编译期注册，生成按操作码下标的稠密分发表，分发时只有一次下标访问和一次函数调用，
+        没有虚函数也没有查表用的 map：
+
+            int OnLogin(Client* pClient, const char* payload, size_t size);
+            int OnQuote(Client* pClient, const char* payload, size_t size);
+
+            typedef Router<Route<1,&OnLogin>, Route<2,&OnQuote>>  APP_ROUTER;
+            APP_ROUTER router;
+            server.SetMessageHandler(&router,reinterpret_cast<MESSAGE_CALLBACK>(&APP_ROUTER::Consume));
+
+        分发表的大小等于最大操作码加一，操作码应该从小到大连续分配。
+        每个操作码统计消息数、出错数和处理耗时的直方图（按 2 的幂分桶，单位微秒）。
+--*/
+
+
+
+// 消息头
+struct MessageHeader
+{
+    enum {MHMaxLength = 16 * 1024 * 1024};     // 负载的最大长度，超过视为格式错误
+
+    uint16_t    m_opcode;
+    uint16_t    m_flags;
+    uint32_t    m_length;       // 负载长度，不含消息头
+};
+static_assert(sizeof(MessageHeader) == 8, "MessageHeader must be 8 bytes");
+
+
+// 处理函数，返回 0 表示成功，其他值计入出错数
+typedef int (*ROUTE_HANDLER)(Client* pClient, const char* payload, size_t size);
+
+
+// 一条注册：操作码和处理函数
+template<uint16_t Op, ROUTE_HANDLER Fn>
+struct Route
+{
+    static constexpr uint16_t       Opcode  = Op;
+    static constexpr ROUTE_HANDLER  Handler = Fn;
+};
+
+
+// 单个操作码的运行指标
+struct RouteMetrics
+{
+    enum {RMBuckets = 20};      // 第 i 个桶统计耗时小于 2^i 微秒的消息，最后一个桶包含更长的
+
+    size_t      m_count     = 0;
+    size_t      m_errors    = 0;
+    ULONGLONG   m_totalUs   = 0;
+    size_t      m_histogram[RMBuckets] = {};
+};
+
+
+
+template<typename... Routes>
+class Router \
+        : public ThreadFuncBase
+{
+public:
+    static constexpr size_t RouteCount = sizeof...(Routes);
+    static_assert(RouteCount > 0, "Router needs at least one route");
+
+public:
+    Router()
+        {
+        LARGE_INTEGER freq;
+        QueryPerformanceFrequency(&freq);
+        m_frequency = freq.QuadPart;
+        m_unknown = 0;
+        m_malformed = 0;
+        }
+
+    ~Router() = default;
+
+    // 处理 data 中所有完整的消息，返回处理掉的字节数，剩下的是不完整的消息。
+    // 返回 -1 表示消息格式错误，连接应该关闭
+    int Consume(Client* pClient, const char* data, size_t size)
+        {
+        size_t offset = 0;
+        while(size - offset >= sizeof(MessageHeader))
+            {
+            MessageHeader header;
+            memcpy(&header,data + offset,sizeof(header));
+            if(header.m_length > MessageHeader::MHMaxLength)
+                {
+                ++m_malformed;
+                return -1;
+                }
+            size_t total = sizeof(header) + header.m_length;
+            if(size - offset < total)
+                {
+                break;
+                }
+            Dispatch(header.m_opcode,pClient,data + offset + sizeof(header),header.m_length);
+            offset += total;
+            }
+        return static_cast<int>(offset);
+        }
+
+    // 分发一条消息，返回处理函数的返回值，未注册的操作码返回 -1
+    int Dispatch(uint16_t opcode, Client* pClient, const char* payload, size_t size)
+        {
+        if(opcode >= TableSize || !Table[opcode].m_handler)
+            {
+            ++m_unknown;
+            return -1;
+            }
+        const Entry& entry = Table[opcode];
+        LARGE_INTEGER start, end;
+        QueryPerformanceCounter(&start);
+        int ret = entry.m_handler(pClient,payload,size);
+        QueryPerformanceCounter(&end);
+        Record(m_stats[entry.m_slot],end.QuadPart - start.QuadPart,ret);
+        return ret;
+        }
+
+    // 单个操作码的指标，未注册的操作码返回全 0
+    RouteMetrics GetMetrics(uint16_t opcode) const
+        {
+        RouteMetrics metrics;
+        if(opcode >= TableSize || !Table[opcode].m_handler)
+            {
+            return metrics;
+            }
+        const Stats& stats = m_stats[Table[opcode].m_slot];
+        metrics.m_count = stats.m_count.load(std::memory_order_relaxed);
+        metrics.m_errors = stats.m_errors.load(std::memory_order_relaxed);
+        metrics.m_totalUs = stats.m_totalUs.load(std::memory_order_relaxed);
+        for(size_t i = 0; i != RouteMetrics::RMBuckets; ++i)
+            {
+            metrics.m_histogram[i] = stats.m_histogram[i].load(std::memory_order_relaxed);
+            }
+        return metrics;
+        }
+
+    // 所有注册的操作码
+    static constexpr std::array<uint16_t, RouteCount> Opcodes()
+        { return std::array<uint16_t, RouteCount>{Routes::Opcode...}; }
+
+    size_t UnknownCount() const { return m_unknown.load(); }
+    size_t MalformedCount() const { return m_malformed.load(); }
+
+private:
+    struct Entry
+        {
+        ROUTE_HANDLER   m_handler;
+        uint16_t        m_slot;     // 统计数据的下标
+        };
+
+    struct Stats
+        {
+        std::atomic<size_t>     m_count{0};
+        std::atomic<size_t>     m_errors{0};
+        std::atomic<ULONGLONG>  m_totalUs{0};
+        std::atomic<size_t>     m_histogram[RouteMetrics::RMBuckets] = {};
+        };
+
+    static constexpr size_t MaxOpcode()
+        {
+        size_t value = 0;
+        ((value = (std::max)(value,static_cast<size_t>(Routes::Opcode))), ...);
+        return value;
+        }
+
+    static constexpr bool Unique()
+        {
+        constexpr std::array<uint16_t, RouteCount> opcodes = {Routes::Opcode...};
+        for(size_t i = 0; i != RouteCount; ++i)
+            {
+            for(size_t j = i + 1; j != RouteCount; ++j)
+                {
+                if(opcodes[i] == opcodes[j])
+                    {
+                    return false;
+                    }
+                }
+            }
+        return true;
+        }
+    static_assert(Unique(), "duplicate opcode in Router");
+
+    static constexpr size_t TableSize = MaxOpcode() + 1;
+
+    static constexpr std::array<Entry, TableSize> Build()
+        {
+        std::array<Entry, TableSize> table{};
+        uint16_t slot = 0;
+        ((table[Routes::Opcode] = Entry{Routes::Handler, slot++}), ...);
+        return table;
+        }
+
+    static constexpr std::array<Entry, TableSize> Table = Build();
+
+    void Record(Stats& stats, LONGLONG ticks, int ret)
+        {
+        ULONGLONG us = static_cast<ULONGLONG>(ticks) * 1000000 / m_frequency;
+        size_t bucket = 0;
+        while((bucket + 1 < RouteMetrics::RMBuckets) && ((1ULL << bucket) <= us))
+            {
+            ++bucket;
+            }
+        stats.m_count.fetch_add(1,std::memory_order_relaxed);
+        stats.m_errors.fetch_add(ret ? 1 : 0,std::memory_order_relaxed);
+        stats.m_totalUs.fetch_add(us,std::memory_order_relaxed);
+        stats.m_histogram[bucket].fetch_add(1,std::memory_order_relaxed);
+        }
+
+private:
+    LONGLONG                            m_frequency;
+    std::array<Stats, RouteCount>       m_stats;
+    std::atomic<size_t>                 m_unknown;      // 未注册的操作码
+    std::atomic<size_t>                 m_malformed;    // 格式错误
+};
+
+
+#endif //IOCPANDTHREADPOOL_ROUTER_H
@@ -1,305 +1,1879 @@
 #include "Server.h"
+#include "Datagram.h"
+#include "Parallel.h"
 
-Client::Client() \
-    : m_isBusy(false), \
+Client::Client(int family, ThreadPool* pPool) \
+    : m_recvBuf(nullptr), \
+      m_recvCap(0), \
+      m_usedBuf(0), \
+      m_dwReceived(0), \
       m_dwFlags(0), \
-      m_ptrOverlapped(new ACCEPTOVERLAPPED), \
+      m_sending(false), \
+      m_stopRecv(false), \
+      m_corkDepth(0), \
+      m_captureId(0), \
+      m_maxRecv(ClientMaxRecvBuffer), \
+      m_capture(nullptr), \
+      m_backlog(0), \
+      m_bufferBytes(0), \
+      m_ioPending(0), \
       m_ptrRecv(new RECVOVERLAPPED), \
-      m_ptrSend(new SENDOVERLAPPED), \
-      m_vecSend(this,reinterpret_cast<SEND_CALLBACK>(&Client::SendData)) \
+      m_msgObj(nullptr), \
+      m_msgCallback(nullptr), \
+      m_strand(pPool), \
+      m_refs(1), \
+      m_ptrOverlapped(new ACCEPTOVERLAPPED), \
+      m_send(nullptr), \
+      m_hIocp(nullptr) \
     {
-    printf("m_ptrOverlapped %08X\r\n",&m_ptrOverlapped);
+    Log::TraceWrite("m_ptrOverlapped %p",m_ptrOverlapped.get());
+    memset(&m_raddr,0,sizeof(m_raddr));
 
-    m_sock = WSASocket(PF_INET,SOCK_STREAM,0, nullptr,0,WSA_FLAG_OVERLAPPED);
-    m_buffer.resize(1024);
-    memset(&m_laddr,0,sizeof(m_laddr));
+    m_sock = INVALID_SOCKET;
+    if(family != AF_UNSPEC)
+        {
+        m_sock = WSASocket(family,SOCK_STREAM,0, nullptr,0,WSA_FLAG_OVERLAPPED);
+        }
+    }
+
+
+Client::~Client()
+    {
+    // 由 Drain 关闭的连接在这里写关闭帧，Recv 发现关闭的连接已经写过
+    Capture(CaptureClose);
+    ReleaseRecv(false);
+    if(m_link)
+        {
+        m_link->Close();
+        }
+    if(m_sock != INVALID_SOCKET)
+        {
+        closesocket(m_sock);
+        }
+    delete m_send.load();
+    }
+
+
+// 连接到进程内通道
+void Client::AttachInProc(const PTR_LINK& link, HANDLE hIocp)
+    {
+    m_link = link;
+    m_hIocp = hIocp;
+    }
+
+
+// 保存对端地址，IPv4/IPv6 以外的地址族不保存
+void Client::SetRemoteAddr(const sockaddr* pAddr, int length)
+    {
     memset(&m_raddr,0,sizeof(m_raddr));
+    if(!pAddr)
+        {
+        return;
+        }
+    if((AF_INET == pAddr->sa_family) && (length >= static_cast<int>(sizeof(m_raddr.Ipv4))))
+        {
+        memcpy(&m_raddr.Ipv4,pAddr,sizeof(m_raddr.Ipv4));
+        }
+    else if((AF_INET6 == pAddr->sa_family) && (length >= static_cast<int>(sizeof(m_raddr.Ipv6))))
+        {
+        memcpy(&m_raddr.Ipv6,pAddr,sizeof(m_raddr.Ipv6));
+        }
+    }
+
+
+// 读取本地地址
+bool Client::GetLocalAddr(SOCKADDR_STORAGE& addr)
+    {
+    memset(&addr,0,sizeof(addr));
+    if(m_link || (INVALID_SOCKET == m_sock))
+        {
+        return false;
+        }
+    int length = sizeof(addr);
+    return 0 == getsockname(m_sock,reinterpret_cast<sockaddr*>(&addr),&length);
+    }
+
+
+// 投递接收，返回值同 WSARecv
+int Client::PostRecv(LPWSABUF lpBuffers, LPOVERLAPPED lpOverlapped)
+    {
+    if(m_link)
+        {
+        m_link->m_toServer.ReadAsync(lpBuffers->buf,lpBuffers->len,lpOverlapped,m_hIocp,reinterpret_cast<ULONG_PTR>(this));
+        WSASetLastError(WSA_IO_PENDING);
+        return SOCKET_ERROR;
+        }
+    DWORD dwFlags = 0;
+    return WSARecv(m_sock,lpBuffers,1,nullptr,&dwFlags,lpOverlapped,nullptr);
+    }
+
+
+// 投递发送，返回值同 WSASend
+int Client::PostSend(LPWSABUF lpBuffers, DWORD dwCount, LPOVERLAPPED lpOverlapped)
+    {
+    if(m_link)
+        {
+        DWORD dwTotal = 0;
+        for(DWORD i = 0; i != dwCount; ++i)
+            {
+            if(m_link->m_toClient.Write(lpBuffers[i].buf,lpBuffers[i].len) < 0)
+                {
+                WSASetLastError(WSAECONNRESET);
+                return SOCKET_ERROR;
+                }
+            dwTotal += lpBuffers[i].len;
+            }
+        PostQueuedCompletionStatus(m_hIocp,dwTotal,reinterpret_cast<ULONG_PTR>(this),lpOverlapped);
+        WSASetLastError(WSA_IO_PENDING);
+        return SOCKET_ERROR;
+        }
+    return WSASend(m_sock,lpBuffers,dwCount,nullptr,0,lpOverlapped,nullptr);
+    }
+
+
+// 立即读取，返回值同 recv
+int Client::ReadNow(char* buffer, size_t size)
+    {
+    if(m_link)
+        {
+        int ret = m_link->m_toServer.TryRead(buffer,size);
+        if(ret < 0)
+            {
+            WSASetLastError(WSAEWOULDBLOCK);
+            return SOCKET_ERROR;
+            }
+        return ret;
+        }
+    return recv(m_sock,buffer,static_cast<int>(size),0);
+    }
+
+
+// 接收
+int Client::Recv()
+    {
+    if(!m_recvBuf && !ReserveRecv(m_sizer.NextSize()))
+        {
+        return -1;
+        }
+    if(m_usedBuf == m_recvCap)
+        {
+        // 缓冲区中是不完整的消息，扩大后继续读。超过上限说明消息太大或者对端在消耗内存，断开连接
+        if(m_recvCap * 2 > m_maxRecv)
+            {
+            Log::Write(LogWarn,"recv: incomplete message exceeds %u bytes, closing connection",m_maxRecv);
+            RecvBufferPool::CountOversized();
+            return Closed();
+            }
+        RecvBufferPool::CountGrow();
+        if(!ReserveRecv(m_recvCap * 2))
+            {
+            return -1;
+            }
+        }
+
+    int ret = ReadNow(m_recvBuf + m_usedBuf,m_recvCap - m_usedBuf);
+    if(ret <= 0)
+        {
+        if((SOCKET_ERROR == ret) && (WSAEWOULDBLOCK == WSAGetLastError()))
+            {
+            // 暂时没有数据：没有未处理的数据时归还缓冲区和 Arena 的块，再投递零字节接收，等数据到达后再处理
+            if(0 == m_usedBuf)
+                {
+                ReleaseRecv(true);
+                m_arena.Trim();
+                }
+            if(!m_stopRecv.load(std::memory_order_relaxed))
+                {
+                PostOwnRecv();
+                }
+            return -1;
+            }
+        // 对端关闭或者出错
+        return Closed();
+        }
+    m_sizer.Record(static_cast<size_t>(ret));
+    m_usedBuf += static_cast<size_t>(ret);
+    Capture(CaptureData,m_recvBuf + m_usedBuf - ret,static_cast<size_t>(ret));
+
+    // 解析和回复中的临时对象从 m_arena 分配，处理完后整体释放
+    ArenaScope scope(m_arena);
+
+    size_t consumed = m_usedBuf;
+    if(m_msgObj && m_msgCallback)
+        {
+        // 按消息处理，不完整的消息留在缓冲区中等待后续数据
+        // 这一批消息产生的回复合并成一次发送
+        int handled = 0;
+        {
+        CorkScope cork(*this);
+        handled = (m_msgObj->*m_msgCallback)(this,m_recvBuf,m_usedBuf);
+        }
+        if(handled < 0)
+            {
+            // 数据错误（例如 Router::Consume 遇到超过 MHMaxLength 的长度），断开并注销连接。
+            // 之前的消息产生的回复在 Uncork 时已经进入发送队列，断开后以失败完成
+            Log::Write(LogWarn,"recv: message handler rejected data, closing connection");
+            return Closed();
+            }
+        consumed = static_cast<size_t>(handled);
+        }
+    else if(Log::IsTrace())
+        {
+        Tools::Dump(reinterpret_cast<BYTE*>(m_recvBuf + m_usedBuf - ret),ret);
+        }
+
+    // 未处理的数据移到缓冲区开头
+    if(consumed < m_usedBuf)
+        {
+        memmove(m_recvBuf,m_recvBuf + consumed,m_usedBuf - consumed);
+        }
+    m_usedBuf -= consumed;
+
+    // 缓冲区比预测大得多时归还，下一次按预测的大小重新分配
+    if((0 == m_usedBuf) && (m_recvCap > 2 * m_sizer.NextSize()))
+        {
+        ReleaseRecv(false);
+        }
+    return 0;
+    }
+
+
+// 投递连接自己的零字节接收
+int Client::PostOwnRecv()
+    {
+    if(!m_link)
+        {
+        IoStarted();
+        }
+    int ret = PostRecv(RecvWSABuffer(),RecvOverlapped());
+    if(!m_link && (SOCKET_ERROR == ret) && (WSAGetLastError() != WSA_IO_PENDING))
+        {
+        IoDone();
+        }
+    return ret;
+    }
+
+
+// 连接关闭
+int Client::Closed()
+    {
+    // 在发现关闭的时候写关闭帧，重放时按录制的时间关闭连接。之后不再录制，析构时不重复写
+    Capture(CaptureClose);
+    m_capture = nullptr;
+    Abort();
+    ReleaseRecv(false);
+    m_arena.Trim();
+    return -2;
+    }
+
+
+// 保证接收缓冲区至少有 size 字节
+bool Client::ReserveRecv(size_t size)
+    {
+    if(m_recvCap >= size)
+        {
+        return true;
+        }
+    char* pBuffer = RecvBufferPool::Acquire(size);
+    if(!pBuffer)
+        {
+        return false;
+        }
+    if(m_recvBuf)
+        {
+        memcpy(pBuffer,m_recvBuf,m_usedBuf);
+        RecvBufferPool::Release(m_recvBuf,m_recvCap,false);
+        }
+    m_recvBuf = pBuffer;
+    m_recvCap = size;
+    m_bufferBytes.store(size,std::memory_order_relaxed);
+    return true;
+    }
+
+
+// 归还接收缓冲区
+void Client::ReleaseRecv(bool bParked)
+    {
+    if(m_recvBuf)
+        {
+        RecvBufferPool::Release(m_recvBuf,m_recvCap,bParked);
+        m_recvBuf = nullptr;
+        m_recvCap = 0;
+        m_usedBuf = 0;
+        m_bufferBytes.store(0,std::memory_order_relaxed);
+        }
+    }
+
+
+// 发送，数据会复制到发送队列中
+int Client::Send(void* buffer, size_t size, SEND_DONE done)
+    {
+    SendItem item;
+    item.m_data.resize(size);
+    memcpy(item.m_data.data(),buffer,size);
+    item.m_done = done;
+    if(Submit(std::move(item)))
+        {
+        return 0;
+        }
+    return -1;
+    }
+
+
+// 发送文件的一部分，length 为 0 表示发送到文件末尾
+int Client::SendFile(const std::string& path, ULONGLONG offset, ULONGLONG length, SEND_DONE done)
+    {
+    HANDLE hFile = CreateFile(path.c_str(), \
+        GENERIC_READ, \
+        FILE_SHARE_READ, \
+        nullptr, \
+        OPEN_EXISTING, \
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, \
+        nullptr);
+    if(INVALID_HANDLE_VALUE == hFile)
+        {
+        return -1;
+        }
+    if(0 == SubmitFile(hFile,offset,length,true,done))
+        {
+        return 0;
+        }
+    CloseHandle(hFile);
+    return -1;
+    }
+
+
+// 发送已经打开的文件，length 的含义和按路径发送相同
+int Client::SendFile(HANDLE hFile, ULONGLONG offset, ULONGLONG length, SEND_DONE done)
+    {
+    return SubmitFile(hFile,offset,length,false,done);
+    }
+
+
+// 换算文件区域的实际长度后进入发送队列。
+// TransmitFile 把 0 当作整个文件并且不考虑 offset，所以不能把 0 直接交给它
+int Client::SubmitFile(HANDLE hFile, ULONGLONG offset, ULONGLONG length, bool bCloseFile, SEND_DONE done)
+    {
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(hFile,&size) || (offset > static_cast<ULONGLONG>(size.QuadPart)))
+        {
+        return -1;
+        }
+    if(0 == length || (offset + length > static_cast<ULONGLONG>(size.QuadPart)))
+        {
+        length = static_cast<ULONGLONG>(size.QuadPart) - offset;
+        }
+    if(0 == length)
+        {
+        // 空区域（空文件或者 offset 在文件末尾）没有可发送的数据，直接完成
+        if(bCloseFile)
+            {
+            CloseHandle(hFile);
+            }
+        if(done)
+            {
+            done(0,0);
+            }
+        return 0;
+        }
+
+    SendItem item;
+    item.m_type = SendItem::SIFile;
+    item.m_hFile = hFile;
+    item.m_offset = offset;
+    item.m_length = length;
+    item.m_closeFile = bCloseFile;
+    item.m_done = done;
+    if(Submit(std::move(item)))
+        {
+        return 0;
+        }
+    return -1;
+    }
+
+
+// 发送共享的只读数据，不复制
+int Client::SendShared(std::shared_ptr<const void> owner, const char* data, size_t size, SEND_DONE done)
+    {
+    SendItem item;
+    item.m_type = SendItem::SIShared;
+    item.m_owner = std::move(owner);
+    item.m_pShared = data;
+    item.m_sharedSize = size;
+    item.m_done = done;
+    if(Submit(std::move(item)))
+        {
+        return 0;
+        }
+    return -1;
+    }
+
+
+// 发送状态，第一次调用时分配。两个线程同时分配时只保留先装入的一个
+ClientSend* Client::SendState()
+    {
+    ClientSend* pSend = m_send.load(std::memory_order_acquire);
+    if(pSend)
+        {
+        return pSend;
+        }
+    ClientSend* pNew = new ClientSend;
+    if(m_send.compare_exchange_strong(pSend,pNew,std::memory_order_acq_rel))
+        {
+        return pNew;
+        }
+    delete pNew;
+    return pSend;
+    }
+
+
+// 进入发送队列并计数。没有正在发送的项时取一个发送上下文，在当前线程开始发送
+bool Client::Enqueue(SendItem&& item, std::unique_lock<std::mutex>& guard)
+    {
+    m_backlog.fetch_add(1,std::memory_order_relaxed);
+    if(m_sending.load(std::memory_order_relaxed))
+        {
+        m_send.load(std::memory_order_relaxed)->m_pending.push_back(std::move(item));
+        guard.unlock();
+        return true;
+        }
+    m_sending.store(true,std::memory_order_relaxed);
+    m_ptrSend.reset(new SENDOVERLAPPED);
+    m_ptrSend->m_client = this;
+    m_ptrSend->m_item = std::move(item);
+    guard.unlock();
+
+    if(!StartSend())
+        {
+        // 调用者可能是其他连接的处理函数或者广播的线程，失败的完成交给连接的 strand，
+        // SEND_DONE 回调和接收处理不会同时运行
+        m_ptrSend->m_dwTransferred = 0;
+        m_ptrSend->m_dwError = WSAGetLastError();
+        m_strand.Post(&m_ptrSend->m_task);
+        }
+    return true;
+    }
+
+
+// Cork 期间暂存，否则直接进入发送队列
+bool Client::Submit(SendItem&& item)
+    {
+    ClientSend* pSend = SendState();
+    std::unique_lock<std::mutex> guard(pSend->m_lock);
+    if(m_corkDepth.load() > 0)
+        {
+        if(item.m_type != SendItem::SIFile)
+            {
+            pSend->m_corked.push_back(std::move(item));
+            return true;
+            }
+        // 文件不能合并，先发出暂存的数据，保持发送顺序
+        FlushCorked(guard);
+        guard.lock();
+        }
+    return Enqueue(std::move(item),guard);
+    }
+
+
+// 开始合并发送。只修改计数，不分配发送状态：处理函数执行期间自动 Cork，不回复的连接不需要发送状态
+void Client::Cork()
+    {
+    m_corkDepth.fetch_add(1);
+    }
+
+
+// 最外层的 Uncork 发出暂存的数据
+void Client::Uncork()
+    {
+    ClientSend* pSend = m_send.load(std::memory_order_acquire);
+    if(pSend)
+        {
+        std::unique_lock<std::mutex> guard(pSend->m_lock);
+        if(0 == m_corkDepth.load())
+            {
+            return;
+            }
+        if(1 == m_corkDepth.fetch_sub(1))
+            {
+            FlushCorked(guard);
+            }
+        return;
+        }
+
+    // 还没有发送状态，暂存区为空，不加锁减少计数
+    int depth = m_corkDepth.load();
+    while((depth > 0) && !m_corkDepth.compare_exchange_weak(depth,depth - 1))
+        {
+        }
+    if(depth != 1)
+        {
+        return;
+        }
+    // 减少计数之前另一个线程可能已经分配了发送状态并看到计数为 1 而暂存，由这里发出
+    pSend = m_send.load(std::memory_order_acquire);
+    if(pSend)
+        {
+        std::unique_lock<std::mutex> guard(pSend->m_lock);
+        if(0 == m_corkDepth.load())
+            {
+            FlushCorked(guard);
+            }
+        }
+    }
+
+
+// 暂存的数据合并成一个发送项
+void Client::FlushCorked(std::unique_lock<std::mutex>& guard)
+    {
+    std::vector<SendItem>& corked = m_send.load(std::memory_order_relaxed)->m_corked;
+    if(corked.empty())
+        {
+        guard.unlock();
+        return;
+        }
+    if(1 == corked.size())
+        {
+        SendItem item = std::move(corked.front());
+        std::vector<SendItem>().swap(corked);
+        Enqueue(std::move(item),guard);
+        }
+    else
+        {
+        SendItem item;
+        item.m_type = SendItem::SIGather;
+        item.m_parts.swap(corked);
+        Enqueue(std::move(item),guard);
+        }
+    }
+
+
+// 取消未完成的操作，完成包以失败投递到完成端口
+void Client::CancelIo()
+    {
+    if(m_link)
+        {
+        m_link->Close();
+        return;
+        }
+    if(m_sock != INVALID_SOCKET)
+        {
+        CancelIoEx(reinterpret_cast<HANDLE>(m_sock),nullptr);
+        }
+    }
+
+
+// 断开连接
+void Client::Abort()
+    {
+    m_stopRecv.store(true,std::memory_order_relaxed);
+    if(m_link)
+        {
+        m_link->Close();
+        return;
+        }
+    if(m_sock != INVALID_SOCKET)
+        {
+        shutdown(m_sock,SD_BOTH);
+        CancelIoEx(reinterpret_cast<HANDLE>(m_sock),nullptr);
+        }
+    }
+
+
+// 关闭 Nagle 算法
+bool Client::SetNoDelay(bool bNoDelay)
+    {
+    if(m_link || (INVALID_SOCKET == m_sock))
+        {
+        return true;
+        }
+    BOOL opt = bNoDelay ? TRUE : FALSE;
+    return 0 == setsockopt(m_sock,IPPROTO_TCP,TCP_NODELAY,reinterpret_cast<const char*>(&opt),sizeof(opt));
+    }
+
+
+// 发送当前项剩余的部分
+bool Client::StartSend()
+    {
+    SendItem& item = m_ptrSend->m_item;
+    memset(&m_ptrSend->m_overlapped,0,sizeof(m_ptrSend->m_overlapped));
+    ULONGLONG remain = item.Length() - item.m_sent;
+    if(!m_link)
+        {
+        IoStarted();
+        }
+
+    int ret = 0;
+    if(SendItem::SIFile == item.m_type && m_link)
+        {
+        // 进程内通道没有 TransmitFile，分块读到发送缓冲区中再写入
+        DWORD dwBytes = static_cast<DWORD>((std::min)(remain,static_cast<ULONGLONG>(64 * 1024)));
+        ULONGLONG position = item.m_offset + item.m_sent;
+        OVERLAPPED ov;
+        memset(&ov,0,sizeof(ov));
+        ov.Offset = static_cast<DWORD>(position & 0xFFFFFFFF);
+        ov.OffsetHigh = static_cast<DWORD>(position >> 32);
+        m_ptrSend->m_buffer.resize(dwBytes);
+        DWORD dwRead = 0;
+        if(!ReadFile(item.m_hFile,m_ptrSend->m_buffer.data(),dwBytes,&dwRead,&ov) || !dwRead)
+            {
+            WSASetLastError(WSAECONNRESET);
+            return false;
+            }
+        m_ptrSend->m_wsaBuffer.buf = m_ptrSend->m_buffer.data();
+        m_ptrSend->m_wsaBuffer.len = dwRead;
+        ret = PostSend(&m_ptrSend->m_wsaBuffer,1,&m_ptrSend->m_overlapped);
+        }
+    else if(SendItem::SIFile == item.m_type)
+        {
+        // TransmitFile 一次最多发送 2^31 - 2 字节，剩余的部分在完成后继续发送
+        ULONGLONG position = item.m_offset + item.m_sent;
+        m_ptrSend->m_overlapped.Offset = static_cast<DWORD>(position & 0xFFFFFFFF);
+        m_ptrSend->m_overlapped.OffsetHigh = static_cast<DWORD>(position >> 32);
+        DWORD dwBytes = static_cast<DWORD>((std::min)(remain,static_cast<ULONGLONG>(0x7FFFFFFE)));
+        ret = TransmitFile(m_sock,item.m_hFile,dwBytes,0,&m_ptrSend->m_overlapped,nullptr,0) ? 0 : SOCKET_ERROR;
+        }
+    else if(SendItem::SIGather == item.m_type)
+        {
+        // 跳过已经发送的部分，剩下的每一部分一个 WSABUF
+        m_ptrSend->m_gather.clear();
+        ULONGLONG skip = item.m_sent;
+        for(size_t i = 0; i != item.m_parts.size(); ++i)
+            {
+            ULONGLONG length = item.m_parts[i].Length();
+            if(skip >= length)
+                {
+                skip -= length;
+                continue;
+                }
+            WSABUF buffer;
+            buffer.buf = const_cast<CHAR*>(item.m_parts[i].Data()) + skip;
+            buffer.len = static_cast<ULONG>(length - skip);
+            m_ptrSend->m_gather.push_back(buffer);
+            skip = 0;
+            }
+        ret = PostSend(m_ptrSend->m_gather.data(),static_cast<DWORD>(m_ptrSend->m_gather.size()),&m_ptrSend->m_overlapped);
+        }
+    else if(SendItem::SIShared == item.m_type)
+        {
+        m_ptrSend->m_wsaBuffer.buf = const_cast<CHAR*>(item.m_pShared) + item.m_sent;
+        m_ptrSend->m_wsaBuffer.len = static_cast<ULONG>(remain);
+        ret = PostSend(&m_ptrSend->m_wsaBuffer,1,&m_ptrSend->m_overlapped);
+        }
+    else
+        {
+        m_ptrSend->m_wsaBuffer.buf = item.m_data.data() + item.m_sent;
+        m_ptrSend->m_wsaBuffer.len = static_cast<ULONG>(remain);
+        ret = PostSend(&m_ptrSend->m_wsaBuffer,1,&m_ptrSend->m_overlapped);
+        }
+
+    if(SOCKET_ERROR == ret && WSAGetLastError() != WSA_IO_PENDING)
+        {
+        if(!m_link)
+            {
+            IoDone();
+            }
+        std::cerr << "send failed! [" << WSAGetLastError() \
+                  << "] (" << Tools::GetErrorInfo(WSAGetLastError()).c_str() \
+                  << ")" << std::endl;
+        return false;
+        }
+    return true;
+    }
+
+
+// 发送完成。没有发送完时继续发送剩余部分，全部完成或失败后回调并开始发送队列中的下一项。
+// 队列为空时释放发送上下文，调用者（SendWorker）之后不能再访问它
+void Client::OnSendComplete(DWORD dwTransferred, DWORD dwError)
+    {
+    for(;;)
+        {
+        SendItem& item = m_ptrSend->m_item;
+        if(!dwError)
+            {
+            item.m_sent += dwTransferred;
+            if(item.m_sent < item.Length())
+                {
+                if(dwTransferred > 0 && StartSend())
+                    {
+                    return;
+                    }
+                dwError = dwTransferred > 0 ? WSAGetLastError() : WSAECONNRESET;
+                }
+            }
+
+        SEND_DONE done = std::move(item.m_done);
+        ULONGLONG sent = item.m_sent;
+        std::vector<SendItem> parts = std::move(item.m_parts);
+        if(item.m_closeFile && (item.m_hFile != INVALID_HANDLE_VALUE))
+            {
+            CloseHandle(item.m_hFile);
+            }
+        item = SendItem();
+        m_backlog.fetch_sub(1,std::memory_order_relaxed);
+
+        // 取下一项，没有时释放上下文，之后的 Send 重新分配
+        std::unique_ptr<SENDOVERLAPPED> ptrIdle;
+        bool bNext = false;
+        {
+        ClientSend* pSend = m_send.load(std::memory_order_relaxed);
+        std::lock_guard<std::mutex> guard(pSend->m_lock);
+        if(pSend->m_pending.empty())
+            {
+            ptrIdle = std::move(m_ptrSend);
+            m_sending.store(false,std::memory_order_relaxed);
+            // 队列用完后归还元素占用的块，空闲连接只保留 ClientSend 本身
+            pSend->m_pending.shrink_to_fit();
+            }
+        else
+            {
+            m_ptrSend->m_item = std::move(pSend->m_pending.front());
+            pSend->m_pending.pop_front();
+            bNext = true;
+            }
+        }
+        ptrIdle.reset();
+
+        if(done)
+            {
+            done(static_cast<int>(dwError),sent);
+            }
+        // 合并的发送项按每一部分实际发出的字节数分别回调
+        for(size_t i = 0; i != parts.size(); ++i)
+            {
+            ULONGLONG length = parts[i].Length();
+            ULONGLONG partSent = (std::min)(sent,length);
+            sent -= partSent;
+            if(parts[i].m_done)
+                {
+                parts[i].m_done((partSent < length) ? static_cast<int>(dwError) : 0,partSent);
+                }
+            }
+
+        if(!bNext || StartSend())
+            {
+            return;
+            }
+        // 下一项投递失败，按失败完成后继续
+        dwTransferred = 0;
+        dwError = WSAGetLastError();
+        }
+    }
+
+
+// 设置重叠结构，发送上下文在开始发送时设置
+void Client::SetOverlapped(Client* ptr)
+    {
+    if(m_ptrOverlapped)
+        {
+        m_ptrOverlapped->m_client = ptr;
+        }
+    m_ptrRecv->m_client = ptr;
+    }
+
+
+Client::operator PVOID() { return m_ptrOverlapped ? reinterpret_cast<PVOID>(m_ptrOverlapped->m_addrBuf) : nullptr; }
+
+
+Client::operator LPOVERLAPPED() { return m_ptrOverlapped ? &m_ptrOverlapped->m_overlapped : nullptr; }
+
+
+LPWSABUF Client::RecvWSABuffer() { return &m_ptrRecv->m_wsaBuffer; }
+
+
+LPOVERLAPPED Client::RecvOverlapped() { return &m_ptrRecv->m_overlapped; }
+
+
+// 连接建立后释放 accept 的上下文
+void Client::ReleaseAccept() { m_ptrOverlapped.reset(); }
+
+
+// 空闲连接占用的内存，按 NumaHeap 的分级计算实际分配的大小
+size_t Client::IdleFootprint()
+    {
+    return NumaHeap::BlockSize(sizeof(Client)) \
+        + NumaHeap::BlockSize(sizeof(RECVOVERLAPPED));
+    }
+
+
+// 发送过数据的连接另外保留的发送状态
+size_t Client::SendStateFootprint() { return NumaHeap::BlockSize(sizeof(ClientSend)); }
+
+
+
+template<IoOperator _Op> \
+AcceptOverlapped<_Op>::AcceptOverlapped()
+    {
+    m_worker = ThreadWorker(this, reinterpret_cast<FUNCTYPE>(&AcceptOverlapped<_Op>::AcceptWorker));
+    m_operator = IOAccept;
+    memset(&m_overlapped,0,sizeof(m_overlapped));
+    memset(m_addrBuf,0,sizeof(m_addrBuf));
+    m_server = nullptr;
+    }
+
+
+template<IoOperator _Op> \
+int AcceptOverlapped<_Op>::AcceptWorker()
+    {
+    Log::TraceWrite("AcceptWorker this %p",this);
+
+    if(m_client)
+        {
+        Server* pServer = m_server;
+        if(!pServer->AdmitConnection(m_client))
+            {
+            // 连接已经删除，这个重叠结构属于它，之后不能再访问成员
+            return pServer->ContinueAccept() ? -1 : -2;
+            }
+
+        pServer->CompleteAccept(m_client);
+
+        // 地址已经取出，accept 的上下文（也就是 this）不再需要，释放后不能再访问成员
+        Client* pClient = m_client;
+        pClient->ReleaseAccept();
+        pClient->Capture(CaptureOpen);
+
+        int ret = pClient->PostOwnRecv();
+
+        if (SOCKET_ERROR == ret && (WSAGetLastError() != WSA_IO_PENDING))
+            {
+            // TODO: 报错
+            std::cerr << "WSARecv failed! [" << WSAGetLastError() \
+                      << "] (" << Tools::GetErrorInfo(WSAGetLastError()).c_str() \
+                      << ")" << std::endl;
+            }
+        if (!pServer->ContinueAccept())
+            {
+            return -2;
+            }
+        }
+    return -1;  // 必须返回 -1，否则循环不会终止！！！
+    }
+
+
+template<IoOperator _Op> \
+RecvOverlapped<_Op>::RecvOverlapped()
+    {
+    m_operator = _Op;
+    m_worker = ThreadWorker(this,reinterpret_cast<FUNCTYPE>(&RecvOverlapped<_Op>::RecvWorker));
+    m_task.m_worker = m_worker;
+    memset(&m_overlapped,0,sizeof(m_overlapped));
+    // 零字节接收：只等待数据到达，数据由 Client::Recv 读取
+    m_wsaBuffer.buf = nullptr;
+    m_wsaBuffer.len = 0;
+    }
+
+
+
+template<IoOperator _Op> \
+int RecvOverlapped<_Op>::RecvWorker()
+    {
+    int ret = m_client->Recv();
+    if(0 == ret)
+        {
+        m_client->GetStrand().Post(&m_task);
+        }
+    else if((-2 == ret) && m_server)
+        {
+        m_server->CloseClient(m_client);
+        }
+    return -1;
+    }
+
+
+template<IoOperator _Op> \
+SendOverlapped<_Op>::SendOverlapped()
+    {
+    m_operator = _Op;
+    m_worker = ThreadWorker(this,reinterpret_cast<FUNCTYPE>(&SendOverlapped<_Op>::SendWorker));
+    m_task.m_worker = m_worker;
+    memset(&m_overlapped,0,sizeof(m_overlapped));
+    m_dwTransferred = 0;
+    m_dwError = 0;
+    }
+
+
+
+template<IoOperator _Op> \
+ErrorOverlapped<_Op>::ErrorOverlapped()
+    {
+    m_operator = _Op;
+    m_worker(this,&ErrorOverlapped::ErrorWorker);
+    memset(&m_overlapped,0,sizeof(m_overlapped));
+    m_buffer.resize(1024);
+    }
+
+
+
+Server::~Server()
+    {
+    // 连接在 Drain 中关闭，线程池停止后才删除，不会和完成包的处理同时进行
+    Drain(0);
+
+    for(size_t i = 0; i != m_datagrams.size(); ++i)
+        {
+        delete m_datagrams[i];
+        }
+    m_datagrams.clear();
+    }
+
+
+
+// 排空并关闭
+DrainResult Server::Drain(ULONGLONG timeoutMs)
+    {
+    DrainResult result;
+    if(m_draining.exchange(true))
+        {
+        return result;
+        }
+    ULONGLONG start = GetTickCount64();
+
+    // 停止接受连接。投递中的 AcceptEx 以失败完成，它的 Client 在最后删除
+    if(m_endpoint.IsInProc())
+        {
+        std::lock_guard<std::mutex> guard(InProcRegistryLock());
+        std::map<std::string, Server*>::iterator it = InProcRegistry().find(m_endpoint.Name());
+        if((it != InProcRegistry().end()) && (this == it->second))
+            {
+            InProcRegistry().erase(it);
+            }
+        }
+    else if(m_sock != INVALID_SOCKET)
+        {
+        closesocket(m_sock);
+        m_sock = INVALID_SOCKET;
+        }
+
+    // 已有连接处理完收到的数据后不再接收
+    {
+    std::lock_guard<std::mutex> guard(m_lock);
+    std::vector<Client*> clients;
+    CollectClients(clients);
+    result.m_connections = clients.size();
+    for(size_t i = 0; i != clients.size(); ++i)
+        {
+        clients[i]->StopReceiving();
+        }
+    }
+
+    // 等待正在处理的数据和发送队列完成
+    for(;;)
+        {
+        size_t busy = 0;
+        {
+        std::lock_guard<std::mutex> guard(m_lock);
+        std::vector<Client*> clients;
+        CollectClients(clients);
+        for(size_t i = 0; i != clients.size(); ++i)
+            {
+            if(!clients[i]->IsQuiet())
+                {
+                ++busy;
+                }
+            }
+        }
+        if(0 == busy)
+            {
+            break;
+            }
+        if(GetTickCount64() - start >= timeoutMs)
+            {
+            result.m_clean = false;
+            result.m_aborted = busy;
+            break;
+            }
+        Sleep(ServerDrainPollMs);
+        }
+
+    // 先断开所有连接再停止线程池：还在等待对端的发送、阻塞在连接上的处理都以失败完成，
+    // 线程池的线程才能退出。持有引用，线程池上的 RemoveClient 不会在这期间删除连接
+    std::vector<Client*> clients;
+    {
+    std::lock_guard<std::mutex> guard(m_lock);
+    CollectClients(clients);
+    clients.insert(clients.end(),m_closed.begin(),m_closed.end());
+    for(size_t i = 0; i != clients.size(); ++i)
+        {
+        clients[i]->AddRef();
+        }
+    }
+    for(size_t i = 0; i != clients.size(); ++i)
+        {
+        clients[i]->Abort();
+        }
+
+    // 取消是异步的，内核在操作完成时仍然会写入 Client 的重叠结构。
+    // 线程池还在运行时取消的操作按正常流程回来（发送回调得到错误），等它们全部回来
+    ULONGLONG deadline = GetTickCount64() + ServerCancelWaitMs;
+    WaitCancelled(clients,deadline,false);
+
+    // 停止完成端口线程（空完成包让 ThreadIocp 返回 -1）和线程池
+    bool bIocp = m_hIocp && (INVALID_HANDLE_VALUE != m_hIocp);
+    if(bIocp)
+        {
+        PostQueuedCompletionStatus(m_hIocp,0,0,nullptr);
+        }
+    m_pool.Stop();
+
+    // 还没有取出的完成包在这里取出丢弃。到时仍有操作没有回来的连接不删除，泄漏比释放后被内核写入安全
+    size_t leaked = bIocp ? WaitCancelled(clients,deadline,true) : 0;
+    for(size_t i = 0; i != clients.size(); ++i)
+        {
+        clients[i]->Release();
+        }
+    clients.clear();
+    {
+    std::lock_guard<std::mutex> guard(m_lock);
+    CollectClients(clients);
+    clients.insert(clients.end(),m_closed.begin(),m_closed.end());
+    m_closed.clear();
+    m_closedCount.store(0);
+    m_client.clear();
+    m_inprocClients.clear();
+    m_inprocAccepts.clear();
+    m_inprocBacklog.clear();
+    m_groups.clear();
+    }
+    for(size_t i = 0; i != clients.size(); ++i)
+        {
+        if(clients[i]->HasPendingIo())
+            {
+            continue;
+            }
+        clients[i]->Release();
+        }
+    result.m_leaked = leaked;
+    if(leaked)
+        {
+        Log::Write(LogError,"drain: %zu connections still have cancelled operations outstanding, not deleted",leaked);
+        }
+    if(bIocp)
+        {
+        CloseHandle(m_hIocp);
+        m_hIocp = INVALID_HANDLE_VALUE;
+        }
+
+    result.m_elapsedMs = GetTickCount64() - start;
+    if(result.m_connections)
+        {
+        Log::Write(result.m_clean ? LogInfo : LogWarn,"drain: %zu connections closed, %zu aborted after %llu ms", \
+            result.m_connections,result.m_aborted,result.m_elapsedMs);
+        }
+    return result;
+    }
+
+
+// 等待取消的操作回到完成端口
+size_t Server::WaitCancelled(const std::vector<Client*>& clients, ULONGLONG deadline, bool bDequeue)
+    {
+    for(;;)
+        {
+        size_t pending = 0;
+        for(size_t i = 0; i != clients.size(); ++i)
+            {
+            // 线程池运行时还要等回来的发送在 strand 上处理完
+            if(clients[i]->HasPendingIo() || (!bDequeue && !clients[i]->IsQuiet()))
+                {
+                ++pending;
+                }
+            }
+        ULONGLONG now = GetTickCount64();
+        if((0 == pending) || (now >= deadline))
+            {
+            return pending;
+            }
+        if(!bDequeue)
+            {
+            Sleep(ServerDrainPollMs);
+            continue;
+            }
+        // 完成端口线程已经退出，在这里取出完成包，只减少计数，不再处理
+        OVERLAPPED_ENTRY entries[ServerIocpBatch];
+        ULONG ulCount = 0;
+        DWORD dwTimeout = static_cast<DWORD>((std::min)(deadline - now,static_cast<ULONGLONG>(ServerDrainPollMs)));
+        if(GetQueuedCompletionStatusEx(m_hIocp,entries,ServerIocpBatch,&ulCount,dwTimeout,FALSE))
+            {
+            for(ULONG i = 0; i != ulCount; ++i)
+                {
+                if(entries[i].lpCompletionKey && entries[i].lpOverlapped)
+                    {
+                    CountIoDone(CONTAINING_RECORD(entries[i].lpOverlapped,IoOverlapped,m_overlapped));
+                    }
+                }
+            }
+        }
+    }
+
+
+// 连接自己的重叠结构的完成包取出后减少未完成操作数
+void Server::CountIoDone(IoOverlapped* pOver)
+    {
+    switch(pOver->m_operator)
+        {
+    case IOAccept:
+    case IORecv:
+    case IOSend:
+        if(pOver->m_client && !pOver->m_client->IsInProc())
+            {
+            pOver->m_client->IoDone();
+            }
+        break;
+    default:
+        break;
+        }
+    }
+
+
+// 所有连接，需要持有 m_lock
+void Server::CollectClients(std::vector<Client*>& clients)
+    {
+    clients.reserve(clients.size() + m_client.size() + m_inprocClients.size());
+    std::map<SOCKET, Client*>::iterator it = m_client.begin();
+    for(; it != m_client.end(); ++it)
+        {
+        clients.push_back(it->second);
+        }
+    clients.insert(clients.end(),m_inprocClients.begin(),m_inprocClients.end());
+    }
+
+
+
+// IOCP 流程函数，绑定 IOCP 并启动线程池
+bool Server::StartServer()
+    {
+    if(m_endpoint.IsInProc())
+        {
+        // 进程内通道不需要套接字，只登记名字
+        m_hIocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE,nullptr,0,4);
+        if(!m_hIocp)
+            {
+            m_hIocp = INVALID_HANDLE_VALUE;
+            return false;
+            }
+        {
+        std::lock_guard<std::mutex> guard(InProcRegistryLock());
+        if(!InProcRegistry().insert(std::make_pair(m_endpoint.Name(),this)).second)
+            {
+            return false;
+            }
+        }
+        m_pool.Invoke();
+        m_pool.DispatchWorker(ThreadWorker(this,reinterpret_cast<FUNCTYPE>(&Server::ThreadIocp)));
+        return NewAccept();
+        }
+
+    // 继承的监听套接字已经绑定并且在监听
+    if(INVALID_SOCKET == m_sock)
+        {
+        // 创建套接字
+        CreateSocket();
+
+        // 绑定
+        if(-1 == bind(m_sock,m_endpoint.Addr(),m_endpoint.AddrLen()))
+            {
+            closesocket(m_sock);
+            m_sock = INVALID_SOCKET;
+            return false;
+            }
+
+        // 监听
+        if(-1 == listen(m_sock, 5))
+            {
+            closesocket(m_sock);
+            m_sock = INVALID_SOCKET;
+            return false;
+            }
+        }
+
+    // 创建 IOCP
+    m_hIocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE,nullptr,0,4);
+    if(!m_hIocp)
+        {
+        closesocket(m_sock);
+        m_sock = INVALID_SOCKET;
+        m_hIocp = INVALID_HANDLE_VALUE;
+        return false;
+        }
+
+    // 将 IOCP 和套接字绑定在一起
+    CreateIoCompletionPort(reinterpret_cast<HANDLE>(m_sock),m_hIocp,reinterpret_cast<ULONG_PTR>(this),0);
+
+    // 启动线程池
+    m_pool.Invoke();
+
+    // 分发线程工作
+    m_pool.DispatchWorker(ThreadWorker(this,reinterpret_cast<FUNCTYPE>(&Server::ThreadIocp)));
+
+    // 创建新连接
+    if(!NewAccept())
+        {
+        return false;
+        }
+
+    return true;
+    }
+
+
+
+// 创建客户端并登记
+Client* Server::CreateClient()
+    {
+    Client* pClient = new Client(m_endpoint.Family(),&m_pool);
+    pClient->GetStrand().SetScheduler(&m_scheduler);
+    pClient->SetMessageHandler(m_msgObj,m_msgCallback);
+    pClient->SetCapture(m_capture);
+    pClient->SetMaxRecvBuffer(m_maxRecv);
+    pClient->SetOverlapped(pClient);
+    std::lock_guard<std::mutex> guard(m_lock);
+    if(m_endpoint.IsInProc())
+        {
+        m_inprocClients.push_back(pClient);
+        }
+    else
+        {
+        m_client.insert(std::pair<SOCKET,Client*>(*pClient,pClient));
+        }
+    return pClient;
+    }
+
+
+
+// 所有连接的状态
+std::vector<ConnectionStats> Server::GetConnectionStats()
+    {
+    std::vector<ConnectionStats> stats;
+    std::lock_guard<std::mutex> guard(m_lock);
+    stats.reserve(m_client.size() + m_inprocClients.size());
+    std::map<SOCKET, Client*>::iterator it = m_client.begin();
+    for(; it != m_client.end(); ++it)
+        {
+        ConnectionStats item;
+        item.m_sock = it->first;
+        item.m_bufferBytes = it->second->GetBufferSize();
+        item.m_sending = it->second->IsSending();
+        item.m_idle = it->second->GetStrand().IsIdle();
+        item.m_weight = it->second->GetStrand().GetWeight();
+        item.m_sendBacklog = it->second->GetSendBacklog();
+        stats.push_back(item);
+        }
+    for(size_t i = 0; i != m_inprocClients.size(); ++i)
+        {
+        ConnectionStats item;
+        item.m_bufferBytes = m_inprocClients[i]->GetBufferSize();
+        item.m_sending = m_inprocClients[i]->IsSending();
+        item.m_idle = m_inprocClients[i]->GetStrand().IsIdle();
+        item.m_weight = m_inprocClients[i]->GetStrand().GetWeight();
+        item.m_sendBacklog = m_inprocClients[i]->GetSendBacklog();
+        stats.push_back(item);
+        }
+    return stats;
+    }
+
+
+
+// 继续接受连接，过载时暂停
+bool Server::ContinueAccept()
+    {
+    if((AdmissionPause == m_admission.GetOptions().m_acceptPolicy) && m_admission.IsOverloaded())
+        {
+        m_acceptPaused.store(true);
+        m_admission.CountPaused();
+        return true;
+        }
+    return NewAccept();
+    }
+
+
+// 过载时重置新连接
+bool Server::AdmitConnection(Client* pClient)
+    {
+    if((AdmissionReject != m_admission.GetOptions().m_acceptPolicy) || !m_admission.IsOverloaded())
+        {
+        return true;
+        }
+    if(static_cast<SOCKET>(*pClient) != INVALID_SOCKET)
+        {
+        // 超时为 0 的 linger，closesocket 发送 RST，客户端立即得到失败，不经过 TIME_WAIT
+        LINGER linger;
+        linger.l_onoff = 1;
+        linger.l_linger = 0;
+        setsockopt(*pClient,SOL_SOCKET,SO_LINGER,reinterpret_cast<const char*>(&linger),sizeof(linger));
+        }
+    m_admission.CountRejected();
+    RemoveClient(pClient);
+    return false;
     }
 
 
-Client::~Client()
-    {
-    m_buffer.clear();
-    closesocket(m_sock);
-    }
-
 
-// 接收
-int Client::Recv()
+// 加入广播分组
+void Server::JoinGroup(UINT group, Client* pClient)
     {
-    int ret = recv(m_sock,m_buffer.data() + m_usedBuf,m_buffer.size() - m_usedBuf,0);
-    if(ret <= 0)
+    if(BroadcastAll == group)
         {
-        return -1;
+        return;
+        }
+    std::lock_guard<std::mutex> guard(m_lock);
+    std::vector<Client*>& members = m_groups[group];
+    if(std::find(members.begin(),members.end(),pClient) == members.end())
+        {
+        members.push_back(pClient);
         }
-    m_usedBuf += static_cast<size_t>(ret);
-
-    // TODO: 解析数据
-    Tools::Dump(reinterpret_cast<BYTE*>(m_buffer.data()),ret);
-
-    return 0;
     }
 
 
-// 发送
-int Client::Send(void* buffer, size_t size)
+// 退出广播分组
+void Server::LeaveGroup(UINT group, Client* pClient)
     {
-    std::vector<char> data(size);
-    memcpy(data.data(),buffer,size);
-    if(m_vecSend.PushBack(data))
+    std::lock_guard<std::mutex> guard(m_lock);
+    std::map<UINT, std::vector<Client*>>::iterator it = m_groups.find(group);
+    if(it != m_groups.end())
         {
-        return 0;
+        it->second.erase(std::remove(it->second.begin(),it->second.end(),pClient),it->second.end());
         }
     }
 
 
-// 发送数据
-int Client::SendData(std::vector<char>& data)
+// 广播
+BroadcastResult Server::Broadcast(UINT group, std::shared_ptr<const void> owner, const char* data, size_t size, size_t maxBacklog)
+    {
+    // 持锁只复制成员并增加引用，入队（可能直接调用 WSASend）不阻塞 accept、RemoveClient、统计和排空
+    std::vector<Client*> members;
     {
-    if(m_vecSend.Size() > 0)
+    std::lock_guard<std::mutex> guard(m_lock);
+    if(BroadcastAll == group)
         {
-        int ret = WSASend(m_sock,SendWSABuffer(),1,&m_dwReceived,m_dwFlags,&m_ptrSend->m_overlapped, nullptr);
-        if(ret != 0 && WSAGetLastError() != WSA_IO_PENDING)
+        CollectClients(members);
+        }
+    else
+        {
+        std::map<UINT, std::vector<Client*>>::iterator it = m_groups.find(group);
+        if(it != m_groups.end())
             {
-            std::cerr << "WSASend failed! [" << WSAGetLastError() \
-                      << "] (" << Tools::GetErrorInfo(WSAGetLastError()).c_str() \
-                      << ")" << std::endl;
-
-            return ret;
+            members = it->second;
             }
         }
-    return 0;
+    for(size_t i = 0; i != members.size(); ++i)
+        {
+        members[i]->AddRef();
+        }
     }
 
+    std::atomic<size_t> sent{0};
+    std::function<void(size_t, size_t)> enqueue = [&](size_t first, size_t last)
+        {
+        size_t batchSent = 0;
+        for(size_t i = first; i != last; ++i)
+            {
+            Client* pClient = members[i];
+            if((pClient->GetSendBacklog() < maxBacklog) && (0 == pClient->SendShared(owner,data,size)))
+                {
+                ++batchSent;
+                }
+            }
+        sent.fetch_add(batchSent,std::memory_order_relaxed);
+        };
 
-Client::operator LPOVERLAPPED() { return &m_ptrOverlapped->m_overlapped; }
-
-
-LPWSABUF Client::RecvWSABuffer() { return &m_ptrRecv->m_wsaBuffer; }
+    // 每个线程池线程一批，一批只占用一次调度
+    size_t threads = (std::max)(static_cast<size_t>(1),m_pool.GetOptions().m_maxThreads);
+    size_t batches = (std::min)(threads,members.size() / BroadcastMinBatch);
+    if(batches < 2)
+        {
+        enqueue(0,members.size());
+        }
+    else
+        {
+        size_t batchSize = (members.size() + batches - 1) / batches;
+        TaskGroup tasks(m_pool);
+        for(size_t first = batchSize; first < members.size(); first += batchSize)
+            {
+            size_t last = (std::min)(first + batchSize,members.size());
+            tasks.Run([&enqueue, first, last]() { enqueue(first,last); });
+            }
+        enqueue(0,batchSize);
+        tasks.Wait();
+        }
 
+    for(size_t i = 0; i != members.size(); ++i)
+        {
+        members[i]->Release();
+        }
 
-LPOVERLAPPED Client::RecvOverlapped() { return &m_ptrRecv->m_overlapped; }
+    BroadcastResult result;
+    result.m_sent = sent.load();
+    result.m_dropped = members.size() - result.m_sent;
+    ++m_broadcast.m_broadcasts;
+    m_broadcast.m_deliveries += result.m_sent;
+    m_broadcast.m_dropped += result.m_dropped;
+    return result;
+    }
 
 
-LPWSABUF Client::SendWSABuffer() { return &m_ptrSend->m_wsaBuffer; }
+// 复制一次数据后广播
+BroadcastResult Server::Broadcast(UINT group, const void* data, size_t size, size_t maxBacklog)
+    {
+    char* buffer = reinterpret_cast<char*>(NumaHeap::Allocate(size ? size : 1));
+    if(!buffer)
+        {
+        Log::Write(LogError,"broadcast: allocate %zu bytes failed",size);
+        return BroadcastResult();
+        }
+    memcpy(buffer,data,size);
+    std::shared_ptr<const void> owner(buffer,[](const void* ptr) { NumaHeap::Free(const_cast<void*>(ptr)); });
+    return Broadcast(group,std::move(owner),buffer,size,maxBacklog);
+    }
 
 
-LPOVERLAPPED Client::SendOverlapped() { return &m_ptrSend->m_overlapped; }
 
+// 注销客户端并释放引用
+void Server::RemoveClient(Client* pClient)
+    {
+    if(!pClient)
+        {
+        return;
+        }
+    bool bFound = false;
+    {
+    std::lock_guard<std::mutex> guard(m_lock);
+    bFound = Unregister(pClient);
+    }
+    // 已经被 Drain 或 CloseClient 取走的连接由它们释放
+    if(bFound)
+        {
+        pClient->Release();
+        }
+    }
 
 
-template<IoOperator _Op> \
-AcceptOverlapped<_Op>::AcceptOverlapped()
+// 注销已经关闭的客户端，等它安静下来再释放
+void Server::CloseClient(Client* pClient)
     {
-    m_worker = ThreadWorker(this, reinterpret_cast<FUNCTYPE>(&AcceptOverlapped<_Op>::AcceptWorker));
-    m_operator = IOAccept;
-    memset(&m_overlapped,0,sizeof(m_overlapped));
-    m_buffer.resize(1024);
-    m_server = nullptr;
+    std::lock_guard<std::mutex> guard(m_lock);
+    if(Unregister(pClient))
+        {
+        m_closed.push_back(pClient);
+        m_closedCount.store(m_closed.size());
+        }
     }
 
 
-template<IoOperator _Op> \
-int AcceptOverlapped<_Op>::AcceptWorker()
+// 释放已经安静下来的关闭的客户端。
+// 没有未完成的发送项（取消的发送已经回到 strand）、strand 空闲、套接字上没有未完成的操作之后，
+// 不会再有线程或者内核访问它
+void Server::ReapClients()
+    {
+    if(0 == m_closedCount.load())
+        {
+        return;
+        }
+    std::vector<Client*> quiet;
     {
-    printf("AcceptWorker this %08X\r\n", this);
+    std::lock_guard<std::mutex> guard(m_lock);
+    std::vector<Client*>::iterator it = m_closed.begin();
+    while(it != m_closed.end())
+        {
+        if((*it)->IsQuiet() && !(*it)->HasPendingIo())
+            {
+            quiet.push_back(*it);
+            it = m_closed.erase(it);
+            }
+        else
+            {
+            ++it;
+            }
+        }
+    m_closedCount.store(m_closed.size());
+    }
+    for(size_t i = 0; i != quiet.size(); ++i)
+        {
+        quiet[i]->Release();
+        }
+    }
 
-    INT lLength = 0, rLength = 0;
-    if(m_client->GetBufferSize() > 0)
-        {
-        // 本地地址，远程地址
-        LPSOCKADDR pLocalAddr, pRemoteAddr;
-        GetAcceptExSockaddrs(*m_client, \
-            0, \
-            sizeof(sockaddr_in) + 16, \
-            sizeof(sockaddr_in) + 16, \
-            reinterpret_cast<sockaddr**>(&pLocalAddr),/*本地地址*/ \
-            &lLength, \
-            reinterpret_cast<sockaddr**>(&pRemoteAddr),/*远程地址*/ \
-            &rLength);
-
-        memcpy(m_client->GetLocalAddr(),pLocalAddr,sizeof(sockaddr_in));
-        memcpy(m_client->GetRemoteAddr(),pRemoteAddr,sizeof(sockaddr_in));
-
-        m_server->BindNewSocket(*m_client,reinterpret_cast<ULONG_PTR>(m_client));
-
-        int ret = WSARecv(static_cast<SOCKET>(*m_client), \
-            m_client->RecvWSABuffer(), \
-            1, \
-            *m_client, \
-            &m_client->GetFlags(), \
-            m_client->RecvOverlapped(), \
-            nullptr);
 
-        if (SOCKET_ERROR == ret && (WSAGetLastError() != WSA_IO_PENDING))
+// 从连接表和广播分组中移除，需要持有 m_lock
+bool Server::Unregister(Client* pClient)
+    {
+    bool bFound = false;
+    if(pClient->IsInProc() || m_endpoint.IsInProc())
+        {
+        std::vector<Client*>::iterator it = std::find(m_inprocClients.begin(),m_inprocClients.end(),pClient);
+        if(it != m_inprocClients.end())
             {
-            // TODO: 报错
-            std::cerr << "WSARecv failed! [" << WSAGetLastError() \
-                      << "] (" << Tools::GetErrorInfo(WSAGetLastError()).c_str() \
-                      << ")" << std::endl;
+            m_inprocClients.erase(it);
+            bFound = true;
             }
-        if (!m_server->NewAccept())
+        }
+    else
+        {
+        std::map<SOCKET, Client*>::iterator it = m_client.find(*pClient);
+        if((it != m_client.end()) && (pClient == it->second))
             {
-            return -2;
+            m_client.erase(it);
+            bFound = true;
             }
         }
-    return -1;  // 必须返回 -1，否则循环不会终止！！！
+    std::map<UINT, std::vector<Client*>>::iterator it = m_groups.begin();
+    for(; it != m_groups.end(); ++it)
+        {
+        it->second.erase(std::remove(it->second.begin(),it->second.end(),pClient),it->second.end());
+        }
+    return bFound;
     }
 
 
-template<IoOperator _Op> \
-RecvOverlapped<_Op>::RecvOverlapped()
+
+// 投递 AcceptEx。false 表示投递失败，错误码通过 WSAGetLastError 获取
+bool Server::PostAccept(Client* pClient, LPOVERLAPPED lpOverlapped)
     {
-    m_operator = _Op;
-    m_worker = ThreadWorker(this,reinterpret_cast<FUNCTYPE>(&RecvOverlapped<_Op>::RecvWorker));
-    memset(&m_overlapped,0,sizeof(m_overlapped));
-    m_buffer.resize(1024 * 256);
+    if(m_endpoint.IsInProc())
+        {
+        // 有等待中的连接时立即完成，否则等 ConnectInProc
+        std::unique_lock<std::mutex> guard(m_lock);
+        if(m_inprocBacklog.empty())
+            {
+            m_inprocAccepts.push_back(std::make_pair(pClient,lpOverlapped));
+            return true;
+            }
+        PTR_LINK link = m_inprocBacklog.front();
+        m_inprocBacklog.pop_front();
+        guard.unlock();
+        pClient->AttachInProc(link,m_hIocp);
+        return PostCompletion(lpOverlapped) != FALSE;
+        }
+    if(!AcceptEx(m_sock,*pClient,*pClient,0,AcceptAddrLen(),AcceptAddrLen(),*pClient,lpOverlapped))
+        {
+        int err = WSAGetLastError();
+        if(err != ERROR_SUCCESS && err != WSA_IO_PENDING)
+            {
+            return false;
+            }
+        }
+    return true;
     }
 
 
 
-template<IoOperator _Op> \
-SendOverlapped<_Op>::SendOverlapped()
+// AcceptEx 完成后，获取地址并将新套接字绑定到 IOCP
+void Server::CompleteAccept(Client* pClient)
     {
-    m_operator = _Op;
-    m_worker = ThreadWorker(this,reinterpret_cast<FUNCTYPE>(&SendOverlapped<_Op>::SendWorker));
-    memset(&m_overlapped,0,sizeof(m_overlapped));
-    m_buffer.resize(1024 * 256);
+    if(pClient->IsInProc())
+        {
+        // 进程内连接在 PostAccept 时已经接好，没有地址也不需要绑定
+        return;
+        }
+
+    INT lLength = 0, rLength = 0;
+    // 本地地址，远程地址。本地地址不保存，需要时由 Client::GetLocalAddr 读取
+    LPSOCKADDR pLocalAddr, pRemoteAddr;
+    GetAcceptExSockaddrs(*pClient, \
+        0, \
+        AcceptAddrLen(), \
+        AcceptAddrLen(), \
+        reinterpret_cast<sockaddr**>(&pLocalAddr),/*本地地址*/ \
+        &lLength, \
+        reinterpret_cast<sockaddr**>(&pRemoteAddr),/*远程地址*/ \
+        &rLength);
+
+    pClient->SetRemoteAddr(pRemoteAddr,rLength);
+
+    // 继承监听套接字的属性，之后 getpeername/shutdown 才能正常使用
+    setsockopt(*pClient,SOL_SOCKET,SO_UPDATE_ACCEPT_CONTEXT,reinterpret_cast<const char*>(&m_sock),sizeof(m_sock));
+
+    // 非阻塞模式：Client::Recv 用 recv 读取，没有数据时必须返回 WSAEWOULDBLOCK 再投递零字节接收，
+    // 阻塞的 recv 会让空闲连接一直占住一个线程池线程和它的 strand。重叠的 WSARecv/WSASend/TransmitFile 不受影响
+    u_long nonBlocking = 1;
+    if(SOCKET_ERROR == ioctlsocket(*pClient,FIONBIO,&nonBlocking))
+        {
+        Log::Write(LogError,"accept: set non-blocking failed [%d]",WSAGetLastError());
+        }
+
+    if(m_noDelay)
+        {
+        pClient->SetNoDelay(true);
+        }
+
+    BindNewSocket(*pClient,reinterpret_cast<ULONG_PTR>(pClient));
     }
 
 
 
-template<IoOperator _Op> \
-ErrorOverlapped<_Op>::ErrorOverlapped()
+// 连接到进程内通道监听的 Server
+PTR_INPROC_STREAM Server::ConnectInProc(const std::string& name)
     {
-    m_operator = _Op;
-    m_worker(this,&ErrorOverlapped::ErrorWorker);
-    memset(&m_overlapped,0,sizeof(m_overlapped));
-    m_buffer.resize(1024);
+    Server* pServer = nullptr;
+    {
+    std::lock_guard<std::mutex> guard(InProcRegistryLock());
+    std::map<std::string, Server*>::iterator it = InProcRegistry().find(name);
+    if(it == InProcRegistry().end())
+        {
+        return nullptr;
+        }
+    pServer = it->second;
+    }
+    PTR_LINK link = std::make_shared<InProcLink>();
+    if(!pServer->AcceptInProc(link))
+        {
+        return nullptr;
+        }
+    return std::make_shared<InProcStream>(link);
     }
 
 
 
-Server::~Server()
+// 进程内通道的新连接。有等待中的 accept 时立即完成，否则放入 backlog
+bool Server::AcceptInProc(const PTR_LINK& link)
     {
-    std::map<SOCKET,Client*>::iterator it = m_client.begin();
-    for(; it != m_client.end(); ++it)
+    std::unique_lock<std::mutex> guard(m_lock);
+    if(m_inprocAccepts.empty())
         {
-        delete it->second;
-        it->second = nullptr;
+        m_inprocBacklog.push_back(link);
+        return true;
         }
-    m_client.clear();
+    std::pair<Client*, LPOVERLAPPED> accept = m_inprocAccepts.front();
+    m_inprocAccepts.pop_front();
+    guard.unlock();
+    accept.first->AttachInProc(link,m_hIocp);
+    return PostCompletion(accept.second) != FALSE;
     }
 
 
 
-// IOCP 流程函数，绑定 IOCP 并启动线程池
-bool Server::StartServer()
+// 向 IOCP 投递一个自定义完成包
+bool Server::PostCompletion(LPOVERLAPPED lpOverlapped, DWORD dwTransferred)
+    {
+    return PostQueuedCompletionStatus(m_hIocp,dwTransferred,reinterpret_cast<ULONG_PTR>(this),lpOverlapped);
+    }
+
+
+
+// 绑定新套接字
+void Server::BindNewSocket(SOCKET s, ULONG_PTR ulKey)
     {
-    // 创建套接字
-    CreateSocket();
+    CreateIoCompletionPort(reinterpret_cast<HANDLE>(s),m_hIocp,ulKey,0);
+    }
 
-    // 绑定
-    if(-1 == bind(m_sock,reinterpret_cast<sockaddr*>(&m_addr),sizeof(m_addr)))
+
+
+// IOCP 线程
+int Server::ThreadIocp()
+    {
+    if(m_pinCompletion)
         {
-        closesocket(m_sock);
-        m_sock = INVALID_SOCKET;
-        return false;
+        m_pinCompletion = false;
+        Numa::PinCurrentThread(m_completionAffinity);
         }
 
-    // 监听
-    if(-1 == listen(m_sock, 5))
+    // 过载暂停的 AcceptEx 在恢复后重新投递
+    if(m_acceptPaused.load() && !m_admission.IsOverloaded() && m_acceptPaused.exchange(false))
         {
-        closesocket(m_sock);
-        m_sock = INVALID_SOCKET;
-        return false;
+        NewAccept();
         }
+    // 关闭的连接安静下来后释放
+    ReapClients();
 
-    // 创建 IOCP
-    m_hIocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE,nullptr,0,4);
-    if(!m_hIocp)
+    // 一次取出多个完成包，数据报按端点攒成一批再交给线程池
+    OVERLAPPED_ENTRY entries[ServerIocpBatch];
+    ULONG ulCount = 0;
+    if(!PollCompletion(entries,ulCount))
         {
-        closesocket(m_sock);
-        m_sock = INVALID_SOCKET;
-        m_hIocp = INVALID_HANDLE_VALUE;
-        return false;
+        ++m_metrics.m_blocks;
+        // 等待完成包不算任务执行时间，看门狗只检查处理完成包的部分
+        ThreadBlockingScope blocking;
+        // 打开准入控制时定期醒来，检查是否可以恢复接受连接；有关闭的连接等待释放时也定期醒来
+        DWORD dwTimeout = m_admission.IsEnabled() ? ServerAdmissionCheckMs : INFINITE;
+        if(m_closedCount.load())
+            {
+            dwTimeout = (std::min)(dwTimeout,static_cast<DWORD>(ServerReapMs));
+            }
+        if(!GetQueuedCompletionStatusEx(m_hIocp,entries,ServerIocpBatch,&ulCount,dwTimeout,FALSE))
+            {
+            return 0;
+            }
         }
+    Thread::SetTaskLabel("completion loop");
+    m_metrics.m_completions += ulCount;
 
-    // 将 IOCP 和套接字绑定在一起
-    CreateIoCompletionPort(reinterpret_cast<HANDLE>(m_sock),m_hIocp,reinterpret_cast<ULONG_PTR>(this),0);
+    int ret = 0;
+    for(ULONG i = 0; i != ulCount; ++i)
+        {
+        if(!entries[i].lpCompletionKey || !entries[i].lpOverlapped)
+            {
+            ret = -1;
+            continue;
+            }
+        DealCompletion(entries[i]);
+        }
 
-    // 启动线程池
-    m_pool.Invoke();
+    for(size_t i = 0; i != m_ready.size(); ++i)
+        {
+        m_ready[i]->Flush();
+        }
+    m_ready.clear();
+    return ret;
+    }
 
-    // 分发线程工作
-    m_pool.DispatchWorker(ThreadWorker(this,reinterpret_cast<FUNCTYPE>(&Server::ThreadIocp)));
 
-    // 创建新连接
-    if(!NewAccept())
+
+// 忙轮询，在设定的时间内取到完成包返回 true。没有开启忙轮询时直接返回 false
+bool Server::PollCompletion(OVERLAPPED_ENTRY* pEntries, ULONG& ulCount)
+    {
+    LONGLONG llBudget = m_busyPollTicks.load();
+    if(llBudget <= 0)
         {
         return false;
         }
-
-    return true;
+    LARGE_INTEGER start, now;
+    QueryPerformanceCounter(&start);
+    do
+        {
+        ++m_metrics.m_polls;
+        if(GetQueuedCompletionStatusEx(m_hIocp,pEntries,ServerIocpBatch,&ulCount,0,FALSE) && ulCount)
+            {
+            ++m_metrics.m_spinHits;
+            return true;
+            }
+        YieldProcessor();
+        QueryPerformanceCounter(&now);
+        } while(now.QuadPart - start.QuadPart < llBudget);
+    return false;
     }
 
 
 
-// 绑定新套接字
-void Server::BindNewSocket(SOCKET s, ULONG_PTR ulKey)
+// 处理一个完成包
+void Server::DealCompletion(const OVERLAPPED_ENTRY& entry)
     {
-    CreateIoCompletionPort(reinterpret_cast<HANDLE>(s),m_hIocp,ulKey,0);
+    DWORD dwTranferred = entry.dwNumberOfBytesTransferred;
+    // Internal 保存的是 NTSTATUS，小于 0 表示操作失败
+    bool bSuccess = static_cast<LONG>(entry.lpOverlapped->Internal) >= 0;
+    IoOverlapped* pOver = CONTAINING_RECORD(entry.lpOverlapped,IoOverlapped,m_overlapped);
+    pOver->m_server = this;
+    CountIoDone(pOver);
+
+    switch(pOver->m_operator)
+        {
+    case IOAwait:
+        ResumeAwait(static_cast<AWAITOVERLAPPED*>(pOver),dwTranferred,bSuccess);
+        return;
+    case IORecvFrom:
+        {
+        DatagramOverlapped* pDgramOver = static_cast<DatagramOverlapped*>(pOver);
+        pDgramOver->m_endpoint->OnRecv(pDgramOver,dwTranferred,bSuccess);
+        }
+        return;
+    case IOSendTo:
+        {
+        DatagramOverlapped* pDgramOver = static_cast<DatagramOverlapped*>(pOver);
+        pDgramOver->m_endpoint->OnSent(pDgramOver);
+        }
+        return;
+    case IOSend:
+        {
+        // 发送失败也要通知客户端，否则发送队列会一直等待
+        SENDOVERLAPPED* pSendOver = static_cast<SENDOVERLAPPED*>(pOver);
+        pSendOver->m_dwTransferred = dwTranferred;
+        pSendOver->m_dwError = bSuccess ? 0 : WSAECONNRESET;
+        if(!bSuccess)
+            {
+            DWORD dwFlags = 0;
+            if(!WSAGetOverlappedResult(*pSendOver->m_client,&pSendOver->m_overlapped,&dwTranferred,FALSE,&dwFlags) \
+                && WSAGetLastError())
+                {
+                pSendOver->m_dwError = WSAGetLastError();
+                }
+            }
+        pSendOver->m_client->GetStrand().Post(&pSendOver->m_task);
+        }
+        return;
+    case IORecv:
+        {
+        // 失败的接收（对端重置、操作被取消）也交给 Client::Recv，由 recv 的返回值发现连接关闭
+        RECVOVERLAPPED* pRecvOver = static_cast<RECVOVERLAPPED*>(pOver);
+        pRecvOver->m_client->GetStrand().Post(&pRecvOver->m_task);
+        }
+        return;
+    default:
+        break;
+        }
+
+    // 其他操作失败时直接丢弃
+    if(!bSuccess)
+        {
+        return;
+        }
+    Log::TraceWrite("Operator is %d",static_cast<int>(pOver->m_operator));
+
+    switch(pOver->m_operator)
+        {
+    case IOAccept:
+        {
+        ACCEPTOVERLAPPED* pAcceptOver = reinterpret_cast<ACCEPTOVERLAPPED*>(pOver);
+        Log::TraceWrite("pAcceptOver %p",pAcceptOver);
+        m_pool.DispatchWorker(pAcceptOver->m_worker);
+        }
+    break;
+    case IOError:
+        {
+        ERROROVERLAPPED* peErrOver = reinterpret_cast<ERROROVERLAPPED*>(pOver);
+        m_pool.DispatchWorker(peErrOver->m_worker);
+        }
+    break;
+        }
     }
 
 
 
-// IOCP 线程
-int Server::ThreadIocp()
+// 恢复等待中的协程
+void Server::ResumeAwait(AWAITOVERLAPPED* pAwaitOver, DWORD dwTransferred, bool bSuccess)
     {
-    DWORD dwTranferred = 0;
-    ULONG_PTR ulCompletionKey = 0;
-    OVERLAPPED* lpOverlapped = nullptr;
-    if(GetQueuedCompletionStatus(m_hIocp,&dwTranferred,&ulCompletionKey,&lpOverlapped,INFINITE))
+    DWORD dwError = 0;
+    if(!bSuccess)
         {
-        if(ulCompletionKey)
+        // 把 NTSTATUS 转换成 Winsock 错误码
+        DWORD dwFlags = 0;
+        WSAGetOverlappedResult(pAwaitOver->m_sock,&pAwaitOver->m_overlapped,&dwTransferred,FALSE,&dwFlags);
+        dwError = WSAGetLastError();
+        if(!dwError)
             {
-            IoOverlapped* pOver = CONTAINING_RECORD(lpOverlapped,IoOverlapped,m_overlapped);
-            pOver->m_server = this;
-            std::cout << "Operator is " << pOver->m_operator << std::endl;
-
-            switch(pOver->m_operator)
-                {
-            case IOAccept:
-                {
-                ACCEPTOVERLAPPED* pAcceptOver = reinterpret_cast<ACCEPTOVERLAPPED*>(pOver);
-                printf("pAcceptOver %08X\r\n",pAcceptOver);
-                m_pool.DispatchWorker(pAcceptOver->m_worker);
-                }
-            break;
-            case IORecv:
-                {
-                RECVOVERLAPPED* pRecvOver = reinterpret_cast<RECVOVERLAPPED*>(pOver);
-                m_pool.DispatchWorker(pRecvOver->m_worker);
-                }
-            break;
-            case IOSend:
-                {
-                SENDOVERLAPPED* pSendOver = reinterpret_cast<SENDOVERLAPPED*>(pOver);
-                m_pool.DispatchWorker(pSendOver->m_worker);
-                }
-            break;
-            case IOError:
-                {
-                ERROROVERLAPPED* peErrOver = reinterpret_cast<ERROROVERLAPPED*>(pOver);
-                m_pool.DispatchWorker(peErrOver->m_worker);
-                }
-            break;
-                }
+            dwError = WSAECONNRESET;
             }
-        else
+        }
+    pAwaitOver->Complete(dwTransferred,dwError);
+    if(ResumeInPool == pAwaitOver->m_mode)
+        {
+        // 线程池没有运行时退回到当前线程恢复，保证协程不会丢失
+        if(m_pool.DispatchWorker(pAwaitOver->m_worker) != -1)
             {
-            return -1;
+            return;
             }
         }
-    return 0;
+    pAwaitOver->Resume();
+    }
+
+
+
+// 添加一个数据报端点
+DatagramEndpoint* Server::AddDatagramEndpoint(const std::string& ip, short port, \
+    ThreadFuncBase* obj, DATAGRAM_CALLBACK callback, const DatagramOptions& options)
+    {
+    if(!m_hIocp || (INVALID_HANDLE_VALUE == m_hIocp))
+        {
+        return nullptr;
+        }
+    sockaddr_in addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr(ip.c_str());
+
+    DatagramEndpoint* pEndpoint = new DatagramEndpoint(this,addr,obj,callback,options);
+    if(!pEndpoint->Start(m_hIocp))
+        {
+        delete pEndpoint;
+        return nullptr;
+        }
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_datagrams.push_back(pEndpoint);
+    return pEndpoint;
     }
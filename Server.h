@@ -2,14 +2,28 @@
 #define IOCPANDTHREADPOOL_SERVER_H
 
 #include <MSWSock.h>
+#include <WS2tcpip.h>
 
 
+#include <coroutine>
+#include <deque>
+#include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
 
 
 #include "Thread.h"
 #include "ThreadQueue.h"
 #include "Tools.h"
+#include "Arena.h"
+#include "RecvBuffer.h"
+#include "Strand.h"
+#include "Transport.h"
+#include "Log.h"
+#include "Admission.h"
+#include "Handoff.h"
+#include "Capture.h"
 
 
 
@@ -20,12 +34,29 @@ enum IoOperator
     IOAccept,
     IORecv,
     IOSend,
-    IOError
+    IOError,
+    IOAwait,        // 协程等待的操作，完成后恢复协程
+    IORecvFrom,     // 数据报接收
+    IOSendTo        // 数据报发送
+    };
+
+
+// 协程恢复的位置
+enum ResumeMode
+    {
+    ResumeInline,   // 在完成端口线程上直接恢复，没有线程切换
+    ResumeInPool    // 投递到线程池恢复，不阻塞完成端口线程
     };
 
 
 class Server;
 class Client;
+class DatagramEndpoint;
+struct DatagramOptions;
+class DatagramBatch;
+typedef int (ThreadFuncBase::*DATAGRAM_CALLBACK)(DatagramBatch& batch);
+// 消息处理回调：处理 data 中完整的消息，返回处理掉的字节数，-1 表示数据错误（例如 Router::Consume）
+typedef int (ThreadFuncBase::*MESSAGE_CALLBACK)(Client* pClient, const char* data, size_t size);
 typedef std::shared_ptr<Client>  PTR_CLIENT;
 
 
@@ -36,11 +67,15 @@ class IoOverlapped \
 public:
     IoOverlapped() = default;
     virtual ~IoOverlapped() { m_client = nullptr; }
+
+    // 操作上下文随连接和发送频繁创建释放，从 NumaHeap 的线程缓存分配
+    static void* operator new(size_t size) { return NumaHeap::Allocate(size); }
+    static void operator delete(void* ptr) { NumaHeap::Free(ptr); }
 public:
     OVERLAPPED          m_overlapped;
     DWORD               m_operator;
-    std::vector<char>   m_buffer;       // 缓冲区
     ThreadWorker        m_worker;       // 处理函数
+    StrandTask          m_task;         // 在连接的 strand 上执行 m_worker
     Server*             m_server;       // 服务器对象
     Client*             m_client;       // 客户端对象
     WSABUF              m_wsaBuffer;
@@ -58,56 +93,334 @@ template<IoOperator> \
 class SendOverlapped; \
 typedef SendOverlapped<IOSend>      SENDOVERLAPPED;
 
+template<IoOperator> \
+class AwaitOverlapped; \
+typedef AwaitOverlapped<IOAwait>    AWAITOVERLAPPED;
+
+
+// 发送完成回调。error 为 0 表示成功，sent 为实际发送的字节数
+typedef std::function<void(int error, ULONGLONG sent)>  SEND_DONE;
+
+
+/*++
+    发送项
+        内存数据或者文件的一部分，按进入发送队列的顺序依次发送，上一项发送完成后才开始下一项。
+        文件通过 TransmitFile 直接从系统缓存发送到套接字，不经过用户态缓冲区。
+--*/
+struct SendItem
+{
+    enum
+        {
+        SIBuffer,
+        SIFile,
+        SIShared,       // 多个连接共享的只读数据，例如 ContentCache 中的映射内存
+        SIGather        // 多个内存数据（SIBuffer/SIShared）合并成一次 WSASend，见 Client::Cork
+        };
+
+    SendItem() \
+        : m_type(SIBuffer), \
+          m_hFile(INVALID_HANDLE_VALUE), \
+          m_offset(0), \
+          m_length(0), \
+          m_closeFile(false), \
+          m_pShared(nullptr), \
+          m_sharedSize(0), \
+          m_sent(0) \
+        {  }
+
+    // 需要发送的总字节数
+    ULONGLONG Length() const
+        {
+        switch(m_type)
+            {
+        case SIFile:
+            return m_length;
+        case SIShared:
+            return m_sharedSize;
+        case SIGather:
+            {
+            ULONGLONG length = 0;
+            for(size_t i = 0; i != m_parts.size(); ++i)
+                {
+                length += m_parts[i].Length();
+                }
+            return length;
+            }
+        default:
+            return m_data.size();
+            }
+        }
+
+    // 内存数据的起始地址，只用于 SIBuffer 和 SIShared
+    const char* Data() const
+        { return (SIShared == m_type) ? m_pShared : m_data.data(); }
+
+    int                 m_type;
+    std::vector<char>   m_data;         // SIBuffer
+    HANDLE              m_hFile;        // SIFile
+    ULONGLONG           m_offset;       // 文件起始位置
+    ULONGLONG           m_length;       // 文件区域长度
+    bool                m_closeFile;    // 发送完成后关闭文件
+    std::shared_ptr<const void> m_owner;    // SIShared，发送完成前保持数据有效
+    const char*         m_pShared;
+    size_t              m_sharedSize;
+    std::vector<SendItem>   m_parts;    // SIGather，每一部分的 m_done 分别回调
+    ULONGLONG           m_sent;         // 已经发送的字节数
+    SEND_DONE           m_done;
+};
+
+
+// 连接的发送状态：合并发送和等待发送的项。
+// 第一次发送时才分配（Client::SendState），只接收不发送的连接没有；队列空了以后归还元素占用的内存
+struct ClientSend
+{
+    static void* operator new(size_t size) { return NumaHeap::Allocate(size); }
+    static void operator delete(void* ptr) { NumaHeap::Free(ptr); }
+
+    std::mutex              m_lock;         // 保护 m_corked 和 m_pending
+    std::vector<SendItem>   m_corked;       // Cork 期间暂存的发送项
+    std::deque<SendItem>    m_pending;      // 等待上一项发送完成的项
+};
+
 
 // 客户端
 class Client \
         : public ThreadFuncBase
 {
 public:
-    Client();
+    enum
+        {
+        ClientMaxRecvBuffer = 1024 * 1024   // 默认的接收缓冲区上限
+        };
+public:
+    // family 为 AF_UNSPEC 时不创建套接字，用于进程内通道。
+    // 接收、发送完成的处理在 pPool 上串行执行，pPool 为空时在完成端口线程上执行
+    explicit Client(int family = AF_INET, ThreadPool* pPool = nullptr);
     ~Client();
 
     // 设置重叠结构
     void SetOverlapped(Client* ptr);
 
+    // Client 对象从创建线程所在的 NUMA 节点上分配
+    static void* operator new(size_t size) { return NumaHeap::Allocate(size); }
+    static void operator delete(void* ptr) { NumaHeap::Free(ptr); }
+
     operator SOCKET() { return m_sock; };
-    operator PVOID() { return reinterpret_cast<PVOID>(m_buffer.data()); }
+    // AcceptEx 的地址缓冲区和重叠结构，AcceptWorker 完成后释放（ReleaseAccept），之后为空
+    operator PVOID();
     operator LPOVERLAPPED();
     operator LPDWORD() { return &m_dwReceived; }
 
     LPWSABUF RecvWSABuffer();
     LPOVERLAPPED RecvOverlapped();
 
-    LPWSABUF SendWSABuffer();
-    LPOVERLAPPED SendOverlapped();
-
     DWORD& GetFlags() { return m_dwFlags; }
-    sockaddr_in* GetLocalAddr() { return &m_laddr; }
-    sockaddr_in* GetRemoteAddr() { return &m_raddr; }
-    size_t GetBufferSize() const { return m_buffer.size(); }
+    // 对端地址，只保存 IPv4/IPv6，其他地址族（Unix 域套接字、进程内通道）的 si_family 为 AF_UNSPEC
+    const SOCKADDR_INET& GetRemoteAddr() const { return m_raddr; }
+    void SetRemoteAddr(const sockaddr* pAddr, int length);
+    // 本地地址不保存，需要时用 getsockname 读取，失败返回 false
+    bool GetLocalAddr(SOCKADDR_STORAGE& addr);
+
+    // 连接建立后释放 accept 的上下文，只能由 AcceptWorker 调用
+    void ReleaseAccept();
+
+    // 空闲连接（没有接收缓冲区、没有正在发送的项）占用的内存：Client 和接收上下文。
+    // 发送过数据的连接另外保留一个 ClientSend（SendStateFootprint）。由管理端点报告
+    static size_t IdleFootprint();
+    static size_t SendStateFootprint();
+    // 接收缓冲区的上限，不完整的消息超过这个大小时断开连接，需要大于最大的消息（例如 Router 的 MHMaxLength）
+    void SetMaxRecvBuffer(size_t size) { m_maxRecv = static_cast<uint32_t>((std::min)(size,static_cast<size_t>(UINT32_MAX))); }
+
+    // 当前接收缓冲区的大小，连接空闲时为 0。可以在其他线程读取
+    size_t GetBufferSize() const { return m_bufferBytes.load(std::memory_order_relaxed); }
+
+    // 有发送项正在发送
+    bool IsSending() const { return m_sending.load(std::memory_order_relaxed); }
+
+    // 合并发送：Cork 之后的 Send/SendShared 先暂存，最外层的 Uncork 把它们合并成一个发送项，
+    // 用一次多缓冲区的 WSASend 发出。可以嵌套，可以在任意线程调用。
+    // 处理函数（SetMessageHandler）执行期间自动 Cork，一批消息产生的回复合并发送
+    void Cork();
+    void Uncork();
+
+    // 关闭 Nagle 算法。合并发送之后每次 WSASend 都是完整的一批数据，关闭 Nagle 不会增加包数，
+    // 也不会有 Nagle 带来的等待。进程内通道直接返回 true
+    bool SetNoDelay(bool bNoDelay);
+
+    // 已经进入发送队列还没有发送完成的项数
+    size_t GetSendBacklog() const { return m_backlog.load(std::memory_order_relaxed); }
+
+    // 录制收到的数据，pCapture 为空时关闭。需要在连接建立之前设置（Server::SetCapture）
+    void SetCapture(CaptureLog* pCapture)
+        {
+        m_capture = pCapture;
+        m_captureId = pCapture ? pCapture->NextConnection() : 0;
+        }
+
+    // 写一帧录制数据，没有打开录制时什么也不做
+    void Capture(uint16_t type, const void* data = nullptr, size_t size = 0)
+        {
+        if(m_capture)
+            {
+            m_capture->Write(m_captureId,type,data,size);
+            }
+        }
+
+    // 停止接收：当前的数据处理完后不再投递接收，用于 Server::Drain
+    void StopReceiving() { m_stopRecv.store(true,std::memory_order_relaxed); }
+
+    // 没有未完成的发送项，strand 上也没有待执行的任务
+    bool IsQuiet() { return (0 == GetSendBacklog()) && m_strand.IsIdle(); }
+
+    // 套接字上已经投递、完成包还没有取出的操作数（AcceptEx、零字节接收、发送）。
+    // 内核在操作完成时写入 Client 的重叠结构，不为 0 时不能删除 Client。进程内通道不计数
+    void IoStarted() { m_ioPending.fetch_add(1,std::memory_order_relaxed); }
+    void IoDone() { m_ioPending.fetch_sub(1,std::memory_order_relaxed); }
+    bool HasPendingIo() const { return m_ioPending.load(std::memory_order_relaxed) > 0; }
+
+    // 取消套接字上所有未完成的操作，进程内通道关闭管道
+    void CancelIo();
+
+    // 断开连接：不再接收，关闭双向的数据流并取消未完成的操作。
+    // 套接字不关闭（Server 按套接字登记连接），Client 对象在 Drain 时删除
+    void Abort();
+
+    // 引用计数，创建时为 1，由 Server 持有。Broadcast 在锁外使用连接时另外持有引用，
+    // RemoveClient 和 Drain 释放 Server 的引用，最后一个 Release 删除对象
+    void AddRef() { m_refs.fetch_add(1,std::memory_order_relaxed); }
+    void Release()
+        {
+        if(1 == m_refs.fetch_sub(1,std::memory_order_acq_rel))
+            {
+            delete this;
+            }
+        }
 
-    // 接收
+    // 连接的串行执行器，投递到这里的任务不会和接收、发送处理同时运行
+    Strand& GetStrand() { return m_strand; }
+
+    // 消息处理用的线性分配器，只能在连接的 strand 上使用，每条消息处理完后重置
+    Arena& GetArena() { return m_arena; }
+
+    // 调度权重，默认为 1，权重越大每轮得到的处理时间越多
+    void SetWeight(UINT weight) { m_strand.SetWeight(weight); }
+
+    // 收到数据后交给 obj->callback 处理，未设置时数据只打印不处理
+    void SetMessageHandler(ThreadFuncBase* obj, MESSAGE_CALLBACK callback)
+        {
+        m_msgObj = obj;
+        m_msgCallback = callback;
+        }
+
+    // 连接到进程内通道，完成包投递到 hIocp
+    void AttachInProc(const PTR_LINK& link, HANDLE hIocp);
+    bool IsInProc() const { return m_link != nullptr; }
+
+    // 投递接收和发送，返回值同 WSARecv/WSASend。进程内通道不经过内核
+    int PostRecv(LPWSABUF lpBuffers, LPOVERLAPPED lpOverlapped);
+    int PostSend(LPWSABUF lpBuffers, DWORD dwCount, LPOVERLAPPED lpOverlapped);
+
+    // 投递连接自己的零字节接收（m_ptrRecv）并计入未完成的操作，返回值同 PostRecv
+    int PostOwnRecv();
+
+    // 立即读取，返回值同 recv。套接字在 CompleteAccept 中设为非阻塞，没有数据时失败，错误码为 WSAEWOULDBLOCK
+    int ReadNow(char* buffer, size_t size);
+
+    // 接收并处理数据。返回 0 表示可能还有数据，-1 表示已经投递了零字节接收或者停止了接收，
+    // -2 表示连接已经关闭（对端关闭、出错、消息过大或者处理函数返回 -1），缓冲区已经归还，调用者需要注销连接（Server::CloseClient）
     int Recv();
 
-    // 发送
-    int Send(void* buffer, size_t size);
+    // 发送，数据会复制到发送队列中
+    int Send(void* buffer, size_t size, SEND_DONE done = nullptr);
+
+    // 发送文件的一部分，length 为 0 表示发送到文件末尾
+    int SendFile(const std::string& path, ULONGLONG offset = 0, ULONGLONG length = 0, SEND_DONE done = nullptr);
+
+    // 发送已经打开的文件，调用者需要保证发送完成前文件句柄有效。length 的含义和上面相同：
+    // 0 或者超出文件末尾时发送到文件末尾，offset 超出文件大小返回 -1，空区域立即回调 done
+    int SendFile(HANDLE hFile, ULONGLONG offset, ULONGLONG length, SEND_DONE done = nullptr);
+
+    // 发送共享的只读数据，不复制。owner 保证发送完成前 data 有效
+    int SendShared(std::shared_ptr<const void> owner, const char* data, size_t size, SEND_DONE done = nullptr);
 
-    // 发送数据
-    int SendData(std::vector<char>& data);
+    // 发送完成，由 SendWorker 调用。队列中没有其他项时释放发送上下文
+    void OnSendComplete(DWORD dwTransferred, DWORD dwError);
 
 private:
+    // 发送状态，第一次调用时分配，可以在任意线程调用
+    ClientSend* SendState();
+
+    // 进入发送队列。guard 持有 SendState()->m_lock，返回前释放
+    bool Enqueue(SendItem&& item, std::unique_lock<std::mutex>& guard);
+
+    // Cork 期间暂存，否则直接进入发送队列
+    bool Submit(SendItem&& item);
+
+    // 确定文件区域的长度后进入发送队列，失败返回 -1，这时 hFile 由调用者关闭
+    int SubmitFile(HANDLE hFile, ULONGLONG offset, ULONGLONG length, bool bCloseFile, SEND_DONE done);
+
+    // 暂存的数据合并成一个发送项进入发送队列。guard 持有 SendState()->m_lock，返回前释放
+    void FlushCorked(std::unique_lock<std::mutex>& guard);
+
+    // 发送当前项剩余的部分，false 表示投递失败
+    bool StartSend();
+
+    // 保证接收缓冲区至少有 size 字节
+    bool ReserveRecv(size_t size);
+
+    // 归还接收缓冲区
+    void ReleaseRecv(bool bParked);
+
+    // 连接关闭：断开连接，归还接收缓冲区和 Arena 的块，返回 -2
+    int Closed();
+
+private:
+    // 热数据：接收、发送路径上访问的字段放在前两个缓存行
     SOCKET                              m_sock;
+    char*                               m_recvBuf;      // 接收缓冲区，空闲时为空
+    size_t                              m_recvCap;      // 接收缓冲区大小
+    size_t                              m_usedBuf;      // 已经使用的缓冲区大小
     DWORD                               m_dwReceived;
     DWORD                               m_dwFlags;
-    std::shared_ptr<ACCEPTOVERLAPPED>   m_ptrOverlapped;
-    std::shared_ptr<RECVOVERLAPPED>     m_ptrRecv;
-    std::shared_ptr<SENDOVERLAPPED>     m_ptrSend;
-    std::vector<char>                   m_buffer;
-    size_t                              m_usedBuf;      // 已经使用的缓冲区大小
-    sockaddr_in                         m_laddr;        // local
-    sockaddr_in                         m_raddr;        // remote
-    bool                                m_isBusy;       // 是否在忙
-    SendQueue<std::vector<char>>        m_vecSend;      // 发送数据队列
+    std::atomic<bool>                   m_sending;      // 有发送项正在发送
+    std::atomic<bool>                   m_stopRecv;     // 不再投递接收
+    std::atomic<int>                    m_corkDepth;    // Cork 的嵌套层数
+    uint32_t                            m_captureId;    // 录制中的连接编号
+    uint32_t                            m_maxRecv;      // 接收缓冲区上限
+    CaptureLog*                         m_capture;      // 流量录制，为空表示不录制
+    std::atomic<size_t>                 m_backlog;      // 未完成的发送项
+    std::atomic<size_t>                 m_bufferBytes;  // m_recvCap 的副本，供其他线程读取
+    std::atomic<int>                    m_ioPending;    // 未完成的套接字操作
+    std::unique_ptr<RECVOVERLAPPED>     m_ptrRecv;
+    std::unique_ptr<SENDOVERLAPPED>     m_ptrSend;      // 只在发送期间存在
+    ThreadFuncBase*                     m_msgObj;       // 消息处理对象
+    MESSAGE_CALLBACK                    m_msgCallback;
+    PTR_LINK                            m_link;         // 进程内通道
+    AdaptiveSizer                       m_sizer;        // 接收缓冲区大小预测
+    Strand                              m_strand;       // 接收、发送处理按顺序执行
+    Arena                               m_arena;        // 消息处理的临时内存，连接空闲时归还
+    // 冷数据
+    std::atomic<long>                   m_refs;
+    std::unique_ptr<ACCEPTOVERLAPPED>   m_ptrOverlapped;    // 只在 AcceptEx 完成前存在
+    std::atomic<ClientSend*>            m_send;         // 第一次发送时分配
+    HANDLE                              m_hIocp;        // 进程内通道的完成端口
+    SOCKADDR_INET                       m_raddr;        // 对端地址
+};
+
+
+
+// 作用域内合并发送
+class CorkScope
+{
+public:
+    explicit CorkScope(Client& client) : m_client(client) { m_client.Cork(); }
+    ~CorkScope() { m_client.Uncork(); }
+
+    CorkScope(const CorkScope&) = delete;
+    CorkScope& operator=(const CorkScope&) = delete;
+
+private:
+    Client&     m_client;
 };
 
 
@@ -122,6 +435,8 @@ public:
     virtual ~AcceptOverlapped() = default;
 public:
     int AcceptWorker();
+public:
+    char        m_addrBuf[2 * (sizeof(SOCKADDR_STORAGE) + 16)];    // AcceptEx 的地址
 };
 
 
@@ -135,11 +450,9 @@ public:
     RecvOverlapped();
     virtual ~RecvOverlapped() = default;
 public:
-    int RecvWorker()
-        {
-        int ret = m_client->Recv();
-        return ret;
-        }
+    // 在连接的 strand 上执行。读到数据后重新排队继续读，直到没有数据时投递零字节接收。
+    // 连接关闭后注销，Client 在 strand 空闲后由完成端口线程释放
+    int RecvWorker();
 };
 
 
@@ -153,9 +466,15 @@ public:
 public:
     int SendWorker()
         {
-        // TODO: Send 可能不会立即完成
+        m_client->OnSendComplete(m_dwTransferred,m_dwError);
         return -1;
         }
+public:
+    SendItem    m_item;             // 正在发送的项
+    std::vector<WSABUF> m_gather;   // SIGather 的缓冲区数组
+    NUMA_BUFFER m_buffer;           // 进程内通道发送文件时的分块
+    DWORD       m_dwTransferred;
+    DWORD       m_dwError;
 };
 typedef SendOverlapped<IOSend>   SENDOVERLAPPED;
 
@@ -173,23 +492,149 @@ public:
         // TODO: 报错
         return -1;
         }
+public:
+    NUMA_BUFFER     m_buffer;
 };
 typedef ErrorOverlapped<IOError>    ERROROVERLAPPED;
 
 
+// Await - Overlapped
+// 协程等待对象的基类，存放在协程帧中，不需要额外分配内存
+template<IoOperator _Op> \
+class AwaitOverlapped \
+        : public IoOverlapped \
+{
+public:
+    AwaitOverlapped(ResumeMode mode = ResumeInline)
+        {
+        m_operator = _Op;
+        m_worker = ThreadWorker(this,reinterpret_cast<FUNCTYPE>(&AwaitOverlapped<_Op>::ResumeWorker));
+        memset(&m_overlapped,0,sizeof(m_overlapped));
+        m_server = nullptr;
+        m_client = nullptr;
+        m_sock = INVALID_SOCKET;
+        m_mode = mode;
+        m_dwTransferred = 0;
+        m_dwError = 0;
+        }
+    virtual ~AwaitOverlapped() = default;
+public:
+    // 完成端口线程调用，保存结果
+    void Complete(DWORD dwTransferred, DWORD dwError)
+        {
+        m_dwTransferred = dwTransferred;
+        m_dwError = dwError;
+        }
+
+    // 恢复协程，恢复后本对象可能已经被销毁
+    void Resume()
+        { m_handle.resume(); }
+
+    // 线程池中恢复协程
+    int ResumeWorker()
+        {
+        Resume();
+        return -1;
+        }
+public:
+    std::coroutine_handle<>     m_handle;           // 等待中的协程
+    SOCKET                      m_sock;             // 发起操作的套接字，失败时用来获取错误码
+    ResumeMode                  m_mode;
+    DWORD                       m_dwTransferred;    // 传输的字节数
+    DWORD                       m_dwError;          // 0 表示成功
+};
+
+
+
+// 完成端口线程运行指标。m_spinHits / (m_spinHits + m_blocks) 为忙轮询命中率
+struct CompletionLoopMetrics
+{
+    size_t  m_polls         = 0;    // 非阻塞轮询次数
+    size_t  m_spinHits      = 0;    // 在忙轮询期间取到完成包的次数
+    size_t  m_blocks        = 0;    // 阻塞等待的次数
+    size_t  m_completions   = 0;    // 处理的完成包数
+};
+
+
+// 单个连接的状态
+struct ConnectionStats
+{
+    SOCKET      m_sock          = INVALID_SOCKET;   // 进程内连接为 INVALID_SOCKET
+    size_t      m_bufferBytes   = 0;                // 接收缓冲区大小
+    bool        m_sending       = false;            // 有发送项正在发送
+    bool        m_idle          = true;             // strand 上没有待执行的任务
+    UINT        m_weight        = 1;                // 调度权重
+    size_t      m_sendBacklog   = 0;                // 未完成的发送项
+};
+
+
+// 一次排空的结果
+struct DrainResult
+{
+    bool        m_clean         = true;     // 截止时间前所有连接都处理完了
+    size_t      m_connections   = 0;        // 开始排空时的连接数
+    size_t      m_aborted       = 0;        // 截止时还有未完成操作、被取消的连接数
+    size_t      m_leaked        = 0;        // 取消的操作没有在 ServerCancelWaitMs 内完成、没有删除的连接数
+    ULONGLONG   m_elapsedMs     = 0;
+};
+
+
+// 一次广播的结果
+struct BroadcastResult
+{
+    size_t  m_sent      = 0;    // 进入发送队列的连接数
+    size_t  m_dropped   = 0;    // 积压超过上限或者发送队列已经关闭而跳过的连接数
+};
+
+
+// 广播运行指标
+struct BroadcastMetrics
+{
+    size_t  m_broadcasts    = 0;
+    size_t  m_deliveries    = 0;
+    size_t  m_dropped       = 0;
+};
+
+
 
 class Server
         : public ThreadFuncBase
 {
 public:
-    Server(const std::string& ip = "0.0.0.0", short port = 9527) \
-        : m_pool(10) \
+    enum
+        {
+        ServerIocpBatch         = 64,   // 完成端口线程每次最多取出的完成包数
+        ServerAdmissionCheckMs  = 50,   // 暂停接受连接时完成端口线程检查恢复的间隔
+        ServerDrainPollMs       = 10,   // 排空时检查连接状态的间隔
+        ServerReapMs            = 100,  // 有关闭的连接等待释放时完成端口线程醒来的间隔
+        ServerCancelWaitMs      = 2000  // 排空时等待取消的操作完成的最长时间
+        };
+public:
+    Server(const std::string& ip = "0.0.0.0", short port = 9527, \
+           const ThreadPoolOptions& options = ThreadPoolOptions()) \
+        : Server(Endpoint::Inet(ip,port),options) \
+        {  }
+
+    // 监听指定的端点：TCP、Unix 域套接字或进程内通道
+    explicit Server(const Endpoint& endpoint, \
+           const ThreadPoolOptions& options = ThreadPoolOptions()) \
+        : m_pool(options), \
+          m_scheduler(&m_pool), \
+          m_admission(&m_pool), \
+          m_endpoint(endpoint) \
         {
         m_hIocp = INVALID_HANDLE_VALUE;
         m_sock = INVALID_SOCKET;
-        m_addr.sin_family = AF_INET;
-        m_addr.sin_port = htons(port);
-        m_addr.sin_addr.s_addr = inet_addr(ip.c_str());
+        m_pinCompletion = false;
+        m_busyPollTicks = 0;
+        m_noDelay = false;
+        m_maxRecv = Client::ClientMaxRecvBuffer;
+        m_acceptPaused = false;
+        m_draining = false;
+        m_closedCount = 0;
+        m_capture = nullptr;
+        m_msgObj = nullptr;
+        m_msgCallback = nullptr;
         }
 
     ~Server();
@@ -200,29 +645,193 @@ public:
     // 新连接
     bool NewAccept()
         {
-        Client* pClient = new Client;
-        pClient->SetOverlapped(pClient);
-        m_client.insert(std::pair<SOCKET,Client*>(*pClient,pClient));
-        if(!AcceptEx(m_sock,*pClient,*pClient,0,sizeof(sockaddr_in) + 16,sizeof(sockaddr_in) + 16,*pClient,*pClient))
+        if(m_draining.load())
             {
-            if(WSAGetLastError() != ERROR_SUCCESS && (WSAGetLastError() != WSA_IO_PENDING))
+            return true;
+            }
+        Client* pClient = CreateClient();
+        bool bKernel = !m_endpoint.IsInProc();
+        if(bKernel)
+            {
+            pClient->IoStarted();
+            }
+        if(!PostAccept(pClient,*pClient))
+            {
+            if(bKernel)
                 {
-                std::cerr << "AcceptEx failed! [" << WSAGetLastError() \
-                          << "] (" << Tools::GetErrorInfo(WSAGetLastError()).c_str() \
-                          << ")" << std::endl;
-                closesocket(m_sock);
-                m_sock = INVALID_SOCKET;
-                m_hIocp = INVALID_HANDLE_VALUE;
-
-                return false;
+                pClient->IoDone();
                 }
+            std::cerr << "AcceptEx failed! [" << WSAGetLastError() \
+                      << "] (" << Tools::GetErrorInfo(WSAGetLastError()).c_str() \
+                      << ")" << std::endl;
+            closesocket(m_sock);
+            m_sock = INVALID_SOCKET;
+            m_hIocp = INVALID_HANDLE_VALUE;
+
+            return false;
             }
         return true;
         }
 
+    // 排空：停止接受新连接（关闭监听套接字），已有连接处理完收到的数据后不再接收，
+    // 等待正在处理的数据和发送队列在 timeoutMs 内完成，然后断开所有连接、等待取消的操作回到完成端口，
+    // 再停止完成端口线程和线程池并删除连接。只执行一次，析构时以 0 超时执行
+    DrainResult Drain(ULONGLONG timeoutMs);
+
+    bool IsDraining() const { return m_draining.load(); }
+
+    // 使用从其他进程继承的监听套接字（ListenerHandoff::Inherit），需要在 StartServer 之前调用，
+    // 端点的地址族需要和套接字相同
+    void AdoptListener(SOCKET sock) { m_sock = sock; }
+
+    // 把监听套接字交给在 path 上等待的新进程，之后通常调用 Drain，见 Handoff.h
+    bool HandOff(const std::string& path, ULONGLONG timeoutMs)
+        { return ListenerHandoff::Offer(m_sock,path,timeoutMs); }
+
+    // 一个连接处理完后继续接受下一个。过载并且策略为 AdmissionPause 时暂停，由完成端口线程恢复
+    bool ContinueAccept();
+
+    // 过载并且策略为 AdmissionReject 时重置并删除新连接，返回 false
+    bool AdmitConnection(Client* pClient);
+
+    // 创建客户端并登记
+    Client* CreateClient();
+
+    // 注销客户端并释放 Server 持有的引用，没有其他引用时删除。只能用于没有进行中的操作的连接
+    void RemoveClient(Client* pClient);
+
+    // 注销已经关闭的客户端，可以在它的 strand 上调用。
+    // 没有未完成的发送、strand 空闲之后由完成端口线程释放 Server 的引用（ReapClients）
+    void CloseClient(Client* pClient);
+
+    // 释放已经安静下来的关闭的客户端
+    void ReapClients();
+
+    // 从连接表和广播分组中移除，需要持有 m_lock。返回 false 表示已经不在表中
+    bool Unregister(Client* pClient);
+
+    // 投递 AcceptEx。false 表示投递失败，错误码通过 WSAGetLastError 获取
+    bool PostAccept(Client* pClient, LPOVERLAPPED lpOverlapped);
+
+    // AcceptEx 完成后，获取地址并将新套接字绑定到 IOCP
+    void CompleteAccept(Client* pClient);
+
+    // 向 IOCP 投递一个自定义完成包
+    bool PostCompletion(LPOVERLAPPED lpOverlapped, DWORD dwTransferred = 0);
+
     // 绑定新套接字
     void BindNewSocket(SOCKET s, ULONG_PTR ulKey);
 
+    // 连接到进程内通道监听的 Server，找不到返回 nullptr
+    static PTR_INPROC_STREAM ConnectInProc(const std::string& name);
+
+    const Endpoint& GetEndpoint() const { return m_endpoint; }
+
+    // 线程池运行指标
+    ThreadPoolMetrics GetPoolMetrics() { return m_pool.GetMetrics(); }
+    std::vector<ThreadState> GetThreadStates() { return m_pool.GetThreadStates(); }
+
+    // 所有连接的状态。只读取连接的原子状态，持有 m_lock 的时间和连接数成正比，不影响收发
+    std::vector<ConnectionStats> GetConnectionStats();
+
+    // 连接之间的公平调度，连接的权重通过 Client::SetWeight 设置
+    void SetSchedulerOptions(const FairSchedulerOptions& options) { m_scheduler.SetOptions(options); }
+    FairSchedulerMetrics GetSchedulerMetrics() { return m_scheduler.GetMetrics(); }
+
+    // 准入控制，需要在 StartServer 之前设置，见 Admission.h
+    void SetAdmissionOptions(const AdmissionOptions& options) { m_admission.SetOptions(options); }
+    AdmissionMetrics GetAdmissionMetrics() { return m_admission.GetMetrics(); }
+
+    // 过载时按连接的权重决定是否处理一个可以拒绝的请求，false 表示应该回复忙或者丢弃。
+    // 只在处理函数中按请求调用，调度器和接收路径不使用
+    bool Admit(Client& client) { return m_admission.Admit(client.GetStrand().GetWeight()); }
+
+    // 录制新连接收到的数据，见 Capture.h。需要在 StartServer 之前设置，为空表示不录制
+    void SetCapture(CaptureLog* pCapture) { m_capture = pCapture; }
+
+    // 新连接的接收缓冲区上限，见 Client::SetMaxRecvBuffer，需要在 StartServer 之前设置
+    void SetMaxRecvBuffer(size_t size) { m_maxRecv = size; }
+
+    // 新连接是否关闭 Nagle 算法（TCP_NODELAY），默认不关闭，需要在 StartServer 之前设置
+    void SetNoDelay(bool bNoDelay) { m_noDelay = bNoDelay; }
+
+    // 新连接的消息处理，需要在 StartServer 之前设置
+    void SetMessageHandler(ThreadFuncBase* obj, MESSAGE_CALLBACK callback)
+        {
+        m_msgObj = obj;
+        m_msgCallback = callback;
+        }
+
+    // 广播分组。连接删除时自动退出所有分组
+    enum
+        {
+        BroadcastAll        = 0,    // 所有连接，不需要加入
+        BroadcastMinBatch   = 256,  // 每批至少的连接数，不到两批时在调用线程上直接入队
+        BroadcastMaxBacklog = 64    // 默认的积压上限
+        };
+    void JoinGroup(UINT group, Client* pClient);
+    void LeaveGroup(UINT group, Client* pClient);
+
+    // 把同一份数据发给分组中的所有连接。数据不复制，每个连接只增加 owner 的引用计数，
+    // 发送完成前 owner 保证 data 有效。积压的发送项达到 maxBacklog 的连接跳过这一次。
+    // m_lock 只在复制成员列表（并增加连接的引用）时持有，入队在锁外进行。
+    // 连接多时按线程池的线程数分成几批，每个线程一批，调用线程执行第一批，返回时已经全部入队
+    BroadcastResult Broadcast(UINT group, std::shared_ptr<const void> owner, const char* data, size_t size, \
+        size_t maxBacklog = BroadcastMaxBacklog);
+
+    // 复制一次数据后广播
+    BroadcastResult Broadcast(UINT group, const void* data, size_t size, size_t maxBacklog = BroadcastMaxBacklog);
+
+    BroadcastMetrics GetBroadcastMetrics() const
+        {
+        BroadcastMetrics metrics;
+        metrics.m_broadcasts = m_broadcast.m_broadcasts.load();
+        metrics.m_deliveries = m_broadcast.m_deliveries.load();
+        metrics.m_dropped = m_broadcast.m_dropped.load();
+        return metrics;
+        }
+
+    // 分发到线程池，返回值同 ThreadPool::DispatchWorker
+    int DispatchWorker(const ThreadWorker& worker) { return m_pool.DispatchWorker(worker); }
+
+    // 监听套接字
+    SOCKET GetListenSocket() const { return m_sock; }
+
+    // 添加一个数据报端点，需要在 StartServer 之后调用。失败返回 nullptr
+    // 收到的数据报按批交给 obj->callback 在线程池中处理
+    DatagramEndpoint* AddDatagramEndpoint(const std::string& ip, short port, \
+        ThreadFuncBase* obj, DATAGRAM_CALLBACK callback, const DatagramOptions& options);
+
+    // 数据报端点在本轮完成包中有数据，等待本轮结束后统一分发
+    void MarkDatagramReady(DatagramEndpoint* pEndpoint) { m_ready.push_back(pEndpoint); }
+
+    // 完成端口线程绑定的核心，需要在 StartServer 之前设置
+    void SetCompletionAffinity(const GROUP_AFFINITY& affinity)
+        {
+        m_completionAffinity = affinity;
+        m_pinCompletion = true;
+        }
+
+    // 忙轮询：完成端口线程先用非阻塞方式轮询 spinUs 微秒，没有完成包才阻塞等待。
+    // 用 CPU 换延迟，适合延迟敏感的部署，配合 SetCompletionAffinity 独占一个核心。0 表示关闭
+    void SetBusyPoll(ULONGLONG spinUs)
+        {
+        LARGE_INTEGER freq;
+        QueryPerformanceFrequency(&freq);
+        m_busyPollTicks.store(static_cast<LONGLONG>(spinUs) * freq.QuadPart / 1000000);
+        }
+
+    // 完成端口线程运行指标
+    CompletionLoopMetrics GetCompletionMetrics() const
+        {
+        CompletionLoopMetrics metrics;
+        metrics.m_polls = m_metrics.m_polls.load();
+        metrics.m_spinHits = m_metrics.m_spinHits.load();
+        metrics.m_blocks = m_metrics.m_blocks.load();
+        metrics.m_completions = m_metrics.m_completions.load();
+        return metrics;
+        }
+
 private:
     // 创建套接字
     void CreateSocket()
@@ -233,19 +842,96 @@ private:
             return;
             }
 
-        m_sock = WSASocket(PF_INET,SOCK_STREAM,0, nullptr,0,WSA_FLAG_OVERLAPPED);
+        m_sock = WSASocket(m_endpoint.Family(),SOCK_STREAM,0, nullptr,0,WSA_FLAG_OVERLAPPED);
+        if(EPUnix == m_endpoint.Type())
+            {
+            // 上次运行留下的套接字文件会导致 bind 失败
+            DeleteFileA(m_endpoint.Name().c_str());
+            return;
+            }
         int opt = 1;
         setsockopt(m_sock,SOL_SOCKET,SO_REUSEADDR,reinterpret_cast<const char*>(&opt),sizeof(opt));
         }
 
+    // AcceptEx 每个地址需要的长度
+    static DWORD AcceptAddrLen() { return sizeof(SOCKADDR_STORAGE) + 16; }
+
+    // 进程内通道的新连接
+    bool AcceptInProc(const PTR_LINK& link);
+
+    // 所有连接，需要持有 m_lock
+    void CollectClients(std::vector<Client*>& clients);
+
+    // 进程内通道的监听表
+    static std::map<std::string, Server*>& InProcRegistry()
+        {
+        static std::map<std::string, Server*> registry;
+        return registry;
+        }
+    static std::mutex& InProcRegistryLock()
+        {
+        static std::mutex lock;
+        return lock;
+        }
+
     // IOCP 线程
     int ThreadIocp();
+
+    // 忙轮询，在设定的时间内取到完成包返回 true
+    bool PollCompletion(OVERLAPPED_ENTRY* pEntries, ULONG& ulCount);
+
+    // 处理一个完成包
+    void DealCompletion(const OVERLAPPED_ENTRY& entry);
+
+    // 连接自己的重叠结构（accept、接收、发送）的完成包取出后减少它的未完成操作数
+    static void CountIoDone(IoOverlapped* pOver);
+
+    // 等待 clients 上取消的操作回到完成端口，最多等到 deadline（GetTickCount64）。
+    // bDequeue 为 true 时线程池已经停止，在当前线程取出完成包并丢弃。返回还有未完成操作的连接数
+    size_t WaitCancelled(const std::vector<Client*>& clients, ULONGLONG deadline, bool bDequeue);
+
+    // 恢复等待中的协程
+    void ResumeAwait(AWAITOVERLAPPED* pAwaitOver, DWORD dwTransferred, bool bSuccess);
 private:
     ThreadPool                  m_pool;
+    FairScheduler               m_scheduler;    // 按连接轮转分配线程池时间
+    AdmissionController         m_admission;    // 准入控制
+    std::atomic<bool>           m_acceptPaused; // 过载时暂停了 AcceptEx
+    std::atomic<bool>           m_draining;     // 正在排空，不再接受连接
     HANDLE                      m_hIocp;
     SOCKET                      m_sock;
-    sockaddr_in                 m_addr;
+    Endpoint                    m_endpoint;
+    GROUP_AFFINITY              m_completionAffinity;
+    bool                        m_pinCompletion;    // 完成端口线程首次运行时绑定核心
+    std::atomic<LONGLONG>       m_busyPollTicks;    // 忙轮询时长，计数周期
+    bool                        m_noDelay;          // 新连接关闭 Nagle 算法
+    size_t                      m_maxRecv;          // 新连接的接收缓冲区上限
+    ThreadFuncBase*             m_msgObj;           // 新连接的消息处理
+    MESSAGE_CALLBACK            m_msgCallback;
+    CaptureLog*                 m_capture;          // 新连接的流量录制
+    struct
+        {
+        std::atomic<size_t>     m_polls{0};
+        std::atomic<size_t>     m_spinHits{0};
+        std::atomic<size_t>     m_blocks{0};
+        std::atomic<size_t>     m_completions{0};
+        }                       m_metrics;          // 只由完成端口线程写入
+    struct
+        {
+        std::atomic<size_t>     m_broadcasts{0};
+        std::atomic<size_t>     m_deliveries{0};
+        std::atomic<size_t>     m_dropped{0};
+        }                       m_broadcast;
+    std::mutex                  m_lock;         // 保护 m_client 和 m_groups，不在持有时发送
+    std::map<UINT, std::vector<Client*>>    m_groups;   // 广播分组
     std::map<SOCKET, Client*>   m_client;
+    std::vector<Client*>        m_inprocClients;    // 进程内连接没有套接字，单独保存
+    std::vector<Client*>        m_closed;           // 已经注销、等待释放的连接
+    std::atomic<size_t>         m_closedCount;      // m_closed 的大小，完成端口线程不加锁检查
+    std::deque<PTR_LINK>        m_inprocBacklog;    // 等待 accept 的进程内连接
+    std::deque<std::pair<Client*, LPOVERLAPPED>>    m_inprocAccepts;    // 等待连接的 accept
+    std::vector<DatagramEndpoint*>  m_datagrams;    // 数据报端点
+    std::vector<DatagramEndpoint*>  m_ready;        // 本轮有数据的端点，只在完成端口线程上访问
 };
 
 
@@ -0,0 +1,390 @@
+#ifndef IOCPANDTHREADPOOL_STRAND_H
+#define IOCPANDTHREADPOOL_STRAND_H
+
+
+#include <atomic>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+
+#include "Thread.h"
+
+
+/*++
+    串行执行器（strand）
+        同一个 Strand 上的任务按投递顺序一个接一个执行，不同 Strand 之间在线程池中并行。
+        每个连接一个 Strand，连接的接收、发送完成处理不会同时在两个线程上运行，
+        处理函数访问连接的缓冲区时不需要加锁。
+
+        实现：侵入式的多生产者单消费者无锁队列（Vyukov），加一个任务计数。
+        计数从 0 变为 1 的投递者负责把 Strand 交给线程池，之后由取得执行权的线程依次执行队列中的任务，
+        计数回到 0 时释放执行权。每次最多连续执行 StrandBudget 个任务，超过后重新排队，
+        避免一个繁忙的连接长期占住线程。
+        设置了 FairScheduler 时，Strand 不直接交给线程池，而是进入调度器的轮转队列，按权重分配执行时间。
+--*/
+
+
+class FairScheduler;
+
+
+
+// 队列节点，通常嵌在重叠结构中，任务执行之前就已经出队，执行时可以再次投递自己
+struct StrandTask
+{
+    StrandTask() : m_next(nullptr) {}
+    explicit StrandTask(const ThreadWorker& worker) : m_next(nullptr), m_worker(worker) {}
+
+    std::atomic<StrandTask*>    m_next;
+    ThreadWorker                m_worker;   // 返回值被忽略
+};
+
+
+class Strand \
+        : public ThreadFuncBase
+{
+public:
+    enum {StrandBudget = 32};   // 每次连续执行的最大任务数
+
+public:
+    // pPool 为空时在投递者的线程上执行
+    explicit Strand(ThreadPool* pPool = nullptr) \
+        : m_pool(pPool), \
+          m_scheduler(nullptr), \
+          m_head(&m_stub), \
+          m_tail(&m_stub), \
+          m_count(0), \
+          m_weight(1), \
+          m_deficit(0) \
+        {  }
+
+    ~Strand() = default;
+
+    Strand(const Strand&) = delete;
+    Strand& operator=(const Strand&) = delete;
+
+    void SetPool(ThreadPool* pPool) { m_pool = pPool; }
+
+    // 由调度器分配执行时间，为空时直接交给线程池
+    void SetScheduler(FairScheduler* pScheduler) { m_scheduler = pScheduler; }
+
+    // 调度权重，每轮得到的执行时间和权重成正比
+    void SetWeight(UINT weight) { m_weight.store((std::max)(1u,weight)); }
+    UINT GetWeight() const { return m_weight.load(); }
+
+    // 投递任务，节点在任务执行前不能被释放或再次投递
+    void Post(StrandTask* pTask)
+        {
+        Push(pTask);
+        if(0 == m_count.fetch_add(1,std::memory_order_acq_rel))
+            {
+            Schedule();
+            }
+        }
+
+    // 投递闭包，需要分配一个节点
+    void Post(std::function<void()> fn)
+        {
+        Closure* pClosure = new Closure(std::move(fn));
+        Post(&pClosure->m_task);
+        }
+
+    // 没有待执行的任务
+    bool IsIdle() const
+        { return 0 == m_count.load(std::memory_order_acquire); }
+
+private:
+    friend class FairScheduler;
+
+    // 自删除的闭包任务
+    class Closure \
+            : public ThreadFuncBase
+    {
+    public:
+        explicit Closure(std::function<void()> fn) \
+            : m_task(ThreadWorker(this,reinterpret_cast<FUNCTYPE>(&Closure::Run))), \
+              m_fn(std::move(fn)) \
+            {  }
+
+        int Run()
+            {
+            m_fn();
+            delete this;
+            return -1;
+            }
+
+        StrandTask              m_task;
+        std::function<void()>   m_fn;
+    };
+
+    // 交给调度器或线程池执行，线程池没有运行时在当前线程执行
+    void Schedule();
+
+    // 执行一轮，最多执行 llBudget 个计数周期（QueryPerformanceCounter），至少执行一个任务，用掉的周期从 m_deficit 中扣除。
+    // 返回实际使用的周期，bMore 为 true 表示还有任务，执行权仍然属于调用者。
+    // bMore 为 false 时执行权已经释放，其他线程可能正在执行它，连接也可能已经被删除，调用者不能再访问这个 Strand
+    LONGLONG RunTurn(LONGLONG llBudget, bool& bMore, size_t& tasks)
+        {
+        LARGE_INTEGER start, now;
+        QueryPerformanceCounter(&start);
+        LONGLONG deficit = m_deficit;
+        for(;;)
+            {
+            StrandTask* pTask = Pop();
+            ThreadWorker worker = pTask->m_worker;
+            worker();
+            ++tasks;
+            QueryPerformanceCounter(&now);
+            LONGLONG used = now.QuadPart - start.QuadPart;
+            // 释放执行权之前写回额度，没有任务的连接不保留正的额度
+            m_deficit = (std::min)(deficit - used,static_cast<LONGLONG>(0));
+            bMore = 1 != m_count.fetch_sub(1,std::memory_order_acq_rel);
+            if(!bMore)
+                {
+                return used;
+                }
+            m_deficit = deficit - used;
+            if(used >= llBudget)
+                {
+                return used;
+                }
+            }
+        }
+
+    // 依次执行队列中的任务
+    int DrainWorker()
+        {
+        for(size_t i = 0; i != StrandBudget; ++i)
+            {
+            StrandTask* pTask = Pop();
+            ThreadWorker worker = pTask->m_worker;
+            worker();
+            if(1 == m_count.fetch_sub(1,std::memory_order_acq_rel))
+                {
+                return -1;
+                }
+            }
+        // 还有任务，重新排队让其他连接先执行
+        Schedule();
+        return -1;
+        }
+
+    // 生产者：任意线程
+    void Push(StrandTask* pTask)
+        {
+        pTask->m_next.store(nullptr,std::memory_order_relaxed);
+        StrandTask* pPrev = m_head.exchange(pTask,std::memory_order_acq_rel);
+        pPrev->m_next.store(pTask,std::memory_order_release);
+        }
+
+    // 消费者：持有执行权的线程。计数保证队列中有任务，生产者还没有链接好时自旋等待
+    StrandTask* Pop()
+        {
+        for(;;)
+            {
+            StrandTask* pTail = m_tail;
+            StrandTask* pNext = pTail->m_next.load(std::memory_order_acquire);
+            if(pTail == &m_stub)
+                {
+                if(!pNext)
+                    {
+                    YieldProcessor();
+                    continue;
+                    }
+                m_tail = pNext;
+                pTail = pNext;
+                pNext = pNext->m_next.load(std::memory_order_acquire);
+                }
+            if(pNext)
+                {
+                m_tail = pNext;
+                return pTail;
+                }
+            if(pTail != m_head.load(std::memory_order_acquire))
+                {
+                YieldProcessor();
+                continue;
+                }
+            // 只剩最后一个节点，放回哨兵后才能取出
+            Push(&m_stub);
+            pNext = pTail->m_next.load(std::memory_order_acquire);
+            if(pNext)
+                {
+                m_tail = pNext;
+                return pTail;
+                }
+            YieldProcessor();
+            }
+        }
+
+private:
+    ThreadPool*                 m_pool;
+    FairScheduler*              m_scheduler;
+    StrandTask                  m_stub;     // 哨兵
+    std::atomic<StrandTask*>    m_head;     // 生产者写入端
+    StrandTask*                 m_tail;     // 消费者读取端，只由持有执行权的线程访问
+    std::atomic<size_t>         m_count;    // 已投递未执行完的任务数
+    std::atomic<UINT>           m_weight;
+    LONGLONG                    m_deficit;  // 调度器的剩余额度，只由持有执行权的线程访问
+};
+
+
+
+// 公平调度器配置
+struct FairSchedulerOptions
+{
+    ULONGLONG   m_quantumUs     = 200;      // 权重为 1 的连接每轮得到的执行时间（微秒）
+    ULONGLONG   m_turnBudgetUs  = 2000;     // 一轮最多连续执行的时间（微秒），额度累积也不超过这个值乘以权重
+};
+
+
+// 公平调度器运行指标
+struct FairSchedulerMetrics
+{
+    size_t  m_turns     = 0;    // 执行的轮数
+    size_t  m_skipped   = 0;    // 额度为负被跳过的轮数
+    size_t  m_tasks     = 0;    // 执行的任务数
+    size_t  m_overruns  = 0;    // 单个任务超出额度的次数
+    size_t  m_active    = 0;    // 当前排队的连接数
+};
+
+
+/*++
+    按连接公平分配线程池时间（赤字轮转，Deficit Round Robin）
+        有任务的 Strand 排在轮转队列中，每次投递一个轮次任务到线程池，轮次从队首取出一个 Strand：
+        额度增加 quantum * 权重，在额度内连续执行它的任务，用完后还有任务就排到队尾。
+        任务的耗时事先不知道，所以超出的部分记为负额度，在后面的轮次中扣回。
+        扣回只在有其他连接等待时进行，队列中只有它自己时一次补足额度直接执行，不空转。
+        一个连接同一时刻最多占用一个线程，安静的连接最多等待排在前面的连接各执行一轮。
+--*/
+class FairScheduler \
+        : public ThreadFuncBase
+{
+public:
+    explicit FairScheduler(ThreadPool* pPool, const FairSchedulerOptions& options = FairSchedulerOptions()) \
+        : m_pool(pPool) \
+        {
+        LARGE_INTEGER freq;
+        QueryPerformanceFrequency(&freq);
+        m_frequency = freq.QuadPart;
+        SetOptions(options);
+        }
+
+    ~FairScheduler() = default;
+
+    // 修改配置，之后的轮次生效
+    void SetOptions(const FairSchedulerOptions& options)
+        {
+        m_quantum.store(static_cast<LONGLONG>(options.m_quantumUs) * m_frequency / 1000000);
+        m_budget.store(static_cast<LONGLONG>(options.m_turnBudgetUs) * m_frequency / 1000000);
+        }
+
+    // 有任务的 Strand 进入轮转队列
+    void Enqueue(Strand* pStrand)
+        {
+        {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_ring.push_back(pStrand);
+        }
+        if(!m_pool || (-1 == m_pool->DispatchWorker(ThreadWorker(this,reinterpret_cast<FUNCTYPE>(&FairScheduler::TurnWorker)))))
+            {
+            TurnWorker();
+            }
+        }
+
+    FairSchedulerMetrics GetMetrics()
+        {
+        std::lock_guard<std::mutex> guard(m_lock);
+        FairSchedulerMetrics metrics = m_metrics;
+        metrics.m_active = m_ring.size();
+        return metrics;
+        }
+
+private:
+    // 执行轮转队列队首的一轮
+    int TurnWorker()
+        {
+        Strand* pStrand = nullptr;
+        {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if(m_ring.empty())
+            {
+            return -1;
+            }
+        pStrand = m_ring.front();
+        m_ring.pop_front();
+        }
+
+        LONGLONG weight = pStrand->GetWeight();
+        LONGLONG quantum = (std::max)(m_quantum.load() * weight,static_cast<LONGLONG>(1));
+        LONGLONG cap = (std::max)(quantum,m_budget.load() * weight);
+        LONGLONG deficit = pStrand->m_deficit + quantum;
+        if(deficit <= 0)
+            {
+            // 上一轮超支。有其他连接在等时本轮只补额度，让它们先执行
+            bool bWaiting = false;
+            {
+            std::lock_guard<std::mutex> guard(m_lock);
+            bWaiting = !m_ring.empty();
+            if(bWaiting)
+                {
+                ++m_metrics.m_skipped;
+                }
+            }
+            if(bWaiting)
+                {
+                pStrand->m_deficit = deficit;
+                Enqueue(pStrand);
+                return -1;
+                }
+            // 没有其他连接，一次补足需要的额度，不为每个 quantum 空转一轮
+            deficit += (-deficit / quantum + 1) * quantum;
+            }
+        pStrand->m_deficit = (std::min)(deficit,cap);
+
+        bool bMore = false;
+        size_t tasks = 0;
+        LONGLONG allowance = (std::min)(pStrand->m_deficit,m_budget.load());
+        LONGLONG used = pStrand->RunTurn(allowance,bMore,tasks);
+        {
+        std::lock_guard<std::mutex> guard(m_lock);
+        ++m_metrics.m_turns;
+        m_metrics.m_tasks += tasks;
+        m_metrics.m_overruns += (used > allowance) ? 1 : 0;
+        }
+        if(bMore)
+            {
+            Enqueue(pStrand);
+            }
+        return -1;
+        }
+
+private:
+    ThreadPool*             m_pool;
+    LONGLONG                m_frequency;
+    std::atomic<LONGLONG>   m_quantum;      // 计数周期
+    std::atomic<LONGLONG>   m_budget;       // 计数周期
+    std::mutex              m_lock;
+    std::deque<Strand*>     m_ring;         // 轮转队列
+    FairSchedulerMetrics    m_metrics;
+};
+
+
+
+inline void Strand::Schedule()
+    {
+    if(m_scheduler)
+        {
+        m_scheduler->Enqueue(this);
+        return;
+        }
+    if(m_pool && (m_pool->DispatchWorker(ThreadWorker(this,reinterpret_cast<FUNCTYPE>(&Strand::DrainWorker))) != -1))
+        {
+        return;
+        }
+    DrainWorker();
+    }
+
+
+#endif //IOCPANDTHREADPOOL_STRAND_H
@@ -7,12 +7,21 @@
 
 
 #include <iostream>
+#include <algorithm>
 #include <atomic>
+#include <deque>
+#include <functional>
 #include <mutex>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
 
+#include "Numa.h"
+#include "Log.h"
+
+
 /*++
     线程池
         为了更好的控制线程，比如线程的开启和关闭，这里使用了 Windows 创建线程的方式，而不是 std::thread
@@ -65,6 +74,9 @@ public:
     bool IsValid() const
         { return (m_thiz != nullptr) && (m_func != nullptr); }
 
+    // 执行任务的对象，用于诊断
+    ThreadFuncBase* Object() const { return m_thiz; }
+
 private:
     ThreadFuncBase* m_thiz;
     FUNCTYPE        m_func;
@@ -81,6 +93,9 @@ public:
         {
         m_hThread = nullptr;
         m_bStatus = false;
+        m_hasAffinity = false;
+        m_worker.store(nullptr);
+        m_idleSince.store(GetTickCount64());
         }
 
     ~Thread()
@@ -98,6 +113,19 @@ public:
         return m_bStatus;
         }
 
+    // 设置亲和性。启动前设置时由线程启动后自己绑定，已经启动时立即生效
+    bool SetAffinity(const GROUP_AFFINITY& affinity)
+        {
+        m_affinity = affinity;
+        m_hasAffinity = true;
+        if(!IsValid())
+            {
+            return true;
+            }
+        m_affinityChanged = true;
+        return SetThreadGroupAffinity(m_hThread,&affinity,nullptr) != FALSE;
+        }
+
     // 是否有效，true 表示有效，false 表示线程异常或已经终止
     bool IsValid()
         {
@@ -135,25 +163,71 @@ public:
             m_worker.store(nullptr);
             return;
             }
+        m_busySince.store(GetTickCount64());
         m_worker.store(new ::ThreadWorker(worker));
         }
 
     // 线程是否是闲置的。true表示空闲，false表示已经分配了工作
+    // UpdateWorker 只会保存有效的 worker，所以只需要判断是否为空
     bool IsIdle()
+        { return nullptr == m_worker.load(); }
+
+    // 已经空闲的时间（毫秒），忙碌时返回 0
+    ULONGLONG IdleTime()
         {
-        if(!m_worker)
+        if(!IsIdle())
             {
-            return true;
+            return 0;
             }
-        return !m_worker.load()->IsValid();
+        return GetTickCount64() - m_idleSince.load();
+        }
+
+    // 看门狗心跳：当前这一次调用 worker 的开始时间，不在任务中（或处于 ThreadBlockingScope 中）为 0
+    ULONGLONG TaskStart() const { return m_taskStart.load(std::memory_order_acquire); }
+    ThreadFuncBase* TaskObject() const { return m_taskObj.load(std::memory_order_relaxed); }
+    const char* TaskLabel() const { return m_taskLabel.load(std::memory_order_relaxed); }
+
+    // 给当前线程正在执行的任务加上说明（字符串常量），看门狗报告时输出。不在线程池线程中时忽略
+    static void SetTaskLabel(const char* label)
+        {
+        if(Current())
+            {
+            Current()->m_taskLabel.store(label,std::memory_order_relaxed);
+            }
+        }
+
+    // 当前线程对应的 Thread，不是 Thread 创建的线程时为空
+    static Thread*& Current()
+        {
+        static thread_local Thread* current = nullptr;
+        return current;
+        }
+
+    // 当前任务已经执行的时间（毫秒），空闲时返回 0
+    ULONGLONG BusyTime()
+        {
+        if(IsIdle())
+            {
+            return 0;
+            }
+        return GetTickCount64() - m_busySince.load();
         }
 
 private:
     // 工作线程
     void ThreadWorker()
         {
+        Current() = this;
+        if(m_hasAffinity)
+            {
+            Numa::PinCurrentThread(m_affinity);
+            }
         while(m_bStatus)
             {
+            if(m_affinityChanged.exchange(false))
+                {
+                Numa::Refresh();
+                }
             if(!m_worker)
                 {
                 Sleep(1);
@@ -162,7 +236,12 @@ private:
             ::ThreadWorker worker = *m_worker.load();
             if(worker.IsValid())
                 {
+                // 心跳：每次调用前记录开始时间，看门狗据此发现卡住的任务
+                m_taskObj.store(worker.Object(),std::memory_order_relaxed);
+                m_taskLabel.store(nullptr,std::memory_order_relaxed);
+                m_taskStart.store(GetTickCount64(),std::memory_order_release);
                 int ret = worker();
+                m_taskStart.store(0,std::memory_order_release);
                 if(ret)
                     {
                     std::string str;
@@ -171,7 +250,8 @@ private:
                     }
                 if(ret < 0)
                     {
-                    m_worker.store(nullptr);
+                    m_idleSince.store(GetTickCount64());
+                    delete m_worker.exchange(nullptr);
                     }
                 }
             else
@@ -195,26 +275,183 @@ private:
     HANDLE                          m_hThread;
     bool                            m_bStatus;      // 线程的状态。true 表示该线程正在运行，false 表示线程将要关闭
     std::atomic<::ThreadWorker*>    m_worker;       // 原子操作
+    std::atomic<ULONGLONG>          m_idleSince;    // 开始空闲的时间
+    std::atomic<ULONGLONG>          m_busySince{0}; // 当前任务开始的时间
+    std::atomic<ULONGLONG>          m_taskStart{0}; // 本次调用 worker 的开始时间
+    std::atomic<ThreadFuncBase*>    m_taskObj{nullptr};
+    std::atomic<const char*>        m_taskLabel{nullptr};
+    ULONGLONG                       m_flaggedStart = 0;     // 看门狗已经报告过的任务，只由管理线程访问
+
+    friend class ThreadPool;
+    friend class ThreadBlockingScope;
+    GROUP_AFFINITY                  m_affinity;     // 绑定的核心
+    bool                            m_hasAffinity;
+    std::atomic<bool>               m_affinityChanged{false};
+};
+
+
+/*++
+    已知的阻塞等待（例如完成端口线程在 GetQueuedCompletionStatusEx 上等待），期间不计入任务执行时间，
+    看门狗不会把它当成卡住的任务。离开作用域时重新开始计时
+--*/
+class ThreadBlockingScope
+{
+public:
+    ThreadBlockingScope() : m_thread(Thread::Current())
+        {
+        if(m_thread)
+            {
+            m_thread->m_taskStart.store(0,std::memory_order_release);
+            }
+        }
+
+    ~ThreadBlockingScope()
+        {
+        if(m_thread)
+            {
+            m_thread->m_taskStart.store(GetTickCount64(),std::memory_order_release);
+            }
+        }
+
+    ThreadBlockingScope(const ThreadBlockingScope&) = delete;
+    ThreadBlockingScope& operator=(const ThreadBlockingScope&) = delete;
+
+private:
+    Thread*     m_thread;
+};
+
+
+/*++
+    闭包任务
+        执行一次后删除自己，返回 -1 让线程回到空闲状态
+--*/
+class PoolTask \
+        : public ThreadFuncBase
+{
+public:
+    explicit PoolTask(std::function<void()> fn) : m_fn(std::move(fn)) {}
+    ~PoolTask() = default;
+
+    int TaskWorker()
+        {
+        m_fn();
+        delete this;
+        return -1;
+        }
+
+private:
+    std::function<void()>   m_fn;
+};
+
+
+template<typename T>
+class Future;
+
+
+
+/*++
+    弹性线程池的配置
+        任务在等待队列中等待超过 m_queueWaitMs 时增加线程，最多 m_maxThreads 个；
+        线程空闲超过 m_keepAliveMs 时回收，最少保留 m_minThreads 个。
+        看门狗：一次任务调用超过 m_stuckMs 时记录警告（线程、任务对象和 SetTaskLabel 的说明），
+        打开 m_replaceStuck 时每个卡住的线程允许多一个线程，任务恢复后多出的线程按空闲时间回收。
+        默认按 CPU 核数确定线程数量。
+--*/
+struct ThreadPoolOptions
+{
+    ThreadPoolOptions()
+        {
+        size_t cores = (std::max)(2u, std::thread::hardware_concurrency());
+        m_minThreads = cores;
+        m_maxThreads = cores * 2;
+        m_queueWaitMs = 5;
+        m_keepAliveMs = 30 * 1000;
+        m_stuckMs = 1000;
+        m_replaceStuck = false;
+        }
+
+    // 固定大小
+    explicit ThreadPoolOptions(size_t size)
+        {
+        m_minThreads = size;
+        m_maxThreads = size;
+        m_queueWaitMs = 5;
+        m_keepAliveMs = 30 * 1000;
+        m_stuckMs = 1000;
+        m_replaceStuck = false;
+        }
+
+    size_t      m_minThreads;
+    size_t      m_maxThreads;
+    ULONGLONG   m_queueWaitMs;      // 队列等待时间阈值
+    ULONGLONG   m_keepAliveMs;      // 空闲线程保留时间
+    ULONGLONG   m_stuckMs;          // 一次调用超过这个时间视为卡住并报告，0 表示关闭看门狗
+    bool        m_replaceStuck;     // 为卡住的线程临时增加线程，可以超过 m_maxThreads
+
+    // 线程亲和性，第 i 个线程绑定到 m_affinity[i % size]，为空表示不绑定。
+    // 例如 Numa::CoreAffinities() 每个线程一个核心，Numa::NodeAffinities() 按节点轮流分配
+    std::vector<GROUP_AFFINITY> m_affinity;
+};
+
+
+// 线程池运行指标
+struct ThreadPoolMetrics
+{
+    size_t      m_threads       = 0;    // 当前线程数
+    size_t      m_idleThreads   = 0;    // 空闲线程数
+    size_t      m_peakThreads   = 0;    // 线程数峰值
+    size_t      m_queued        = 0;    // 等待队列中的任务数
+    ULONGLONG   m_queueWaitMs   = 0;    // 队首任务已等待的时间
+    size_t      m_grown         = 0;    // 扩容次数
+    size_t      m_retired       = 0;    // 回收次数
+    ULONGLONG   m_lastGrowTick  = 0;    // 最近一次扩容的时间
+    ULONGLONG   m_lastRetireTick = 0;   // 最近一次回收的时间
+    size_t      m_stuck         = 0;    // 当前卡住的线程数
+    size_t      m_stuckTotal    = 0;    // 发现卡住的任务总数
+    size_t      m_replacements  = 0;    // 因为卡住的线程超出 m_maxThreads 增加的线程数
+};
+
+
+// 单个线程的状态
+struct ThreadState
+{
+    size_t      m_index     = 0;        // 线程池中的下标
+    bool        m_idle      = true;
+    ULONGLONG   m_busyMs    = 0;        // 当前任务已经执行的时间
+    ULONGLONG   m_idleMs    = 0;        // 已经空闲的时间
+    bool        m_stuck     = false;    // 当前调用超过 m_stuckMs
+    ThreadFuncBase* m_object = nullptr; // 正在执行的任务对象
+    const char* m_label     = nullptr;  // 任务说明
 };
 
 
 /*++
     线程池
+        所有线程都在忙时，任务进入等待队列，由管理线程分配给空闲线程，并根据等待时间和空闲时间伸缩
 --*/
 class ThreadPool
+        : public ThreadFuncBase
 {
 public:
-    ThreadPool(size_t size)
+    ThreadPool(size_t size) \
+        : ThreadPool(ThreadPoolOptions(size)) \
+        {  }
+
+    ThreadPool(const ThreadPoolOptions& options = ThreadPoolOptions()) \
+        : m_options(options) \
         {
-        m_threads.resize(size);
-        for(size_t i = 0; i != size; ++i)
+        m_options.m_maxThreads = (std::max)(m_options.m_minThreads, m_options.m_maxThreads);
+        m_bRunning = false;
+        m_threads.resize(m_options.m_minThreads);
+        for(size_t i = 0; i != m_threads.size(); ++i)
             {
             m_threads[i] = new Thread;
+            ApplyAffinity(m_threads[i],i);
             }
+        m_metrics.m_threads = m_threads.size();
+        m_metrics.m_peakThreads = m_threads.size();
         }
 
-    ThreadPool() = default;
-
     ~ThreadPool()
         {
         Stop();
@@ -233,7 +470,7 @@ public:
         bool ret = true;
         for(size_t i = 0; i != m_threads.size(); ++i)
             {
-            if(!m_threads[i]->Start())
+            if(m_threads[i] && !m_threads[i]->Start())
                 {
                 ret = false;
                 break;
@@ -243,54 +480,298 @@ public:
             {
             for(size_t i = 0; i != m_threads.size(); ++i)
                 {
-                m_threads[i]->Stop();
+                if(m_threads[i])
+                    {
+                    m_threads[i]->Stop();
+                    }
                 }
+            return ret;
             }
+        m_bRunning = true;
+        ret = m_manager.Start();
+        m_manager.UpdateWorker(::ThreadWorker(this,reinterpret_cast<FUNCTYPE>(&ThreadPool::ManageWorker)));
         return ret;
         }
 
     // 停止
     void Stop()
         {
+        m_bRunning = false;
+        m_manager.Stop();
         for(size_t i = 0; i != m_threads.size(); ++i)
             {
-            m_threads[i]->Stop();
+            if(m_threads[i])
+                {
+                m_threads[i]->Stop();
+                }
             }
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_pending.clear();
         }
 
     // 分发线程。
-    // 返回 -1 表示分配失败，所有线程都在忙。
+    // 返回 -1 表示分配失败，线程池没有运行。
+    // 返回 -2 表示所有线程都在忙，已经进入等待队列，稍后执行
     // >= 0 表示分配第 n 个线程来做这个事
     int DispatchWorker(const ThreadWorker& worker)
         {
-        int index = -1;
         std::lock_guard<std::mutex> guard(m_lock);
+        int index = AssignIdle(worker);
+        if(index >= 0)
+            {
+            return index;
+            }
+        if(!m_bRunning)
+            {
+            return -1;
+            }
+        m_pending.push_back(Pending{worker, GetTickCount64()});
+        return -2;
+        }
+
+    // 在线程池中执行一个闭包，返回值同 DispatchWorker，返回 -1 时闭包没有执行
+    int Post(std::function<void()> fn)
+        {
+        PoolTask* pTask = new PoolTask(std::move(fn));
+        int ret = DispatchWorker(ThreadWorker(pTask,reinterpret_cast<FUNCTYPE>(&PoolTask::TaskWorker)));
+        if(-1 == ret)
+            {
+            delete pTask;
+            }
+        return ret;
+        }
+
+    // 提交一个可调用对象，返回值通过 Future 取得，定义在 Future.h
+    template<typename F>
+    Future<std::invoke_result_t<std::decay_t<F>>> Submit(F&& fn);
+
+    // 检查线程是否有效
+    bool CheckThreadValid(size_t index)
+        {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if(index < m_threads.size() && m_threads[index])
+            {
+            return m_threads[index]->IsValid();
+            }
+        return false;
+        }
+
+    // 获取运行指标
+    ThreadPoolMetrics GetMetrics()
+        {
+        std::lock_guard<std::mutex> guard(m_lock);
+        ThreadPoolMetrics metrics = m_metrics;
+        metrics.m_threads = 0;
+        metrics.m_idleThreads = 0;
+        for(size_t i = 0; i != m_threads.size(); ++i)
+            {
+            if(m_threads[i])
+                {
+                ++metrics.m_threads;
+                metrics.m_idleThreads += m_threads[i]->IsIdle() ? 1 : 0;
+                }
+            }
+        metrics.m_queued = m_pending.size();
+        metrics.m_queueWaitMs = m_pending.empty() ? 0 : GetTickCount64() - m_pending.front().m_tick;
+        return metrics;
+        }
+
+    // 每个线程的状态。只读取线程的原子状态，持锁时间和 GetMetrics 相同
+    std::vector<ThreadState> GetThreadStates()
+        {
+        std::vector<ThreadState> states;
+        std::lock_guard<std::mutex> guard(m_lock);
+        for(size_t i = 0; i != m_threads.size(); ++i)
+            {
+            if(m_threads[i])
+                {
+                ThreadState state;
+                state.m_index = i;
+                state.m_idle = m_threads[i]->IsIdle();
+                state.m_busyMs = m_threads[i]->BusyTime();
+                state.m_idleMs = m_threads[i]->IdleTime();
+                ULONGLONG start = m_threads[i]->TaskStart();
+                state.m_stuck = m_options.m_stuckMs && start && (GetTickCount64() - start >= m_options.m_stuckMs);
+                state.m_object = m_threads[i]->TaskObject();
+                state.m_label = m_threads[i]->TaskLabel();
+                states.push_back(state);
+                }
+            }
+        return states;
+        }
+
+    const ThreadPoolOptions& GetOptions() const
+        { return m_options; }
+
+private:
+    // 等待中的任务
+    struct Pending
+        {
+        ThreadWorker    m_worker;
+        ULONGLONG       m_tick;     // 进入队列的时间
+        };
+
+    // 分配给空闲线程，需要持有 m_lock
+    int AssignIdle(const ThreadWorker& worker)
+        {
         for(size_t i = 0; i != m_threads.size(); ++i)
             {
             if(m_threads[i] && m_threads[i]->IsIdle())
                 {
                 m_threads[i]->UpdateWorker(worker);
-                index = i;
-                break;
+                return static_cast<int>(i);
                 }
             }
-        return index;
+        return -1;
+        }
+
+    // 按下标设置亲和性
+    void ApplyAffinity(Thread* pThread, size_t index)
+        {
+        if(!m_options.m_affinity.empty())
+            {
+            pThread->SetAffinity(m_options.m_affinity[index % m_options.m_affinity.size()]);
+            }
+        }
+
+    // 当前线程数，需要持有 m_lock
+    size_t LiveThreads() const
+        {
+        return static_cast<size_t>(std::count_if(m_threads.begin(),m_threads.end(), \
+            [](Thread* pThread) { return pThread != nullptr; }));
         }
 
-        // 检查线程是否有效
-        bool CheckThreadValid(size_t index)
+    // 增加一个线程，优先复用空位，保证已分配的下标不变。需要持有 m_lock
+    Thread* Grow()
+        {
+        std::vector<Thread*>::iterator it = std::find(m_threads.begin(),m_threads.end(),nullptr);
+        size_t index = it - m_threads.begin();
+        Thread* pThread = new Thread;
+        ApplyAffinity(pThread,index);
+        if(!pThread->Start())
             {
-            if(index < m_threads.size())
+            delete pThread;
+            return nullptr;
+            }
+        if(index < m_threads.size())
+            {
+            m_threads[index] = pThread;
+            }
+        else
+            {
+            m_threads.push_back(pThread);
+            }
+        ++m_metrics.m_grown;
+        m_metrics.m_lastGrowTick = GetTickCount64();
+        m_metrics.m_peakThreads = (std::max)(m_metrics.m_peakThreads, LiveThreads());
+        return pThread;
+        }
+
+    // 管理线程：分配等待中的任务，并按负载伸缩
+    int ManageWorker()
+        {
+        Thread* pRetired = nullptr;
+        {
+        std::lock_guard<std::mutex> guard(m_lock);
+        while(!m_pending.empty() && AssignIdle(m_pending.front().m_worker) >= 0)
+            {
+            m_pending.pop_front();
+            }
+
+        ULONGLONG now = GetTickCount64();
+        if(m_options.m_stuckMs && (now - m_lastWatchdog >= PoolWatchdogIntervalMs))
+            {
+            m_lastWatchdog = now;
+            CheckStuck(now);
+            }
+
+        if(!m_pending.empty())
+            {
+            // 等待时间超过阈值，扩容。卡住的线程不算在上限内
+            size_t limit = m_options.m_maxThreads + (m_options.m_replaceStuck ? m_metrics.m_stuck : 0);
+            while(!m_pending.empty() \
+                && (now - m_pending.front().m_tick >= m_options.m_queueWaitMs) \
+                && (LiveThreads() < limit))
                 {
-                return m_threads[index]->IsValid();
+                bool bReplacement = LiveThreads() >= m_options.m_maxThreads;
+                Thread* pThread = Grow();
+                if(!pThread)
+                    {
+                    break;
+                    }
+                m_metrics.m_replacements += bReplacement ? 1 : 0;
+                pThread->UpdateWorker(m_pending.front().m_worker);
+                m_pending.pop_front();
+                }
+            }
+        else if(LiveThreads() > m_options.m_minThreads)
+            {
+            // 每次最多回收一个空闲太久的线程，避免抖动
+            for(size_t i = 0; i != m_threads.size(); ++i)
+                {
+                if(m_threads[i] && (m_threads[i]->IdleTime() >= m_options.m_keepAliveMs))
+                    {
+                    pRetired = m_threads[i];
+                    m_threads[i] = nullptr;
+                    ++m_metrics.m_retired;
+                    m_metrics.m_lastRetireTick = now;
+                    break;
+                    }
+                }
+            }
+        }
+
+        // 在锁外等待线程退出
+        if(pRetired)
+            {
+            pRetired->Stop();
+            delete pRetired;
+            }
+        Sleep(1);
+        return 0;
+        }
+
+    // 看门狗：统计卡住的线程，每个卡住的任务只报告一次。需要持有 m_lock
+    void CheckStuck(ULONGLONG now)
+        {
+        size_t stuck = 0;
+        for(size_t i = 0; i != m_threads.size(); ++i)
+            {
+            Thread* pThread = m_threads[i];
+            ULONGLONG start = pThread ? pThread->TaskStart() : 0;
+            if(!start || (now < start) || (now - start < m_options.m_stuckMs))
+                {
+                continue;
+                }
+            ++stuck;
+            if(pThread->m_flaggedStart != start)
+                {
+                pThread->m_flaggedStart = start;
+                ++m_metrics.m_stuckTotal;
+                const char* label = pThread->TaskLabel();
+                Log::Write(LogWarn,"thread %zu stuck for %llu ms in task %p (%s)", \
+                    i,now - start,static_cast<void*>(pThread->TaskObject()),label ? label : "-");
                 }
-            return false;
             }
+        m_metrics.m_stuck = stuck;
+        }
+
 private:
-    std::mutex              m_lock;
-    std::vector<Thread*>    m_threads;
+    enum {PoolWatchdogIntervalMs = 100};    // 看门狗检查间隔
+
+    ThreadPoolOptions           m_options;
+    ThreadPoolMetrics           m_metrics;
+    std::atomic<bool>           m_bRunning;
+    std::mutex                  m_lock;
+    std::vector<Thread*>        m_threads;      // 回收后的位置置空，下标保持不变
+    std::deque<Pending>         m_pending;      // 等待队列
+    Thread                      m_manager;      // 管理线程
+    ULONGLONG                   m_lastWatchdog = 0;     // 上次看门狗检查的时间
 };
 
 
 
+#include "Future.h"
+
+
 #endif //IOCPANDTHREADPOOL_THREAD_H
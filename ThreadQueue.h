@@ -2,7 +2,11 @@
 #define IOCPANDTHREADPOOL_THREADQUEUE_H
 
 
+#include <algorithm>
+#include <iterator>
 #include <list>
+#include <utility>
+#include <vector>
 
 
 #include "Thread.h"
@@ -23,25 +27,54 @@ public:
         TQPush,
         TQPop,
         TQSize,
-        TQClear
+        TQClear,
+        TQPushBulk,
+        TQPopBulk
         };
 
     // Post Parameter 用于投递信息的结构体
     typedef struct IocpParam
         {
-        size_t  sOperator;      // 操作
-        T       sData;          // 数据
-        HANDLE  sEvent;         // pop 需要
-        IocpParam(int op, const T& data, HANDLE hEve = nullptr)
-            {
-            sOperator = op;
-            sData = data;
-            sEvent = hEve;
-            }
-        IocpParam()
-            {
-            sOperator = TQNone;
-            }
+        size_t          sOperator;      // 操作
+        T               sData;          // 数据
+        HANDLE          sEvent;         // pop 需要
+        std::vector<T>  sBulk;          // 批量操作的数据
+        size_t          sMax;           // 批量弹出的最大个数
+        ULONGLONG       sDeadline;      // 等待数据的截止时间，0 表示不等待
+        bool            sFound;         // 弹出时是否取到了数据
+        IocpParam(int op, const T& data, HANDLE hEve = nullptr) \
+            : sOperator(op), \
+              sData(data), \
+              sEvent(hEve), \
+              sMax(0), \
+              sDeadline(0), \
+              sFound(false) \
+            {  }
+        IocpParam(int op, T&& data, HANDLE hEve = nullptr) \
+            : sOperator(op), \
+              sData(std::move(data)), \
+              sEvent(hEve), \
+              sMax(0), \
+              sDeadline(0), \
+              sFound(false) \
+            {  }
+        // 直接在结构体中构造数据
+        template<typename... Args>
+        IocpParam(int op, std::in_place_t, Args&&... args) \
+            : sOperator(op), \
+              sData(std::forward<Args>(args)...), \
+              sEvent(nullptr), \
+              sMax(0), \
+              sDeadline(0), \
+              sFound(false) \
+            {  }
+        IocpParam() \
+            : sOperator(TQNone), \
+              sEvent(nullptr), \
+              sMax(0), \
+              sDeadline(0), \
+              sFound(false) \
+            {  }
         }PPARAM;    // Post Parameter
 
 public:
@@ -77,79 +110,92 @@ public:
 
     // 放入队列
     bool PushBack(const T& data)
+        { return Post(new IocpParam(TQPush,data)); }
+
+    // 放入队列，数据移动到队列中，不复制
+    bool PushBack(T&& data)
+        { return Post(new IocpParam(TQPush,std::move(data))); }
+
+    // 用参数直接构造数据并放入队列
+    template<typename... Args>
+    bool Emplace(Args&&... args)
+        { return Post(new IocpParam(TQPush,std::in_place,std::forward<Args>(args)...)); }
+
+    // 批量放入，整批只投递一次。元素被移动到队列中
+    template<typename Iter>
+    bool PushBulk(Iter first, Iter last)
         {
-        IocpParam* pParam = new IocpParam(TQPush,data);
-        if(m_lock)
+        IocpParam* pParam = new IocpParam();
+        pParam->sOperator = TQPushBulk;
+        pParam->sBulk.assign(std::make_move_iterator(first),std::make_move_iterator(last));
+        return Post(pParam);
+        }
+
+    bool PushBulk(std::vector<T>&& items)
+        {
+        IocpParam* pParam = new IocpParam();
+        pParam->sOperator = TQPushBulk;
+        pParam->sBulk = std::move(items);
+        return Post(pParam);
+        }
+
+    // 弹出，队列为空时返回 false
+    virtual bool PopFront(T& data)
+        { return PopFront(data,0); }
+
+    // 弹出，队列为空时最多等待 dwMilliseconds 毫秒（INFINITE 表示一直等待）
+    bool PopFront(T& data, DWORD dwMilliseconds)
+        {
+        IocpParam Param;
+        Param.sOperator = TQPop;
+        if(!Request(Param,dwMilliseconds))
             {
-            delete pParam;
             return false;
             }
-        bool ret = PostQueuedCompletionStatus(m_hIocp,sizeof(PPARAM),reinterpret_cast<ULONG_PTR>(pParam),NULL);
-        if(!ret)
+        if(Param.sFound)
             {
-            delete pParam;
+            data = std::move(Param.sData);
             }
-
-        return ret;
+        return Param.sFound;
         }
 
-    // 弹出
-    virtual bool PopFront(T& data)
+    // 批量弹出最多 max 个，追加到 out 末尾，返回弹出的个数。
+    // 队列为空时最多等待 dwMilliseconds 毫秒，有数据后立即返回
+    size_t PopBulk(std::vector<T>& out, size_t max, DWORD dwMilliseconds = 0)
         {
-        HANDLE hEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
-        IocpParam Param(TQPop,data,hEvent);
-
-        if(m_lock)
+        if(0 == max)
             {
-            if(hEvent)
-                {
-                CloseHandle(hEvent);
-                }
-            return false;
+            return 0;
             }
-
-        bool ret = PostQueuedCompletionStatus(m_hIocp,sizeof(PPARAM),reinterpret_cast<ULONG_PTR>(&Param),NULL);
-        if(!ret)
+        IocpParam Param;
+        Param.sOperator = TQPopBulk;
+        Param.sMax = max;
+        if(!Request(Param,dwMilliseconds))
             {
-            CloseHandle(hEvent);
-            return false;
+            return 0;
             }
-        ret = WaitForSingleObject(hEvent,INFINITE) == WAIT_OBJECT_0;
-        if(ret)
+        size_t count = Param.sBulk.size();
+        if(out.empty())
             {
-            data = Param.sData;
+            out = std::move(Param.sBulk);
             }
-
-        return ret;
+        else
+            {
+            out.insert(out.end(),std::make_move_iterator(Param.sBulk.begin()),std::make_move_iterator(Param.sBulk.end()));
+            }
+        return count;
         }
 
     // 大小
     size_t Size()
         {
-        HANDLE hEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
-        IocpParam Param(TQSize,T(),hEvent);
-        if(m_lock)
-            {
-            if(hEvent)
-                {
-                CloseHandle(hEvent);
-                return -1;
-                }
-            }
-
-        bool ret = PostQueuedCompletionStatus(m_hIocp,sizeof(PPARAM),reinterpret_cast<ULONG_PTR>(&Param),NULL);
-        if(!ret)
+        IocpParam Param;
+        Param.sOperator = TQSize;
+        if(!Request(Param,0))
             {
-            CloseHandle(hEvent);
             return -1;
             }
-        ret = WaitForSingleObject(hEvent,INFINITE) == WAIT_OBJECT_0;
-        if(ret)
-            {
-            return Param.sOperator;
-            }
-
-        return -1;
+        return Param.sOperator;
         }
 
     // 清理
@@ -171,6 +217,66 @@ public:
         }
 
 protected:
+    // 投递由队列线程释放的操作
+    bool Post(IocpParam* pParam)
+        {
+        if(m_lock)
+            {
+            delete pParam;
+            return false;
+            }
+        bool ret = PostQueuedCompletionStatus(m_hIocp,sizeof(PPARAM),reinterpret_cast<ULONG_PTR>(pParam),NULL);
+        if(!ret)
+            {
+            delete pParam;
+            }
+        return ret;
+        }
+
+    // 投递需要应答的操作并等待队列线程应答。
+    // Param 在栈上，队列线程最迟在截止时间到达时应答，所以这里总是可以无限等待
+    bool Request(IocpParam& Param, DWORD dwMilliseconds)
+        {
+        HANDLE hEvent = LocalEvent();
+        if(m_lock || !hEvent)
+            {
+            return false;
+            }
+        Param.sEvent = hEvent;
+        if(dwMilliseconds == INFINITE)
+            {
+            Param.sDeadline = ~0ULL;
+            }
+        else if(dwMilliseconds > 0)
+            {
+            Param.sDeadline = GetTickCount64() + dwMilliseconds;
+            }
+        if(!PostQueuedCompletionStatus(m_hIocp,sizeof(PPARAM),reinterpret_cast<ULONG_PTR>(&Param),NULL))
+            {
+            return false;
+            }
+        return WaitForSingleObject(hEvent,INFINITE) == WAIT_OBJECT_0;
+        }
+
+    // 每个线程一个自动重置的事件，等待应答时复用，不再每次调用都创建内核对象
+    static HANDLE LocalEvent()
+        {
+        struct Holder
+            {
+            HANDLE  m_hEvent;
+            Holder() : m_hEvent(CreateEvent(NULL,FALSE,FALSE,NULL)) {}
+            ~Holder()
+                {
+                if(m_hEvent)
+                    {
+                    CloseHandle(m_hEvent);
+                    }
+                }
+            };
+        thread_local Holder holder;
+        return holder.m_hEvent;
+        }
+
     // 线程入口
     static void ThreadEntry(void* arg)
         {
@@ -179,25 +285,105 @@ protected:
         _endthread();
         }
 
+    // 从队首取数据应答弹出操作，没有数据时返回 false
+    bool TakeFront(PPARAM* pParam)
+        {
+        if(m_lstData.empty())
+            {
+            return false;
+            }
+        if(TQPopBulk == pParam->sOperator)
+            {
+            size_t count = (std::min)(pParam->sMax,m_lstData.size());
+            pParam->sBulk.reserve(count);
+            for(size_t i = 0; i != count; ++i)
+                {
+                pParam->sBulk.push_back(std::move(m_lstData.front()));
+                m_lstData.pop_front();
+                }
+            }
+        else
+            {
+            pParam->sData = std::move(m_lstData.front());
+            m_lstData.pop_front();
+            }
+        pParam->sFound = true;
+        return true;
+        }
+
+    // 有新数据时按先后顺序应答等待中的弹出
+    void ServeWaiters()
+        {
+        while(!m_waiters.empty() && TakeFront(m_waiters.front()))
+            {
+            SetEvent(m_waiters.front()->sEvent);
+            m_waiters.pop_front();
+            }
+        }
+
+    // 应答已经超时的弹出
+    void ExpireWaiters()
+        {
+        ULONGLONG now = GetTickCount64();
+        for(typename std::list<PPARAM*>::iterator it = m_waiters.begin(); it != m_waiters.end();)
+            {
+            if((*it)->sDeadline <= now)
+                {
+                SetEvent((*it)->sEvent);
+                it = m_waiters.erase(it);
+                }
+            else
+                {
+                ++it;
+                }
+            }
+        }
+
+    // 距离最近的截止时间的毫秒数
+    DWORD NextTimeout() const
+        {
+        ULONGLONG deadline = ~0ULL;
+        for(typename std::list<PPARAM*>::const_iterator it = m_waiters.begin(); it != m_waiters.end(); ++it)
+            {
+            deadline = (std::min)(deadline,(*it)->sDeadline);
+            }
+        if(~0ULL == deadline)
+            {
+            return INFINITE;
+            }
+        ULONGLONG now = GetTickCount64();
+        return deadline > now ? static_cast<DWORD>(deadline - now) : 0;
+        }
+
     // 处理操作
     virtual void DealParam(PPARAM* pParam)
         {
         switch(pParam->sOperator)
             {
         case TQPush:
-            m_lstData.push_back(pParam->sData);
+            m_lstData.push_back(std::move(pParam->sData));
             delete pParam;
+            ServeWaiters();
             break;
-        case TQPop:
-            if(m_lstData.size() > 0)
+        case TQPushBulk:
+            for(size_t i = 0; i != pParam->sBulk.size(); ++i)
                 {
-                pParam->sData = m_lstData.front();
-                m_lstData.pop_front();
+                m_lstData.push_back(std::move(pParam->sBulk[i]));
                 }
-            if(pParam->sEvent)
+            delete pParam;
+            ServeWaiters();
+            break;
+        case TQPop:
+        case TQPopBulk:
+            // 前面还有等待者时排在后面，保证先来先得
+            if((m_waiters.empty() && TakeFront(pParam)) || (0 == pParam->sDeadline))
                 {
                 SetEvent(pParam->sEvent);
                 }
+            else
+                {
+                m_waiters.push_back(pParam);
+                }
             break;
         case TQSize:
             pParam->sOperator = m_lstData.size();
@@ -224,9 +410,18 @@ protected:
         ULONG_PTR ulComletionKey = 0;
         OVERLAPPED* pOverlapped = nullptr;
 
-        // 循环获取 I/O 操作
-        while(GetQueuedCompletionStatus(m_hIocp,&dwTransferred,&ulComletionKey,&pOverlapped,INFINITE))
+        // 循环获取 I/O 操作，有等待中的弹出时按最近的截止时间醒来
+        for(;;)
             {
+            if(!GetQueuedCompletionStatus(m_hIocp,&dwTransferred,&ulComletionKey,&pOverlapped,NextTimeout()))
+                {
+                if(WAIT_TIMEOUT == GetLastError())
+                    {
+                    ExpireWaiters();
+                    continue;
+                    }
+                break;
+                }
             if(!dwTransferred || !ulComletionKey)
                 {
                 std::cout << "thread is prepare to exit!" << std::endl;
@@ -235,6 +430,10 @@ protected:
 
             pParam = reinterpret_cast<PPARAM*>(ulComletionKey);
             DealParam(pParam);
+            if(!m_waiters.empty())
+                {
+                ExpireWaiters();
+                }
             }
 
         // double check
@@ -250,6 +449,13 @@ protected:
             DealParam(pParam);
             }
 
+        // 队列关闭，释放所有等待者
+        while(!m_waiters.empty())
+            {
+            SetEvent(m_waiters.front()->sEvent);
+            m_waiters.pop_front();
+            }
+
         HANDLE hTmp = m_hIocp;
         m_hIocp = nullptr;
         CloseHandle(hTmp);
@@ -257,6 +463,7 @@ protected:
 
 protected:
     std::list<T>        m_lstData;
+    std::list<PPARAM*>  m_waiters;  // 等待数据的弹出操作，只在队列线程上访问
     HANDLE              m_hIocp;
     HANDLE              m_hThread;
     std::atomic<bool>   m_lock;     // 队列正在析构
@@ -307,7 +514,7 @@ protected:
         bool ret = PostQueuedCompletionStatus( \
                 ThreadQueue<T>::m_hIocp, \
                 sizeof(typename ThreadQueue<T>::PPARAM), \
-                reinterpret_cast<ULONG_PTR>(&pParam), \
+                reinterpret_cast<ULONG_PTR>(pParam), \
                 nullptr);
         if(!ret)
             {
@@ -330,41 +537,23 @@ protected:
         return 0;
         }
 
-    // 处理操作
+    // 处理操作，弹出由回调处理，其余操作和普通队列相同
     virtual void DealParam(typename ThreadQueue<T>::PPARAM* pParam)
         {
-        switch(pParam->sOperator)
+        if(pParam->sOperator != ThreadQueue<T>::TQPop)
             {
-        case ThreadQueue<T>::TQPush:
-            ThreadQueue<T>::m_lstData.push_back(pParam->sData);
-            delete pParam;
-            break;
-        case ThreadQueue<T>::TQPop:
-            if(ThreadQueue<T>::m_lstData.size() > 0)
+            ThreadQueue<T>::DealParam(pParam);
+            return;
+            }
+        // 回调直接处理队首元素，返回 0 表示已经处理（可以移走数据），出队；否则保留到下一次
+        if(ThreadQueue<T>::m_lstData.size() > 0)
+            {
+            if(0 == (m_base->*m_callback)(ThreadQueue<T>::m_lstData.front()))
                 {
-                pParam->sData = ThreadQueue<T>::m_lstData.front();
-                if(0 == (m_base->*m_callback)(pParam->sData))
-                    {
-                    ThreadQueue<T>::m_lstData.pop_front();
-                    }
-                delete pParam;
-                break;
+                ThreadQueue<T>::m_lstData.pop_front();
                 }
-        case ThreadQueue<T>::TQSize:
-            pParam->sOperator = ThreadQueue<T>::m_lstData.size();
-            if(pParam->sEvent)
-                {
-                SetEvent(pParam->sEvent);
-                }
-            break;
-        case ThreadQueue<T>::TQClear:
-            ThreadQueue<T>::m_lstData.clear();
-            delete pParam;
-            break;
-        default:
-            std::cout << "unknown operator!" << std::endl;
-            break;
             }
+        delete pParam;
         }
 private:
     ThreadFuncBase*     m_base;
@@ -372,7 +561,4 @@ private:
     Thread              m_thread;
 };
 
-typedef SendQueue<std::vector<char>>::THREAD_CALLBACK    SEND_CALLBACK;
-
-
 #endif //IOCPANDTHREADPOOL_THREADQUEUE_H
@@ -0,0 +1,287 @@
+#ifndef IOCPANDTHREADPOOL_TRANSPORT_H
+#define IOCPANDTHREADPOOL_TRANSPORT_H
+
+
+#include <MSWSock.h>
+#include <afunix.h>
+
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+/*++
+    可替换的传输层
+        Endpoint 描述监听地址：TCP（AF_INET）、Unix 域套接字（AF_UNIX）、进程内内存通道。
+        AF_UNIX 和 TCP 走同一套 AcceptEx/WSARecv/WSASend 流程，只是地址族不同；
+        进程内通道完全不经过内核，读写直接在内存中完成，完成包通过 PostQueuedCompletionStatus 投递，
+        所以处理函数（RecvWorker、协程、发送队列）不需要任何修改。
+--*/
+
+
+
+// 端点类型
+enum EndpointType
+    {
+    EPInet,
+    EPUnix,
+    EPInProc
+    };
+
+
+class Endpoint
+{
+public:
+    Endpoint() \
+        : m_type(EPInet), \
+          m_addrLen(0) \
+        { memset(&m_addr,0,sizeof(m_addr)); }
+
+    // TCP
+    static Endpoint Inet(const std::string& ip, short port)
+        {
+        Endpoint ep;
+        sockaddr_in* pAddr = reinterpret_cast<sockaddr_in*>(&ep.m_addr);
+        pAddr->sin_family = AF_INET;
+        pAddr->sin_port = htons(port);
+        pAddr->sin_addr.s_addr = inet_addr(ip.c_str());
+        ep.m_addrLen = sizeof(sockaddr_in);
+        ep.m_name = ip + ":" + std::to_string(port);
+        return ep;
+        }
+
+    // Unix 域套接字，path 为套接字文件路径
+    static Endpoint Unix(const std::string& path)
+        {
+        Endpoint ep;
+        ep.m_type = EPUnix;
+        SOCKADDR_UN* pAddr = reinterpret_cast<SOCKADDR_UN*>(&ep.m_addr);
+        pAddr->sun_family = AF_UNIX;
+        strncpy(pAddr->sun_path,path.c_str(),sizeof(pAddr->sun_path) - 1);
+        ep.m_addrLen = sizeof(SOCKADDR_UN);
+        ep.m_name = path;
+        return ep;
+        }
+
+    // 进程内通道，name 在进程内唯一
+    static Endpoint InProc(const std::string& name)
+        {
+        Endpoint ep;
+        ep.m_type = EPInProc;
+        ep.m_name = name;
+        return ep;
+        }
+
+    int Type() const { return m_type; }
+    bool IsInProc() const { return EPInProc == m_type; }
+
+    // 地址族，进程内通道为 AF_UNSPEC
+    int Family() const
+        {
+        switch(m_type)
+            {
+        case EPInet:
+            return AF_INET;
+        case EPUnix:
+            return AF_UNIX;
+        default:
+            return AF_UNSPEC;
+            }
+        }
+
+    const sockaddr* Addr() const { return reinterpret_cast<const sockaddr*>(&m_addr); }
+    int AddrLen() const { return m_addrLen; }
+    const std::string& Name() const { return m_name; }
+
+private:
+    int                 m_type;
+    SOCKADDR_STORAGE    m_addr;
+    int                 m_addrLen;
+    std::string         m_name;
+};
+
+
+
+/*++
+    单向内存管道
+        写入立即完成；读取有数据时立即完成，没有数据时挂起，等写入时完成。
+        异步读取的完成包投递到读取方的完成端口，和真实套接字的完成包走同一套处理流程。
+        长度为 0 的异步读取和零字节 WSARecv 一样，只等待数据到达，不取走数据。
+--*/
+class InProcPipe
+{
+public:
+    InProcPipe() \
+        : m_head(0), \
+          m_closed(false) \
+        { memset(&m_pending,0,sizeof(m_pending)); }
+
+    // 异步读取，完成包投递到 hIocp。false 表示管道已经关闭且没有数据
+    bool ReadAsync(char* buffer, ULONG size, LPOVERLAPPED lpOverlapped, HANDLE hIocp, ULONG_PTR ulKey)
+        {
+        std::unique_lock<std::mutex> guard(m_lock);
+        if(Available() > 0 || m_closed)
+            {
+            DWORD dwBytes = Take(buffer,size);
+            guard.unlock();
+            PostQueuedCompletionStatus(hIocp,dwBytes,ulKey,lpOverlapped);
+            return true;
+            }
+        m_pending.m_buffer = buffer;
+        m_pending.m_size = size;
+        m_pending.m_overlapped = lpOverlapped;
+        m_pending.m_hIocp = hIocp;
+        m_pending.m_key = ulKey;
+        return true;
+        }
+
+    // 非阻塞读取。返回读取的字节数，0 表示已经关闭，-1 表示暂时没有数据
+    int TryRead(char* buffer, size_t size)
+        {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if(0 == Available())
+            {
+            return m_closed ? 0 : -1;
+            }
+        return static_cast<int>(Take(buffer,size));
+        }
+
+    // 阻塞读取。返回读取的字节数，0 表示已经关闭
+    int Read(char* buffer, size_t size)
+        {
+        std::unique_lock<std::mutex> guard(m_lock);
+        m_cond.wait(guard,[this]() { return Available() > 0 || m_closed; });
+        return static_cast<int>(Take(buffer,size));
+        }
+
+    // 写入，返回写入的字节数，-1 表示已经关闭
+    int Write(const char* data, size_t size)
+        {
+        std::unique_lock<std::mutex> guard(m_lock);
+        if(m_closed)
+            {
+            return -1;
+            }
+        m_data.insert(m_data.end(),data,data + size);
+        Wake(guard);
+        return static_cast<int>(size);
+        }
+
+    // 关闭，挂起的读取以 0 字节完成
+    void Close()
+        {
+        std::unique_lock<std::mutex> guard(m_lock);
+        m_closed = true;
+        Wake(guard);
+        }
+
+private:
+    // 完成挂起的读取并唤醒阻塞读取，会释放锁
+    void Wake(std::unique_lock<std::mutex>& guard)
+        {
+        Pending pending = m_pending;
+        DWORD dwBytes = 0;
+        if(pending.m_overlapped)
+            {
+            dwBytes = Take(pending.m_buffer,pending.m_size);
+            memset(&m_pending,0,sizeof(m_pending));
+            }
+        guard.unlock();
+        m_cond.notify_all();
+        if(pending.m_overlapped)
+            {
+            PostQueuedCompletionStatus(pending.m_hIocp,dwBytes,pending.m_key,pending.m_overlapped);
+            }
+        }
+
+    size_t Available() const
+        { return m_data.size() - m_head; }
+
+    // 取出数据，需要持有 m_lock
+    DWORD Take(char* buffer, size_t size)
+        {
+        size_t count = (std::min)(size,Available());
+        if(count)
+            {
+            memcpy(buffer,m_data.data() + m_head,count);
+            m_head += count;
+            }
+        // 读完或者已读部分过半时整理缓冲区
+        if(m_head == m_data.size())
+            {
+            m_data.clear();
+            m_head = 0;
+            }
+        else if(m_head > m_data.size() / 2)
+            {
+            m_data.erase(m_data.begin(),m_data.begin() + m_head);
+            m_head = 0;
+            }
+        return static_cast<DWORD>(count);
+        }
+
+private:
+    struct Pending
+        {
+        char*           m_buffer;
+        ULONG           m_size;
+        LPOVERLAPPED    m_overlapped;
+        HANDLE          m_hIocp;
+        ULONG_PTR       m_key;
+        };
+
+    std::mutex              m_lock;
+    std::condition_variable m_cond;
+    std::vector<char>       m_data;
+    size_t                  m_head;     // 读取位置
+    bool                    m_closed;
+    Pending                 m_pending;  // 挂起的异步读取，同一时刻最多一个
+};
+
+
+// 一条进程内连接，两个方向各一个管道
+struct InProcLink
+{
+    InProcPipe  m_toServer;
+    InProcPipe  m_toClient;
+
+    void Close()
+        {
+        m_toServer.Close();
+        m_toClient.Close();
+        }
+};
+typedef std::shared_ptr<InProcLink>     PTR_LINK;
+
+
+// 进程内连接的发起方，阻塞读写
+class InProcStream
+{
+public:
+    explicit InProcStream(const PTR_LINK& link) : m_link(link) {}
+    ~InProcStream() { Close(); }
+
+    // 返回值同 recv：>0 为字节数，0 表示对端关闭
+    int Read(void* buffer, size_t size)
+        { return m_link->m_toClient.Read(reinterpret_cast<char*>(buffer),size); }
+
+    // 返回写入的字节数，-1 表示已经关闭
+    int Write(const void* data, size_t size)
+        { return m_link->m_toServer.Write(reinterpret_cast<const char*>(data),size); }
+
+    void Close()
+        { m_link->Close(); }
+
+private:
+    PTR_LINK    m_link;
+};
+typedef std::shared_ptr<InProcStream>   PTR_INPROC_STREAM;
+
+
+#endif //IOCPANDTHREADPOOL_TRANSPORT_H